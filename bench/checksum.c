@@ -0,0 +1,105 @@
+/* Times the checks every uploaded block goes through on the server, the
+ * CRC-32C of the block, through store_checksum(), and the running SHA-256 of
+ * the file, against copying the block, which is the least any upload costs.
+ * Runs through a buffer in blocks, the way an upload arrives, as many times
+ * as it takes to pass a GiB.
+ *
+ *   bench/checksum [block KiB [buffer MiB]]   (1024, 64)
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "sha256.h"
+#include "server/store.h"
+#include "debug.h"
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Keeps the compiler from dropping the work being timed */
+static volatile uint32_t sink;
+
+static void report(const char *what, double bytes, double secs, double copy) {
+	printf("%-26s %8.2f GB/s   %5.2fx memcpy\n", what, bytes/secs/1e9, copy/secs);
+}
+
+int main(int argc, char **argv) {
+	size_t block = (argc > 1 ? strtoul(argv[1], NULL, 10) : 1024) << 10;
+	size_t size = (argc > 2 ? strtoul(argv[2], NULL, 10) : 64) << 20;
+	char dir[] = "/tmp/checksum.XXXXXX";
+	char *src = NULL, *dst = NULL;
+	store_t store;
+	store_file_t *file = NULL;
+	double start, copy, secs, bytes;
+	unsigned passes;
+	sha256_t hash;
+	uint8_t digest[SHA256_LEN];
+
+	check(block && block % STORE_GRANULE == 0 && size >= block && size % block == 0,
+			"Blocks must be whole granules of %u bytes, and fill the buffer.", STORE_GRANULE);
+	passes = ((1ULL<<30) + size - 1) / size;
+	bytes = (double)size * passes;
+
+	check_mem(src = malloc(size));
+	check_mem(dst = malloc(size));
+	for(size_t i=0; i<size; i++)
+		src[i] = rand();
+	memset(dst, 0, size);
+
+	/* An upload's file, held in memory so that nothing but the checksums
+	 * is timed */
+	check(mkdtemp(dir), "Couldn't make a spool directory.");
+	check_quiet(!store_init(&store, dir, 0, 1, size, size));
+	check(file = store_create(&store, size), "Couldn't make a file of %zu bytes.", size);
+
+	printf("%zu KiB blocks, through %zu MiB %u times\n", block >> 10, size >> 20, passes);
+
+#define TIME(var, stmt) \
+	start = now(); \
+	for(unsigned p=0; p<passes; p++) \
+		for(size_t off=0; off<size; off+=block) { stmt; } \
+	var = now() - start;
+
+	TIME(copy, memcpy(dst + off, src + off, block); sink += dst[off]);
+	report("memcpy", bytes, copy, copy);
+
+	TIME(secs, sink += crc32c(0, src + off, block));
+	report("crc32c", bytes, secs, copy);
+
+	TIME(secs, sink += store_checksum(file, src + off, block, off));
+	report("store_checksum", bytes, secs, copy);
+
+	sha256_init(&hash);
+	TIME(secs, sha256_update(&hash, src + off, block));
+	sha256_final(&hash, digest);
+	sink += digest[0];
+	report("sha256_update", bytes, secs, copy);
+
+	/* All of a block's checks, as client_take_block() has it */
+	sha256_init(&hash);
+	TIME(secs, sink += store_checksum(file, src + off, block, off);
+			sha256_update(&hash, src + off, block));
+	sha256_final(&hash, digest);
+	sink += digest[0];
+	report("store_checksum + sha256", bytes, secs, copy);
+#undef TIME
+
+	store_release(&store, file);
+	store_free(&store);
+	rmdir(dir);
+	free(src);
+	free(dst);
+	return 0;
+error:
+	free(src);
+	free(dst);
+	return 1;
+}
@@ -0,0 +1,618 @@
+/* Load driver for chat_server. Connects a crowd of clients, puts them all in
+ * one chat, and then either has one of them send timestamped messages that
+ * the server fans out to the rest, or upload a file that the rest download.
+ * Reports throughput, fanout latency and the bytes received per delivery,
+ * and with -P, the server's CPU time over the run, read from /proc.
+ *
+ *   bench/load [options] port
+ *     -c clients   receivers, besides the sender (100)
+ *     -m messages  chat messages to send (1000)
+ *     -s bytes     length of each message, 16 at least (64)
+ *     -r rate      messages per second, 0 for as fast as possible (1000)
+ *     -f MiB       upload a file of this size instead, to every receiver
+ *     -z           take the server's messages deflated
+ *     -l           speak the protocol from before the hello handshake and
+ *                  transfer ids, for older servers
+ *     -P pid       the server, to report its CPU time
+ *     -S pid       sent SIGUSR1 before and after the measured part of the
+ *                  run, for bench/syscount
+ *
+ * A single thread reads every connection; the sender writes from another,
+ * so that a server that blocks on writes to receivers can't deadlock it.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+#include "msg.h"
+#include "status.h"
+#include "debug.h"
+#include "crc32c.h"
+#include "sha256.h"
+
+/* Reads at least this much at a time */
+#define READ_SZ (1<<16)
+
+typedef struct _conn_t {
+	int fd;
+	char *buf;
+	size_t len, size;
+	z_stream inflate; /* For packed messages, with -z */
+	char *plain;
+	size_t plain_size;
+
+	uint16_t id; /* Once identified */
+	uint16_t chat_id; /* Once the chat started */
+	uint32_t chunk; /* Block size, from the server's hello */
+	uint16_t file_id; /* Of the upload, or the download */
+	uint64_t fsize, got; /* Of the download */
+	int known; /* Has its id */
+	int accepted; /* The upload may start; atomic */
+} conn_t;
+
+static struct {
+	int legacy, pack, rate, size;
+	unsigned int clients, messages;
+	unsigned long file_mb;
+	pid_t server, syscount;
+} opt = {.clients = 100, .messages = 1000, .size = 64, .rate = 1000};
+
+static conn_t *conns; /* The sender first */
+static unsigned int num_conns;
+static int epoll_fd;
+
+/* Updated by the reader thread */
+static unsigned long identified, joined, delivered, downloaded;
+static unsigned long received; /* Bytes, off the sockets */
+static uint32_t *lats; /* Fanout latencies, in us */
+
+/* The file the sender uploads, to prove it has it with */
+static const char *upload;
+static uint64_t upload_size;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+/* utime + stime of a process, in seconds */
+static double cpu_time(pid_t pid) {
+	unsigned long utime = 0, stime = 0;
+	char path[64], stat[1024], *p;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if(!(f = fopen(path, "r")))
+		return 0;
+	if(fgets(stat, sizeof(stat), f) && (p = strrchr(stat, ')')))
+		sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+				&utime, &stime);
+	fclose(f);
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* Messages start with the time they were sent, in hex: old servers take
+ * them as strings, and cut them short at the first NUL */
+#define STAMP_LEN 16
+
+static void stamp_put(char *text, uint64_t ns) {
+	static const char hex[] = "0123456789abcdef";
+	for(int i=STAMP_LEN-1; i>=0; i--, ns >>= 4)
+		text[i] = hex[ns & 0xf];
+}
+
+static uint64_t stamp_get(const char *text) {
+	uint64_t ns = 0;
+	for(int i=0; i<STAMP_LEN; i++)
+		ns = ns << 4 | (text[i] <= '9' ? text[i] - '0' : text[i] - 'a' + 10);
+	return ns;
+}
+
+static void mark(void) {
+	if(opt.syscount)
+		kill(opt.syscount, SIGUSR1);
+}
+
+static void write_all(int fd, const void *buf, size_t len) {
+	while(len) {
+		ssize_t ret = write(fd, buf, len);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0) {
+			log_err("Write error: %s", strerror(errno));
+			exit(1);
+		}
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+}
+
+#define SEND(conn, type, ...) do { \
+		const msg_MSG_##type##_t _m = {__VA_ARGS__}; \
+		char *_buf = malloc(msg_size_MSG_##type(&_m)); \
+		if(!_buf) abort(); \
+		write_all((conn)->fd, _buf, msg_encode_MSG_##type(_buf, &_m) - _buf); \
+		free(_buf); \
+	} while(0)
+
+/*
+ * The protocol before the handshake, where it differs
+ */
+
+static void legacy_send_file(conn_t *conn, uint16_t chat_id, uint32_t fsize, const char *fname) {
+	uint16_t len = strlen(fname);
+	char buf[512], *p = buf;
+
+	p = msg_put_u8(p, MSG_send_file);
+	p = msg_put_u16(p, chat_id);
+	p = msg_put_u32(p, fsize);
+	p = msg_put_u16(p, len);
+	memcpy(p, fname, len), p += len;
+	p = msg_put_u16(p, 0);
+	p = msg_put_u16(p, 0);
+	write_all(conn->fd, buf, p - buf);
+}
+
+static void legacy_file_part(conn_t *conn, const char *data, uint16_t len) {
+	char head[3];
+
+	msg_put_u8(head, MSG_file_part);
+	msg_put_u16(head + 1, len);
+	write_all(conn->fd, head, sizeof(head));
+	write_all(conn->fd, data, len);
+}
+
+static void legacy_recv_file(conn_t *conn, uint16_t chat_id, uint32_t file_id) {
+	char buf[7];
+
+	msg_put_u8(buf, MSG_recv_file);
+	msg_put_u16(buf + 1, chat_id);
+	msg_put_u32(buf + 3, file_id);
+	write_all(conn->fd, buf, sizeof(buf));
+}
+
+/* Length of the frame at the start of buf, as msg_frame_len() */
+static ssize_t frame_len(const char *buf, size_t len) {
+	size_t need;
+
+	if(!opt.legacy || !len)
+		return msg_frame_len(buf, len);
+
+	switch(*buf) {
+		case MSG_send_file:
+			if(len < 9)
+				return 0;
+			need = 13 + msg_get_u16(buf + 7);
+			break;
+		case MSG_file_part:
+			if(len < 3)
+				return 0;
+			need = 3 + msg_get_u16(buf + 1);
+			break;
+		default:
+			return msg_frame_len(buf, len);
+	}
+	return len < need ? 0 : (ssize_t)need;
+}
+
+/*
+ * Reading
+ */
+
+static void handle_frames(conn_t *conn, const char *buf, size_t len);
+
+static void handle_packed(conn_t *conn, const char *data, uint32_t len) {
+	z_stream *z = &conn->inflate;
+	size_t out = 0;
+
+	z->next_in = (Bytef *)data;
+	z->avail_in = len;
+	do {
+		if(out == conn->plain_size) {
+			conn->plain_size = conn->plain_size ? 2*conn->plain_size : 1<<16;
+			if(!(conn->plain = realloc(conn->plain, conn->plain_size)))
+				abort();
+		}
+		z->next_out = (Bytef *)conn->plain + out;
+		z->avail_out = conn->plain_size - out;
+		if(inflate(z, Z_SYNC_FLUSH) == Z_DATA_ERROR) {
+			log_err("Bad packed message.");
+			exit(1);
+		}
+		out = conn->plain_size - z->avail_out;
+	} while(z->avail_in || !z->avail_out);
+
+	handle_frames(conn, conn->plain, out);
+}
+
+static void handle_download(conn_t *conn, size_t len) {
+	conn->got += len;
+	if(conn->got == conn->fsize)
+		__atomic_add_fetch(&downloaded, 1, __ATOMIC_RELEASE);
+}
+
+static void handle_frame(conn_t *conn, const char *buf, size_t len) {
+	switch(msg_get_type(*buf)) {
+		case MSG_hello: {
+			msg_MSG_hello_t m = {0};
+			msg_decode_MSG_hello(buf, len, &m);
+			conn->chunk = m.chunk;
+			break;
+		}
+		case MSG_packed: {
+			msg_MSG_packed_t m = {0};
+			msg_decode_MSG_packed(buf, len, &m);
+			handle_packed(conn, m.data, m.len);
+			break;
+		}
+		case MSG_users: {
+			msg_MSG_users_t m = {0};
+			msg_decode_MSG_users(buf, len, &m);
+			handle_frames(conn, m.data, m.len);
+			break;
+		}
+		case MSG_user_update: {
+			msg_MSG_user_update_t m = {0};
+			msg_decode_MSG_user_update(buf, len, &m);
+			if(m.status == US_IDENTIFY && !conn->known) {
+				conn->id = m.user_id;
+				conn->known = 1;
+				__atomic_add_fetch(&identified, 1, __ATOMIC_RELEASE);
+			}
+			break;
+		}
+		case MSG_start_chat: {
+			msg_MSG_start_chat_t m = {0};
+			msg_decode_MSG_start_chat(buf, len, &m);
+			conn->chat_id = m.chat_id;
+			__atomic_add_fetch(&joined, 1, __ATOMIC_RELEASE);
+			break;
+		}
+		case MSG_msg: {
+			msg_MSG_msg_t m = {0};
+			uint64_t sent;
+			unsigned long n;
+
+			msg_decode_MSG_msg(buf, len, &m);
+			if(conn == conns || m.len < STAMP_LEN)
+				break;
+			sent = stamp_get(m.msg);
+			n = __atomic_fetch_add(&delivered, 1, __ATOMIC_RELEASE);
+			if(n < (unsigned long)opt.messages*opt.clients)
+				lats[n] = (now_ns() - sent) / 1000;
+			break;
+		}
+		case MSG_send_file: {
+			if(opt.legacy) {
+				conn->fsize = msg_get_u32(buf + 3);
+				conn->file_id = msg_get_u16(buf + 9 + msg_get_u16(buf + 7));
+				legacy_recv_file(conn, conn->chat_id, conn->file_id);
+			} else {
+				msg_MSG_send_file_t m = {0};
+				msg_decode_MSG_send_file(buf, len, &m);
+				conn->fsize = m.fsize;
+				conn->file_id = m.file_id;
+				SEND(conn, recv_file, .chat_id = m.chat_id, .file_id = m.file_id,
+						.transfer_id = 1);
+			}
+			break;
+		}
+		case MSG_file_status: {
+			msg_MSG_file_status_t m = {0};
+			msg_decode_MSG_file_status(buf, len, &m);
+			conn->file_id = m.file_id;
+			__atomic_store_n(&conn->accepted, 1, __ATOMIC_RELEASE);
+			break;
+		}
+		case MSG_file_proof: {
+			msg_MSG_file_proof_t m = {0};
+			uint8_t answer[SHA256_LEN];
+			sha256_t hash;
+
+			msg_decode_MSG_file_proof(buf, len, &m);
+			sha256_init(&hash);
+			sha256_update(&hash, m.data, m.len);
+			for(unsigned i=0; i<MSG_PROOF_BLOCKS && m.len == MSG_PROOF_NONCE; i++) {
+				uint64_t off = msg_proof_offset(m.data, i, upload_size);
+				sha256_update(&hash, upload + off,
+						upload_size - off < FILE_BLOCK_SZ ? upload_size - off : FILE_BLOCK_SZ);
+			}
+			sha256_final(&hash, answer);
+			SEND(conn, file_proof, .transfer_id = m.transfer_id, .len = SHA256_LEN,
+					.data = (const char *)answer);
+			break;
+		}
+		case MSG_file_part:
+			if(opt.legacy)
+				handle_download(conn, len - 3);
+			else {
+				msg_MSG_file_part_t m = {0};
+				msg_decode_MSG_file_part(buf, len, &m);
+				handle_download(conn, m.len);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+/* Handles the whole frames in buf; returns how much of it that was */
+static size_t handle_frames_len(conn_t *conn, const char *buf, size_t len) {
+	size_t done = 0;
+	ssize_t n;
+
+	while((n = frame_len(buf + done, len - done)) > 0) {
+		handle_frame(conn, buf + done, n);
+		done += n;
+	}
+	if(n < 0) {
+		log_err("Invalid message type %hhu from the server.", buf[done]);
+		exit(1);
+	}
+	return done;
+}
+
+/* For the frames in a packed or users message, which must all be whole */
+static void handle_frames(conn_t *conn, const char *buf, size_t len) {
+	if(handle_frames_len(conn, buf, len) != len) {
+		log_err("Cut off message from the server.");
+		exit(1);
+	}
+}
+
+static void conn_read(conn_t *conn) {
+	ssize_t ret;
+	size_t done;
+
+	if(conn->size - conn->len < READ_SZ) {
+		conn->size = 2*conn->size + READ_SZ;
+		if(!(conn->buf = realloc(conn->buf, conn->size)))
+			abort();
+	}
+
+	ret = read(conn->fd, conn->buf + conn->len, conn->size - conn->len);
+	if(ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if(ret <= 0) {
+		log_err("Disconnected by the server: %s", ret ? strerror(errno) : "EOF");
+		exit(1);
+	}
+	conn->len += ret;
+	__atomic_add_fetch(&received, ret, __ATOMIC_RELAXED);
+
+	done = handle_frames_len(conn, conn->buf, conn->len);
+	memmove(conn->buf, conn->buf + done, conn->len - done);
+	conn->len -= done;
+}
+
+static void *reader(void *arg) {
+	struct epoll_event evs[64];
+	(void)arg;
+
+	for(;;) {
+		int n = epoll_wait(epoll_fd, evs, 64, -1);
+		for(int i=0; i<n; i++)
+			conn_read(evs[i].data.ptr);
+	}
+	return NULL;
+}
+
+/*
+ * Driving
+ */
+
+static void conn_open(conn_t *conn, int port) {
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	struct epoll_event ev = {.events = EPOLLIN};
+	int one = 1;
+
+	memset(conn, 0, sizeof(*conn));
+	check((conn->fd = socket(AF_INET, SOCK_STREAM, 0)) != -1, "socket: %s", strerror(errno));
+	check(!connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)),
+			"Couldn't connect to port %d: %s", port, strerror(errno));
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if(opt.pack)
+		check(inflateInit2(&conn->inflate, -15) == Z_OK, "inflateInit2 failed");
+
+	ev.data.ptr = conn;
+	check(!epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev), "epoll_ctl: %s", strerror(errno));
+
+	if(!opt.legacy)
+		SEND(conn, hello, .version = MSG_VERSION, .chunk = MSG_MAX_CHUNK,
+				.codecs = opt.pack ? MSG_CODEC_BIT(MSG_CODEC_DEFLATE) : 0);
+	return;
+error:
+	exit(1);
+}
+
+/* Waits for the reader to count up to want, for up to secs */
+static int wait_for(unsigned long *count, unsigned long want, int secs) {
+	uint64_t end = now_ns() + (uint64_t)secs*1000000000;
+
+	while(__atomic_load_n(count, __ATOMIC_ACQUIRE) < want) {
+		if(now_ns() > end)
+			return 1;
+		usleep(1000);
+	}
+	return 0;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void run_chat(conn_t *sender) {
+	unsigned long want = (unsigned long)opt.messages*opt.clients, got;
+	double cpu = cpu_time(opt.server), secs;
+	unsigned long bytes = __atomic_load_n(&received, __ATOMIC_RELAXED);
+	char *text;
+	uint64_t start;
+
+	check_mem(text = malloc(opt.size));
+	memset(text, 'x', opt.size);
+	check_mem(lats = malloc(sizeof(*lats)*(want ? want : 1)));
+
+	mark();
+	start = now_ns();
+	for(unsigned int i=0; i<opt.messages; i++) {
+		uint64_t at = start + (opt.rate ? (uint64_t)i*1000000000/opt.rate : 0), now;
+		while(opt.rate && (now = now_ns()) < at) {
+			struct timespec ts = {.tv_sec = (at - now)/1000000000,
+				.tv_nsec = (at - now)%1000000000};
+			nanosleep(&ts, NULL);
+		}
+		stamp_put(text, now_ns());
+		SEND(sender, msg, .chat_id = sender->chat_id, .len = opt.size, .msg = text);
+	}
+	if(wait_for(&delivered, want, 60))
+		log_warn("Only %lu of %lu messages arrived.", delivered, want);
+	secs = (now_ns() - start)/1e9;
+	mark();
+	cpu = cpu_time(opt.server) - cpu;
+	bytes = __atomic_load_n(&received, __ATOMIC_RELAXED) - bytes;
+
+	got = __atomic_load_n(&delivered, __ATOMIC_ACQUIRE);
+	got = got < want ? got : want;
+	qsort(lats, got, sizeof(*lats), cmp_u32);
+
+	printf("%u messages of %d B to %u clients in %.2f s: %.0f deliveries/s\n",
+			opt.messages, opt.size, opt.clients, secs, got/secs);
+	if(got)
+		printf("fanout latency: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+				lats[got/2]/1e3, lats[(size_t)(got*0.99)]/1e3, lats[got-1]/1e3);
+	printf("received: %.1f B/delivery\n", got ? (double)bytes/got : 0);
+	if(opt.server)
+		printf("server cpu: %.2f s, %.2f us/delivery\n", cpu, got ? cpu*1e6/got : 0);
+
+	free(text);
+	return;
+error:
+	exit(1);
+}
+
+static void run_file(conn_t *sender) {
+	uint64_t fsize = (uint64_t)opt.file_mb << 20, off = 0, start;
+	double cpu = cpu_time(opt.server), secs, gb;
+	uint8_t digest[SHA256_LEN];
+	sha256_t hash;
+	char *data;
+
+	/* Incompressible, and new to the server's store */
+	check_mem(data = malloc(fsize));
+	for(uint64_t i=0; i<fsize/sizeof(uint32_t); i++)
+		((uint32_t *)data)[i] = rand() ^ ((uint32_t)rand() << 16);
+	sha256_init(&hash);
+	sha256_update(&hash, data, fsize);
+	sha256_final(&hash, digest);
+	upload = data;
+	upload_size = fsize;
+
+	mark();
+	start = now_ns();
+	if(opt.legacy) {
+		check(fsize <= UINT32_MAX, "-l takes files below 4 GiB.");
+		legacy_send_file(sender, sender->chat_id, fsize, "load.bin");
+		for(; off < fsize; off += FILE_BLOCK_SZ)
+			legacy_file_part(sender, data + off,
+					fsize - off < FILE_BLOCK_SZ ? fsize - off : FILE_BLOCK_SZ);
+	} else {
+		SEND(sender, send_file, .chat_id = sender->chat_id, .fsize = fsize,
+				.len = strlen("load.bin"), .fname = "load.bin", .transfer_id = 1,
+				.hash_len = SHA256_LEN, .hash = (const char *)digest);
+		while(!__atomic_load_n(&sender->accepted, __ATOMIC_ACQUIRE))
+			usleep(1000);
+		for(; off < fsize; off += sender->chunk) {
+			uint32_t len = fsize - off < sender->chunk ? fsize - off : sender->chunk;
+			SEND(sender, file_part, .transfer_id = 1, .offset = off,
+					.crc = crc32c(0, data + off, len), .len = len, .blob = data + off);
+		}
+	}
+	if(wait_for(&downloaded, opt.clients, 300))
+		log_warn("Only %lu of %u downloads finished.", downloaded, opt.clients);
+	secs = (now_ns() - start)/1e9;
+	mark();
+	cpu = cpu_time(opt.server) - cpu;
+
+	gb = (double)fsize*opt.clients / (1<<30);
+	printf("%lu MiB to %u clients in %.2f s: %.0f MiB/s delivered\n",
+			opt.file_mb, opt.clients, secs, gb*1024/secs);
+	if(opt.server)
+		printf("server cpu: %.2f s, %.3f s/GiB delivered\n", cpu, cpu/gb);
+
+	free(data);
+	return;
+error:
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	uint16_t *ids;
+	pthread_t thread;
+	int c, port;
+
+	while((c = getopt(argc, argv, "c:m:s:r:f:zlP:S:")) != -1) {
+		switch(c) {
+			case 'c': opt.clients = atoi(optarg); break;
+			case 'm': opt.messages = atoi(optarg); break;
+			case 's': opt.size = atoi(optarg); break;
+			case 'r': opt.rate = atoi(optarg); break;
+			case 'f': opt.file_mb = strtoul(optarg, NULL, 10); break;
+			case 'z': opt.pack = 1; break;
+			case 'l': opt.legacy = 1; break;
+			case 'P': opt.server = atoi(optarg); break;
+			case 'S': opt.syscount = atoi(optarg); break;
+			default: goto usage;
+		}
+	}
+	if(optind != argc - 1 || !opt.clients || opt.size < STAMP_LEN || opt.size > UINT16_MAX
+			|| (opt.legacy && opt.pack))
+		goto usage;
+	port = atoi(argv[optind]);
+
+	num_conns = opt.clients + 1;
+	check_mem(conns = calloc(num_conns, sizeof(*conns)));
+	check_mem(ids = malloc(sizeof(*ids)*opt.clients));
+	check((epoll_fd = epoll_create1(0)) != -1, "epoll_create1: %s", strerror(errno));
+	signal(SIGPIPE, SIG_IGN);
+
+	check(!pthread_create(&thread, NULL, reader, NULL), "Couldn't start the reader.");
+	/* One at a time, so that the server has greeted each before the next */
+	for(unsigned int i=0; i<num_conns; i++) {
+		conn_open(&conns[i], port);
+		check(!wait_for(&identified, i + 1, 10), "Client %u wasn't identified.", i);
+	}
+
+	/* One chat with everyone */
+	for(unsigned int i=0; i<opt.clients; i++)
+		ids[i] = conns[i + 1].id;
+	SEND(&conns[0], start_chat, .num_ids = opt.clients, .ids.host = ids);
+	check(!wait_for(&joined, num_conns, 30), "Only %lu of %u clients joined the chat.",
+			joined, num_conns);
+
+	if(opt.file_mb)
+		run_file(&conns[0]);
+	else
+		run_chat(&conns[0]);
+
+	return 0;
+usage:
+	fprintf(stderr, "usage: %s [-c clients] [-m messages] [-s bytes] [-r rate] "
+			"[-f MiB] [-z] [-l] [-P pid] [-S pid] port\n", argv[0]);
+error:
+	return 1;
+}
@@ -0,0 +1,239 @@
+/* Times the generated msg_encode_MSG_*() and msg_decode_MSG_*() against the
+ * varargs codec they replaced, which walks the message's format string for
+ * each field: a copy of it is kept below, as it was, but for u64 fields.
+ *
+ *   bench/msg_codec [iterations]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "msg.h"
+
+/*
+ * The varargs codec
+ */
+
+static size_t old_vpack(char *buf, const char *fmt, va_list ap) {
+	size_t prev_arg = 0;
+	char *out = buf;
+
+	while(*fmt) {
+		if(!strncmp(fmt, "%hhu", strlen("%hhu"))) {
+			uint8_t arg = va_arg(ap, unsigned int);
+			memcpy(out, &arg, sizeof(arg)), out += sizeof(arg);
+			fmt += strlen("%hhu");
+			prev_arg = arg;
+		} else if(!strncmp(fmt, "%hu", strlen("%hu"))) {
+			uint16_t arg = va_arg(ap, unsigned int), n_arg = htons(arg);
+			memcpy(out, &n_arg, sizeof(n_arg)), out += sizeof(n_arg);
+			fmt += strlen("%hu");
+			prev_arg = arg;
+		} else if(!strncmp(fmt, "%u", strlen("%u"))) {
+			uint32_t arg = va_arg(ap, unsigned int), n_arg = htonl(arg);
+			memcpy(out, &n_arg, sizeof(n_arg)), out += sizeof(n_arg);
+			fmt += strlen("%u");
+			prev_arg = arg;
+		} else if(!strncmp(fmt, MSG_FMT_u64, strlen(MSG_FMT_u64))) {
+			uint64_t arg = htobe64(va_arg(ap, uint64_t));
+			memcpy(out, &arg, sizeof(arg)), out += sizeof(arg);
+			fmt += strlen(MSG_FMT_u64);
+		} else if(!strncmp(fmt, "%p", strlen("%p"))) {
+			const char *arg = va_arg(ap, const char *);
+			memcpy(out, arg, prev_arg), out += prev_arg;
+			fmt += strlen("%p");
+		} else if(!strncmp(fmt, "%k", strlen("%k"))) {
+			const uint16_t *arg = va_arg(ap, const uint16_t *);
+			for(size_t i=0; i<prev_arg; i++) {
+				uint16_t n_arg = htons(arg[i]);
+				memcpy(out, &n_arg, sizeof(n_arg)), out += sizeof(n_arg);
+			}
+			fmt += strlen("%k");
+		} else
+			abort();
+	}
+
+	return out - buf;
+}
+
+static size_t old_pack(char *buf, const char *fmt, ...) {
+	va_list ap;
+	size_t len;
+
+	va_start(ap, fmt);
+	len = old_vpack(buf, fmt, ap);
+	va_end(ap);
+
+	return len;
+}
+
+static void old_unpack(const char *buf, const char *fmt, ...) {
+	size_t prev_arg = 0;
+	va_list ap;
+
+	va_start(ap, fmt);
+	while(*fmt) {
+		if(!strncmp(fmt, "%hhu", strlen("%hhu"))) {
+			uint8_t *arg = va_arg(ap, uint8_t *);
+			memcpy(arg, buf, sizeof(*arg)), buf += sizeof(*arg);
+			fmt += strlen("%hhu");
+			prev_arg = *arg;
+		} else if(!strncmp(fmt, "%hu", strlen("%hu"))) {
+			uint16_t *arg = va_arg(ap, uint16_t *);
+			memcpy(arg, buf, sizeof(*arg)), buf += sizeof(*arg);
+			*arg = ntohs(*arg);
+			fmt += strlen("%hu");
+			prev_arg = *arg;
+		} else if(!strncmp(fmt, "%u", strlen("%u"))) {
+			uint32_t *arg = va_arg(ap, uint32_t *);
+			memcpy(arg, buf, sizeof(*arg)), buf += sizeof(*arg);
+			*arg = ntohl(*arg);
+			fmt += strlen("%u");
+			prev_arg = *arg;
+		} else if(!strncmp(fmt, MSG_FMT_u64, strlen(MSG_FMT_u64))) {
+			uint64_t *arg = va_arg(ap, uint64_t *);
+			memcpy(arg, buf, sizeof(*arg)), buf += sizeof(*arg);
+			*arg = be64toh(*arg);
+			fmt += strlen(MSG_FMT_u64);
+		} else if(!strncmp(fmt, "%p", strlen("%p"))) {
+			char **arg = va_arg(ap, char **);
+			*arg = realloc(*arg, prev_arg+1);
+			memcpy(*arg, buf, prev_arg), buf += prev_arg;
+			fmt += strlen("%p");
+		} else if(!strncmp(fmt, "%k", strlen("%k"))) {
+			uint16_t **arg = va_arg(ap, uint16_t **);
+			*arg = realloc(*arg, prev_arg*2+1);
+			memcpy(*arg, buf, prev_arg*2), buf += prev_arg*2;
+			for(size_t i=0; i<prev_arg; i++)
+				(*arg)[i] = ntohs((*arg)[i]);
+			fmt += strlen("%k");
+		} else
+			abort();
+	}
+	va_end(ap);
+}
+
+/* Decoding skips the type, which the receiver has read already */
+#define OLD_RECV(type) (msg_format_send_##type + strlen("%hhu"))
+
+/*
+ * Timing
+ */
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Keeps the compiler from dropping the work being timed */
+static volatile size_t sink;
+
+static size_t sum_ids(const uint16_t *ids, size_t num) {
+	size_t sum = 0;
+	for(size_t i=0; i<num; i++)
+		sum += ids[i];
+	return sum;
+}
+
+static size_t sum_wire_ids(msg_ids_t ids, size_t num) {
+	size_t sum = 0;
+	for(size_t i=0; i<num; i++)
+		sum += msg_ids_get(ids, i);
+	return sum;
+}
+
+static void report(const char *what, unsigned long num, double old, double gen) {
+	printf("%-22s %8.1f %8.1f   %5.1fx\n", what, old*1e9/num, gen*1e9/num, old/gen);
+}
+
+int main(int argc, char **argv) {
+	unsigned long num = argc > 1 ? strtoul(argv[1], NULL, 10) : 5000000;
+	static char buf[1<<12];
+	char text[64], fname[32], hash[32];
+	uint16_t ids[16];
+	double start, old, gen;
+	size_t len;
+
+	memset(text, 'x', sizeof(text));
+	memset(fname, 'f', sizeof(fname));
+	memset(hash, 'h', sizeof(hash));
+	for(size_t i=0; i<sizeof(ids)/sizeof(*ids); i++)
+		ids[i] = i;
+
+	const msg_MSG_msg_t msg = {.chat_id = 1, .sender_id = 2,
+		.len = sizeof(text), .msg = text};
+	const msg_MSG_start_chat_t chat = {.chat_id = 1,
+		.num_ids = sizeof(ids)/sizeof(*ids), .ids.host = ids};
+	const msg_MSG_send_file_t file = {.chat_id = 1, .fsize = 1<<30,
+		.len = sizeof(fname), .fname = fname, .file_id = 3, .sender_id = 2,
+		.transfer_id = 4, .hash_len = sizeof(hash), .hash = hash, .codecs = 0};
+
+	printf("%-22s %8s %8s   %6s\n", "ns per message", "varargs", "typed", "");
+
+	/* Encoding */
+#define TIME(var, stmt) \
+	start = now(); \
+	for(unsigned long i=0; i<num; i++) { stmt; } \
+	var = now() - start;
+
+	TIME(old, sink += old_pack(buf, msg_format_send_MSG_msg, MSG_msg,
+				msg.chat_id, msg.sender_id, msg.len, msg.msg));
+	TIME(gen, sink += msg_encode_MSG_msg(buf, &msg) - buf);
+	report("encode msg", num, old, gen);
+
+	TIME(old, sink += old_pack(buf, msg_format_send_MSG_start_chat, MSG_start_chat,
+				chat.chat_id, chat.num_ids, ids));
+	TIME(gen, sink += msg_encode_MSG_start_chat(buf, &chat) - buf);
+	report("encode start_chat", num, old, gen);
+
+	TIME(old, sink += old_pack(buf, msg_format_send_MSG_send_file, MSG_send_file,
+				file.chat_id, file.fsize, file.len, file.fname, file.file_id,
+				file.sender_id, file.transfer_id, file.hash_len, file.hash, file.codecs));
+	TIME(gen, sink += msg_encode_MSG_send_file(buf, &file) - buf);
+	report("encode send_file", num, old, gen);
+
+	/* Decoding, of what was encoded above; payloads are read once either way */
+	{
+		msg_MSG_msg_t m;
+		char *p = NULL;
+
+		len = msg_encode_MSG_msg(buf, &msg) - buf;
+		TIME(old, old_unpack(buf + 1, OLD_RECV(MSG_msg), &m.chat_id, &m.sender_id,
+					&m.len, &p); sink += m.len + p[m.len-1]);
+		TIME(gen, msg_decode_MSG_msg(buf, len, &m); sink += m.len + m.msg[m.len-1]);
+		report("decode msg", num, old, gen);
+		free(p);
+	}
+	{
+		msg_MSG_start_chat_t m;
+		uint16_t *p = NULL;
+
+		len = msg_encode_MSG_start_chat(buf, &chat) - buf;
+		TIME(old, old_unpack(buf + 1, OLD_RECV(MSG_start_chat), &m.chat_id,
+					&m.num_ids, &p); sink += sum_ids(p, m.num_ids));
+		TIME(gen, msg_decode_MSG_start_chat(buf, len, &m);
+				sink += sum_wire_ids(m.ids, m.num_ids));
+		report("decode start_chat", num, old, gen);
+		free(p);
+	}
+	{
+		msg_MSG_send_file_t m;
+		char *name = NULL, *digest = NULL;
+
+		len = msg_encode_MSG_send_file(buf, &file) - buf;
+		TIME(old, old_unpack(buf + 1, OLD_RECV(MSG_send_file), &m.chat_id, &m.fsize,
+					&m.len, &name, &m.file_id, &m.sender_id, &m.transfer_id,
+					&m.hash_len, &digest, &m.codecs); sink += m.fsize + name[0] + digest[0]);
+		TIME(gen, msg_decode_MSG_send_file(buf, len, &m);
+				sink += m.fsize + m.fname[0] + m.hash[0]);
+		report("decode send_file", num, old, gen);
+		free(name);
+		free(digest);
+	}
+#undef TIME
+
+	return 0;
+}
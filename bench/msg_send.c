@@ -0,0 +1,82 @@
+/* Times msg_send() of chat messages over a unix socket, drained by a child
+ * process, and counts the write syscalls it takes per message.
+ *
+ *   bench/msg_send [messages] [length]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "msg.h"
+#include "debug.h"
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Write syscalls made by this process so far */
+static unsigned long syscw(void) {
+	unsigned long n = 0;
+	char line[128];
+	FILE *f = fopen("/proc/self/io", "r");
+
+	while(f && fgets(line, sizeof(line), f)) {
+		if(sscanf(line, "syscw: %lu", &n) == 1)
+			break;
+	}
+	if(f)
+		fclose(f);
+	return n;
+}
+
+static void drain(int fd) {
+	char buf[1<<16];
+	while(read(fd, buf, sizeof(buf)) > 0);
+}
+
+int main(int argc, char **argv) {
+	unsigned long num = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	uint16_t len = argc > 2 ? (uint16_t)atoi(argv[2]) : 64;
+	unsigned long calls;
+	double start, secs;
+	int fds[2], status;
+	char *text;
+	pid_t pid;
+
+	check_mem(text = malloc(len + 1));
+	memset(text, 'x', len);
+	check(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds), "socketpair: %s", strerror(errno));
+
+	check((pid = fork()) != -1, "fork: %s", strerror(errno));
+	if(!pid) {
+		close(fds[0]);
+		drain(fds[1]);
+		_exit(0);
+	}
+	close(fds[1]);
+
+	calls = syscw();
+	start = now();
+	for(unsigned long i=0; i<num; i++)
+		check_quiet(!msg_send(fds[0], MSG_msg, 1, 2, len, text));
+	secs = now() - start;
+	calls = syscw() - calls;
+
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+
+	printf("%lu messages of %hu bytes: %.0f msgs/s, %.2f write syscalls/msg\n",
+			num, len, num / secs, (double)calls / num);
+
+	free(text);
+	return 0;
+error:
+	return 1;
+}
@@ -0,0 +1,142 @@
+/* Counts the syscalls a command and all its threads and children make, like
+ * `strace -c -f`. SIGUSR1 prints the counts so far and starts afresh, so
+ * that a load driver can mark out the part of a run it measures.
+ *
+ *   bench/syscount command [args...]
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "debug.h"
+
+#define MAX_NR 1024
+
+#define N(name) [SYS_##name] = #name,
+static const char * const names[MAX_NR] = {
+	N(read) N(write) N(readv) N(writev) N(pread64) N(pwrite64)
+	N(recvfrom) N(sendto) N(recvmsg) N(sendmsg) N(sendfile) N(splice)
+	N(poll) N(ppoll) N(select) N(pselect6) N(epoll_wait) N(epoll_pwait)
+	N(epoll_ctl) N(io_uring_enter) N(io_uring_setup) N(eventfd2)
+	N(accept) N(accept4) N(close) N(openat) N(fstat) N(newfstatat) N(lseek)
+	N(fcntl) N(ioctl) N(access) N(getpid) N(wait4)
+	N(ftruncate) N(fallocate) N(unlink) N(unlinkat) N(renameat) N(getrandom)
+	N(futex) N(mmap) N(munmap) N(mprotect) N(madvise) N(brk) N(clone) N(clone3)
+	N(rt_sigaction) N(rt_sigprocmask) N(nanosleep) N(clock_nanosleep)
+	N(clock_gettime) N(sched_yield) N(execve) N(exit) N(exit_group)
+};
+#undef N
+
+static unsigned long counts[MAX_NR], other;
+static volatile sig_atomic_t dump;
+
+static void on_usr1(int sig) {
+	(void)sig;
+	dump = 1;
+}
+
+static void print_counts(void) {
+	unsigned long total = other;
+
+	for(int nr=0; nr<MAX_NR; nr++)
+		total += counts[nr];
+
+	fprintf(stderr, "%10s  %s\n", "calls", "syscall");
+	for(int nr=0; nr<MAX_NR; nr++) {
+		if(!counts[nr])
+			continue;
+		if(names[nr])
+			fprintf(stderr, "%10lu  %s\n", counts[nr], names[nr]);
+		else
+			fprintf(stderr, "%10lu  #%d\n", counts[nr], nr);
+	}
+	if(other)
+		fprintf(stderr, "%10lu  (out of range)\n", other);
+	fprintf(stderr, "%10lu  total\n", total);
+
+	memset(counts, 0, sizeof(counts));
+	other = 0;
+}
+
+int main(int argc, char **argv) {
+	struct sigaction sa = {.sa_handler = on_usr1};
+	int status, ret = 1;
+	pid_t child, pid;
+
+	check(argc > 1, "usage: %s command [args...]", argv[0]);
+
+	check((child = fork()) != -1, "fork: %s", strerror(errno));
+	if(!child) {
+		ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+		raise(SIGSTOP);
+		execvp(argv[1], argv + 1);
+		log_err("Couldn't run %s: %s", argv[1], strerror(errno));
+		_exit(127);
+	}
+
+	/* Without SA_RESTART, so that it interrupts waitpid() */
+	sigaction(SIGUSR1, &sa, NULL);
+	signal(SIGINT, SIG_IGN);
+
+	check(waitpid(child, &status, 0) == child && WIFSTOPPED(status),
+			"%s didn't start", argv[1]);
+	check(!ptrace(PTRACE_SETOPTIONS, child, NULL, PTRACE_O_TRACESYSGOOD
+				| PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK
+				| PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL), "PTRACE_SETOPTIONS: %s", strerror(errno));
+	ptrace(PTRACE_SYSCALL, child, NULL, 0);
+
+	for(;;) {
+		int sig = 0;
+
+		if(dump) {
+			dump = 0;
+			print_counts();
+		}
+
+		pid = waitpid(-1, &status, __WALL);
+		if(pid < 0) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+
+		if(WIFEXITED(status) || WIFSIGNALED(status)) {
+			if(pid == child)
+				ret = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+			continue;
+		}
+		if(!WIFSTOPPED(status))
+			continue;
+
+		if(WSTOPSIG(status) == (SIGTRAP|0x80)) {
+			struct __ptrace_syscall_info info;
+			if(ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0
+					&& info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+				if(info.entry.nr < MAX_NR)
+					counts[info.entry.nr]++;
+				else
+					other++;
+			}
+		} else if(status >> 16) {
+			/* A ptrace event: the new thread or child is traced already */
+		} else if(WSTOPSIG(status) != SIGSTOP) {
+			/* Pass signals on, but for the stops that start new tracees */
+			sig = WSTOPSIG(status);
+		}
+
+		ptrace(PTRACE_SYSCALL, pid, NULL, sig);
+	}
+
+	print_counts();
+	return ret;
+error:
+	return 1;
+}
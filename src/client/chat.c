@@ -101,12 +101,19 @@ int chat_send_msg(client_t *client, chat_t *chat, const char *msg) {
 }
 
 int chat_add_msg(client_t *client, chat_t *chat, const char *msg, uint16_t from_id) {
+	assert(msg);
+
+	return chat_add_msg_len(client, chat, msg, strlen(msg), from_id);
+}
+
+/* msg need not be null-terminated */
+int chat_add_msg_len(client_t *client, chat_t *chat, const char *msg, uint16_t len, uint16_t from_id) {
 	assert(client);
 	assert(chat);
 	assert(msg);
 
 	chat_row_t new;
-	const void *start;
+	char *start;
 	user_t *from = user_get(client, from_id);
 
 	/* TODO: validate */
@@ -116,8 +123,10 @@ int chat_add_msg(client_t *client, chat_t *chat, const char *msg, uint16_t from_
 	new.from = from_id;
 
 	new.msg.num_lines = 0;
-	new.msg.len = strlen(msg);
-	check_quiet(start = vector_add(&chat->chars, msg, new.msg.len+1));
+	new.msg.len = len;
+	check_quiet(start = vector_add(&chat->chars, NULL, new.msg.len+1));
+	memcpy(start, msg, len);
+	start[len] = '\0';
 	new.msg.start = vector_indexof(&chat->chars, start);
 	check_quiet(vector_add(&chat->rows, &new, 1));
 
@@ -45,6 +45,7 @@ void chat_del(struct _client_t *client, chat_t *chat);
 chat_t *chat_get(struct _client_t *client, uint16_t id);
 
 int chat_add_msg(struct _client_t *client, chat_t *chat, const char *msg, uint16_t from);
+int chat_add_msg_len(struct _client_t *client, chat_t *chat, const char *msg, uint16_t len, uint16_t from);
 int chat_add_file(struct _client_t *client, chat_t *chat, size_t index, uint16_t from_id);
 
 int chat_send_msg(struct _client_t *client, chat_t *chat, const char *msg);
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <jansson.h>
@@ -15,16 +16,27 @@
 #include "msg_handlers.h"
 #include "transfer.h"
 #include "file.h"
+#include "crc32c.h"
 #include "macros.h"
 
 static void *client_net_thread(void *c);
-int client_connect(client_t *client, const char *hostname, unsigned int port);
+int client_connect(client_t *client, const char *hostname, unsigned int port, int pack);
 
-#define X(name,fmt,fmt_comment) msg_handle_##name,
+/* Bytes read from the socket at a time */
+#define CLIENT_RECV_SZ (1<<16)
+
+/* Unsent bytes the socket may hold: file blocks wait for the buffer to
+ * drain rather than pile up in it ahead of chat messages */
+#define CLIENT_OUT_INFLIGHT (1<<16)
+
+/* Deflate level for uploads: the fastest, so as not to hold them up */
+#define CLIENT_COMPRESS 1
+
+#define X(name,fields) msg_handle_##name,
 msg_handler_t msg_handlers[MSG_NUM_TYPES]= { MSG_TYPES };
 #undef X
 
-int client_init(client_t *client, const char *host, unsigned int port) {
+int client_init(client_t *client, const char *host, unsigned int port, int pack) {
 	assert(client);
 
 	check(!client_ui_init(&client->ui, client),
@@ -34,13 +46,14 @@ int client_init(client_t *client, const char *host, unsigned int port) {
 	vector_init(&client->chats, sizeof(chat_t));
 	vector_init(&client->names, 256*sizeof(char));
 	sp_vector_init(&client->transfers, sizeof(transfer_t));
+	buffer_init(&client->in);
+	codec_init(&client->codec, CLIENT_COMPRESS);
 	check(!pthread_mutex_init(&client->users_mutex, NULL),
 			"Couldn't create mutex");
 
-	check(!client_connect(client, host, port),
+	check(!client_connect(client, host, port, pack),
 			"Couldn't connect to %s:%d", host, port);
 
-	client->transferring = 0;
 	client->name_index = -1;
 	client->status = US_ONLINE;
 
@@ -71,7 +84,7 @@ void client_sigusr1_handler(__attribute__((unused)) int num) {
 	return;
 }
 
-int client_connect(client_t *client, const char *hostname, unsigned int port) {
+int client_connect(client_t *client, const char *hostname, unsigned int port, int pack) {
 	assert(client);
 	assert(hostname);
 	assert(port);
@@ -79,6 +92,7 @@ int client_connect(client_t *client, const char *hostname, unsigned int port) {
 	struct hostent *server;
 	struct sockaddr_in server_addr;
 	struct timeval tv;
+	int inflight = CLIENT_OUT_INFLIGHT;
 
 	client->socket = socket(AF_INET, SOCK_STREAM, 0);
 	check(client->socket != -1, "Couldn't create socket: %s", strerror(errno));
@@ -86,6 +100,7 @@ int client_connect(client_t *client, const char *hostname, unsigned int port) {
 	tv.tv_sec = 0;
 	tv.tv_usec = 1000;
 	setsockopt(client->socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(struct timeval));
+	setsockopt(client->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &inflight, sizeof(inflight));
 
 	server = gethostbyname(hostname);
 	check(server, "Couldn't find host '%s': %s", hostname, strerror(errno));
@@ -99,6 +114,12 @@ int client_connect(client_t *client, const char *hostname, unsigned int port) {
 			sizeof(server_addr)),
 			"Couldn't connect to '%s': %s", hostname, strerror(errno));
 
+	/* Any block size the protocol allows will do: the server picks. Its
+	 * other messages only come deflated if asked for */
+	client->chunk = 0;
+	check_quiet(!msg_send(client->socket, MSG_hello, (uint16_t)MSG_VERSION,
+				(uint32_t)MSG_MAX_CHUNK, (uint8_t)(pack ? MSG_CODEC_BIT(MSG_CODEC_DEFLATE) : 0)));
+
 	client->running = 1;
 	struct sigaction usr1handler = {.sa_handler=client_sigusr1_handler};
 	sigaction(SIGUSR1, &usr1handler, 0);
@@ -126,6 +147,10 @@ int client_disconnect(client_t *client) {
 	vector_free(&client->users);
 	vector_free(&client->chats);
 	vector_free(&client->names);
+	buffer_free(&client->in);
+	codec_free(&client->codec);
+	if(client->unpacking)
+		codec_stream_free(&client->unpack);
 
 	return 0;
 }
@@ -140,21 +165,18 @@ int client_upload_file(client_t *client, chat_t *chat, const char *fname) {
 	const char *err;
 	size_t index;
 
-	if(client->transferring) {
-		chat_add_msg(client, chat, "Already transferring file!", 0);
-		return 1;
-	}
-
 	if((err = transfer_begin_upload(&transfer, chat, fname))) {
 		chat_add_msg(client, chat, err, 0);
 		return 1;
 	}
 
-	client->transferring = 1;
-	msg_send(client->socket, MSG_send_file, chat->id, transfer.fsize,
-			(uint16_t)strlen(fname), fname, (uint16_t)0, (uint16_t)0);
+	/* Compressed where it pays, block by block */
+	transfer.codecs = MSG_CODECS;
 
+	/* The transfer's index doubles as its id on the wire. The net thread
+	 * hashes the file, then offers it to the server */
 	check_quiet(index = sp_vector_add(&client->transfers, &transfer));
+	check(index <= UINT16_MAX, "Too many file transfers.");
 
 	/* r used because fchat_file_i is unsigned, and error code is -1 */
 	check(chat_add_file(client, chat, index, 0) != -1,
@@ -175,8 +197,8 @@ int client_download_file(client_t *client, chat_file_t *file, const char *name)
 	transfer_t *transfer = sp_vector_get(&client->transfers, file->id);
 	const char *err;
 
-	if(client->transferring) {
-		chat_add_msg(client, chat, "Already transferring file!", 0);
+	if(transfer->fd != -1) {
+		chat_add_msg(client, chat, "Already downloading this file!", 0);
 		return 1;
 	}
 
@@ -185,9 +207,11 @@ int client_download_file(client_t *client, chat_file_t *file, const char *name)
 		return 1;
 	}
 
-	client->transferring = 1;
-	client->download_file_id = file->id;
-	msg_send(client->socket, MSG_recv_file, chat->id, transfer->file_id); 
+	/* Only the part of the file we don't have yet, compressed if the
+	 * server can */
+	msg_send(client->socket, MSG_recv_file, chat->id, (uint32_t)transfer->file_id,
+			(uint16_t)file->id, transfer->offset, (uint64_t)0,
+			(uint8_t)(transfer->codecs & MSG_CODECS));
 	return 0;
 }
 
@@ -199,24 +223,53 @@ int client_send_file_part(client_t *client) {
 		if(!transfer->sending)
 			continue;
 
+		/* Offered once hashed, a piece at a time between reads */
+		if(transfer->hashed < transfer->fsize) {
+			if(transfer_hash_upload(transfer))
+				check_quiet(!msg_send(client->socket, MSG_send_file, transfer->chat_id,
+							transfer->fsize, (uint16_t)strlen(transfer->fname), transfer->fname,
+							(uint16_t)0, (uint16_t)0,
+							(uint16_t)sp_vector_indexof(&client->transfers, transfer),
+							(uint8_t)SHA256_LEN, (const char *)transfer->hash, transfer->codecs));
+			continue;
+		}
+
+		/* Uploads start once the server has acknowledged them, which it
+		 * only does after the handshake */
+		if(!transfer->file_id)
+			continue;
+		assert(client->chunk);
+
 		/* SLIGHTLY HACKY:
 		 * Don't remove uploads when they're done, because the chat UI still needs
 		 * the transfer record to print completion/filename/etc
 		 */
-		if(transfer->offset == transfer->fsize)
+		uint64_t offset = __atomic_load_n(&transfer->offset, __ATOMIC_RELAXED);
+		if(offset == transfer->fsize)
 			continue;
 
-		/* Send a chunk of the file */
-		uint16_t len = min(FILE_BLOCK_SZ, transfer->fsize - transfer->offset);
-		char *buf = file_map(transfer->fd, PROT_READ, transfer->offset, len);
-		check_quiet(!msg_send(client->socket, MSG_file_part, len, buf));
+		/* Send a chunk of the file, with its checksum, and compressed if
+		 * it looks like it will shrink, and does */
+		uint32_t len = min(client->chunk, transfer->fsize - offset), wire_len = len;
+		char *buf = file_map(transfer->fd, PROT_READ, offset, len);
+		const char *wire = buf;
+		uint8_t codec = MSG_CODEC_RAW;
+		if((transfer->codecs & MSG_CODEC_BIT(MSG_CODEC_DEFLATE)) && codec_worth_it(buf, len)) {
+			size_t packed = codec_compress(&client->codec, buf, len);
+			if(packed) {
+				wire = client->codec.out;
+				wire_len = packed;
+				codec = MSG_CODEC_DEFLATE;
+			}
+		}
+		check_quiet(!msg_send(client->socket, MSG_file_part,
+					(uint16_t)sp_vector_indexof(&client->transfers, transfer),
+					offset, crc32c(0, buf, len), codec, wire_len, wire));
 		file_unmap(buf, len);
 
-		transfer->offset += len;
-		assert(transfer->offset <= transfer->fsize);
-
-		if(transfer->offset == transfer->fsize)
-			client->transferring = 0;
+		/* Unless the server has sent the upload back meanwhile */
+		__atomic_compare_exchange_n(&transfer->offset, &offset, offset + len, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED);
 	}
 
 	return 0;
@@ -274,13 +327,9 @@ transfer_t *client_get_transfer(client_t *client, uint16_t id) {
 	assert(client);
 	assert(id);
 
-	transfer_t *transfer;
-	sp_vector_foreach(&client->transfers, transfer) {
-		if(transfer->file_id == id)
-			return transfer;
-	}
-
-	return NULL;
+	if(id > client->transfers.largest_id)
+		return NULL;
+	return sp_vector_get(&client->transfers, id);
 }
 
 int client_send_name(client_t *client, const char *name) {
@@ -292,22 +341,95 @@ int client_send_name(client_t *client, const char *name) {
 			(uint8_t)strlen(name), name);
 }
 
+/* Handles a run of whole messages carried by another one, none of them
+ * packed, and all of type only unless it is MSG_invalid; the users lock is
+ * held already */
+int client_handle_run(client_t *client, const char *buf, size_t len, msg_type_t only) {
+	assert(client);
+	assert(buf || !len);
+
+	size_t off = 0;
+	ssize_t frame_len;
+
+	while(off < len) {
+		const char *frame = buf + off;
+
+		check((frame_len = msg_frame_len(frame, len - off)) > 0 && *frame != MSG_packed
+				&& (only == MSG_invalid || *frame == only), "Bad message run from server.");
+		client->frame = frame;
+		client->frame_len = frame_len;
+		check_warn(!msg_handle(msg_get_type(*frame), client),
+				"Message handling error (type %hhu)", *frame);
+		off += frame_len;
+	}
+
+	return 0;
+error:
+	return 1;
+}
+
+/* Handles the messages a packed message inflates to */
+int client_unpack(client_t *client, const char *buf, size_t len) {
+	assert(client);
+	assert(client->unpacking);
+
+	codec_stream_t *unpack = &client->unpack;
+	int err;
+
+	check(!codec_stream_write(unpack, buf, len), "Couldn't inflate messages from server.");
+	err = client_handle_run(client, unpack->out, unpack->out_len, MSG_invalid);
+	unpack->out_len = 0;
+
+	return err;
+error:
+	unpack->out_len = 0;
+	return 1;
+}
+
+/* Handle every complete message in the receive buffer */
+static int client_parse(client_t *client) {
+	assert(client);
+
+	buffer_t *in = &client->in;
+	ssize_t len;
+
+	while((len = msg_frame_len(buffer_data(in), buffer_len(in))) > 0) {
+		const char *frame = buffer_data(in);
+
+		client->frame = frame;
+		client->frame_len = len;
+		pthread_mutex_lock(&client->users_mutex);
+		check_warn(!msg_handle(msg_get_type(*frame), client),
+				"Message handling error (type %hhu)", *frame);
+		pthread_mutex_unlock(&client->users_mutex);
+		client->frame = NULL;
+
+		buffer_consume(in, len);
+	}
+
+	check(len == 0, "Invalid message code '%hhu'", *buffer_data(in));
+
+	return 0;
+error:
+	return 1;
+}
+
 static void *client_net_thread(void *c) {
 	client_t *client = c;
 
 	while(client->running) {
-		uint8_t type;
-		int r = read(client->socket, &type, 1);
+		char *dst;
+		check_mem(dst = buffer_reserve(&client->in, CLIENT_RECV_SZ));
+
+		ssize_t r = recv(client->socket, dst, CLIENT_RECV_SZ, 0);
 		if(r == 0) {
 			/* Client closed, just exit for now */
 			/*client->running = 0;*/
 			log_info("Server closed...");
 			break;
 		} else if(r > 0){
-			pthread_mutex_lock(&client->users_mutex);
-			check_warn(!msg_handle(msg_get_type(type), client),
-					"Message handling error (type %u)", type);
-		pthread_mutex_unlock(&client->users_mutex);
+			buffer_commit(&client->in, r);
+			check_quiet(!client_parse(client));
 		} else {
 			switch(errno) {
 				case EAGAIN:
@@ -328,23 +450,40 @@ error:
 /* TODO: grep for mutex use, add assertions */
 /* TODO: longjmp error handling */
 
+static void client_usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [options] [host [port]]\n"
+			"  -z   ask for the server's chat and presence messages deflated\n",
+			name);
+}
+
 int main(int argc, char **argv) {
 	client_t client;
-	long int port;
-	const char *host;
+	long int port = 1024;
+	const char *host = "localhost";
+	int pack = 0, opt;
 
-	if(argc >= 3) {
-		check_warn(argc == 3, "Excess arguments ignored");
-		check((port = strtol(argv[2], NULL, 10)) != LONG_MIN,
-				"Invalid port number '%s'", argv[1]);
-	} else
-		port = 1024;
+	while((opt = getopt(argc, argv, "zh")) != -1) switch(opt) {
+		case 'z':
+			pack = 1;
+			break;
+		case 'h':
+		default:
+			client_usage(argv[0]);
+			return opt != 'h';
+	}
 
-	host = argc >= 2 ? argv[1] : "localhost";
+	if(optind < argc)
+		host = argv[optind];
+	if(optind + 1 < argc) {
+		check_warn(optind + 2 == argc, "Excess arguments ignored");
+		check((port = strtol(argv[optind + 1], NULL, 10)) != LONG_MIN,
+				"Invalid port number '%s'", argv[optind + 1]);
+	}
 
 	log_info("Connecting to %s:%ld", host, port);
 
-	check_quiet(!client_init(&client, host, port));
+	check_quiet(!client_init(&client, host, port, pack));
 	client_ui_run(&client.ui, &client);
 	client_disconnect(&client);
 	client_ui_free(&client.ui);
@@ -6,9 +6,12 @@
 #include "client_ui.h"
 #include "vector.h"
 #include "sp_vector.h"
+#include "buffer.h"
 #include "macros.h"
 #include "status.h"
 #include "transfer.h"
+#include "codec.h"
+#include "msg.h"
 
 typedef struct _client_t {
 	client_ui_t ui;
@@ -21,17 +24,33 @@ typedef struct _client_t {
 	vector_t names;
 	sp_vector_t transfers;
 
+	/* Received data, and the message being handled within it */
+	buffer_t in;
+	const char *frame;
+	size_t frame_len;
+
 	unsigned int name_index;
 	user_status_t status;
 	uint16_t id;
-
-	/* File transfer: still hacky */
-	uint16_t download_file_id, transferring;
+	/* File block size agreed with the server; 0 until it answers hello */
+	uint32_t chunk;
+	/* Compresses uploads and decompresses downloads, on the net thread */
+	codec_t codec;
+	/* Inflates the server's packed messages, if agreed in the handshake */
+	codec_stream_t unpack;
+	int unpacking;
 } client_t;
 
+/* Decodes the message being handled into a msg_<type>_t view, whose
+ * variable length fields point into the receive buffer */
+#define client_view(client, type, m) \
+	msg_decode_##type((client)->frame, (client)->frame_len, (m))
+
 int client_upload_file(client_t *client, chat_t *chat, const char *fname);
 int client_download_file(client_t *client, chat_file_t *file, const char *name);
 int client_send_file_part(client_t *client);
+int client_handle_run(client_t *client, const char *buf, size_t len, msg_type_t only);
+int client_unpack(client_t *client, const char *buf, size_t len);
 int client_disconnect(client_t *client);
 int client_set_status(client_t *client, user_status_t status);
 int client_send_name(client_t *client, const char *name);
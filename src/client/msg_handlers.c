@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <signal.h>
 #include <unistd.h>
 
@@ -7,39 +8,44 @@
 #include "user.h"
 #include "transfer.h"
 #include "file.h"
-
-char *buf = NULL;
+#include "crc32c.h"
+#include "codec.h"
 
 int msg_handle_start_chat(client_t *client) {
 	assert(client);
 
-	uint16_t chat_id, num_ids, *client_ids;
+	msg_MSG_start_chat_t m;
+	uint16_t *client_ids = NULL;
 
-	check_quiet(!msg_recv(client->socket, MSG_start_chat, &chat_id, &num_ids, &buf));
-	client_ids = (uint16_t*)buf;
+	check_quiet(client_view(client, MSG_start_chat, &m));
+	check(m.num_ids > 0, "Can't start a chat with no participants.");
 
-	check(num_ids > 0, "Can't start a chat with no participants.");
+	check_mem(client_ids = malloc(m.num_ids*sizeof(*client_ids)));
+	msg_ids_copy(client_ids, m.ids, m.num_ids);
 
-	check(!chat_add(client, chat_id, client_ids, num_ids),
+	check(!chat_add(client, m.chat_id, client_ids, m.num_ids),
 			"Couldn't start a chat.");
 
+	free(client_ids);
+
 	return 0;
 error:
+	free(client_ids);
 	return 1;
 }
 
 int msg_handle_leave_chat(client_t *client) {
 	assert(client);
 
-	uint16_t chat_id, client_id;
+	msg_MSG_leave_chat_t m;
 	chat_t *chat;
 
-	check_quiet(!msg_recv(client->socket, MSG_leave_chat, &chat_id, &client_id));
+	check_quiet(client_view(client, MSG_leave_chat, &m));
 
-	log_info("Got leave chat message: %hu", client_id);
+	log_info("Got leave chat message: %hu", m.user_id);
 
-	chat = chat_get(client, chat_id);
-	chat_leave(client, chat, client_id);
+	check_quiet(chat = chat_get(client, m.chat_id));
+	chat_leave(client, chat, m.user_id);
 
 	return 0;
 error:
@@ -50,16 +56,22 @@ int msg_handle_send_file(struct _client_t *client) {
 	assert(client);
 
 	transfer_t transfer = {.sending = 0, .fd = -1, .offset = 0};
-	uint16_t len;
+	msg_MSG_send_file_t m;
 	chat_t *chat;
 	size_t index;
 
-	check_quiet(!msg_recv(client->socket, MSG_send_file,
-				&transfer.chat_id, &transfer.fsize, &len, &buf, &transfer.file_id, &transfer.sender_id));
-	buf[len] = 0;
-	check_quiet(chat = chat_get(client, transfer.chat_id));
-	check_quiet(transfer.file_id);
-	transfer.fname = strdup(buf);
+	check_quiet(client_view(client, MSG_send_file, &m));
+	check_quiet(chat = chat_get(client, m.chat_id));
+	check_quiet(m.file_id);
+	check(m.hash_len == SHA256_LEN, "File %hu from server has no hash.", m.file_id);
+
+	memcpy(transfer.hash, m.hash, SHA256_LEN);
+	transfer.chat_id = m.chat_id;
+	transfer.fsize = m.fsize;
+	transfer.file_id = m.file_id;
+	transfer.sender_id = m.sender_id;
+	transfer.codecs = m.codecs;
+	check_mem(transfer.fname = strndup(m.fname, m.len));
 
 	check_quiet(index = sp_vector_add(&client->transfers, &transfer));
 
@@ -71,26 +83,142 @@ error:
 	return 1;
 }
 
+/* Stops writing a download, and tells the chat it was shared in why, if
+ * it went wrong */
+static void msg_end_download(client_t *client, transfer_t *transfer, const char *why) {
+	assert(client);
+	assert(transfer);
+
+	const char *err = transfer_end_download(transfer);
+	if(!why)
+		why = err;
+
+	chat_t *chat = chat_get(client, transfer->chat_id);
+	if(why && chat) {
+		char buf[strlen("Download of '': ")+strlen(transfer->fname)+strlen(why)+1];
+		sprintf(buf, "Download of '%s': %s", transfer->fname, why);
+		chat_add_msg(client, chat, buf, 0);
+	}
+}
+
+/* Each block is checked on its way in, once decompressed, and the whole
+ * file once it is all there. A damaged block isn't written, so downloading
+ * the file again carries on from it */
 int msg_handle_file_part(client_t *client) {
 	assert(client);
 
-	uint16_t len;
-	uint16_t file_id = client->download_file_id; /* FIXME */
+	msg_MSG_file_part_t m;
 	transfer_t *transfer;
+	ssize_t len;
+
+	check_quiet(client_view(client, MSG_file_part, &m));
+	check(m.transfer_id && (transfer = client_get_transfer(client, m.transfer_id))
+			&& !transfer->sending,
+			"Unknown transfer %hu from server.", m.transfer_id);
+
+	/* Given up on after a damaged block; the rest of it is still coming */
+	if(transfer->fd == -1)
+		return 0;
+
+	check(m.offset == transfer->offset, "Bad block from server.");
+
+	if(m.codec != MSG_CODEC_RAW) {
+		check(m.codec == MSG_CODEC_DEFLATE && (transfer->codecs & MSG_CODEC_BIT(m.codec)),
+				"Block in codec %hhu from server, which wasn't asked for.", m.codec);
+		len = codec_decompress(&client->codec, m.blob, m.len,
+				min(client->chunk, transfer->fsize - transfer->offset));
+		if(len < 0) {
+			msg_end_download(client, transfer, "damaged on the way; download it again to fetch the rest.");
+			return 0;
+		}
+		m.blob = client->codec.out;
+		m.len = len;
+	}
+	check(m.len <= transfer->fsize - transfer->offset, "Bad block from server.");
 
-	check_quiet(!msg_recv(client->socket, MSG_file_part, &len, &buf));
-	check_quiet(transfer = client_get_transfer(client, file_id));
+	if(crc32c(0, m.blob, m.len) != m.crc) {
+		msg_end_download(client, transfer, "damaged on the way; download it again to fetch the rest.");
+		return 0;
+	}
 
-	void *file = file_map(transfer->fd, PROT_WRITE, transfer->offset, len);
-	memcpy(file, buf, len);
-	file_unmap(file, len);
+	check_quiet(!file_write(transfer->fd, m.blob, m.len, transfer->offset));
+	sha256_update(&transfer->check, m.blob, m.len);
 
-	transfer->offset += len;
+	transfer->offset += m.len;
 	assert(transfer->offset <= transfer->fsize);
 
-	if(transfer->offset == transfer->fsize) {
-		close(transfer->fd);
-		client->transferring = 0;
+	if(transfer->offset == transfer->fsize)
+		msg_end_download(client, transfer, NULL);
+
+	return 0;
+error:
+	return 1;
+}
+
+/* The server has taken on one of our uploads: the file's id lets it be
+ * resumed, and the offset is where the server wants it to carry on from,
+ * which is further back if a block was damaged on the way */
+int msg_handle_file_status(client_t *client) {
+	assert(client);
+
+	msg_MSG_file_status_t m;
+	transfer_t *transfer;
+
+	check_quiet(client_view(client, MSG_file_status, &m));
+	check(m.transfer_id && (transfer = client_get_transfer(client, m.transfer_id))
+			&& transfer->sending,
+			"Unknown upload %hu from server.", m.transfer_id);
+	check(m.file_id && m.offset <= transfer->fsize, "Bad file status from server.");
+
+	transfer->file_id = m.file_id;
+	__atomic_store_n(&transfer->offset, m.offset, __ATOMIC_RELAXED);
+
+	return 0;
+error:
+	return 1;
+}
+
+/* The server has a new upload prove it has the content it gave the hash
+ * of, before it is shared */
+int msg_handle_file_proof(client_t *client) {
+	assert(client);
+
+	msg_MSG_file_proof_t m;
+	transfer_t *transfer;
+	uint8_t answer[SHA256_LEN];
+
+	check_quiet(client_view(client, MSG_file_proof, &m));
+	check(m.transfer_id && (transfer = client_get_transfer(client, m.transfer_id))
+			&& transfer->sending && !transfer->file_id,
+			"Unknown upload %hu from server.", m.transfer_id);
+	check(m.len == MSG_PROOF_NONCE, "Bad proof nonce from server.");
+
+	transfer_proof(transfer, m.data, answer);
+
+	return msg_send(client->socket, MSG_file_proof, m.transfer_id,
+			(uint8_t)SHA256_LEN, (const char *)answer);
+error:
+	return 1;
+}
+
+int msg_handle_hello(client_t *client) {
+	assert(client);
+
+	msg_MSG_hello_t m;
+
+	check_quiet(client_view(client, MSG_hello, &m));
+	check(m.version == MSG_VERSION, "Server speaks protocol version %hu.", m.version);
+	check(m.chunk >= FILE_BLOCK_SZ && m.chunk <= MSG_MAX_CHUNK && m.chunk % FILE_BLOCK_SZ == 0,
+			"Bad file block size %u from server.", m.chunk);
+
+	client->chunk = m.chunk;
+
+	/* The server's messages come packed from here on */
+	if(m.codecs) {
+		check(m.codecs == MSG_CODEC_BIT(MSG_CODEC_DEFLATE) && !client->unpacking,
+				"Bad codec %#hhx from server.", m.codecs);
+		check_quiet(!codec_stream_init(&client->unpack, 0));
+		client->unpacking = 1;
 	}
 
 	return 0;
@@ -98,33 +226,63 @@ error:
 	return 1;
 }
 
+int msg_handle_packed(client_t *client) {
+	assert(client);
+
+	msg_MSG_packed_t m;
+
+	check_quiet(client_view(client, MSG_packed, &m));
+	check(client->unpacking, "Packed message from server, which wasn't agreed on.");
+
+	return client_unpack(client, m.data, m.len);
+error:
+	return 1;
+}
+
+int msg_handle_users(client_t *client) {
+	assert(client);
+
+	msg_MSG_users_t m;
+
+	check_quiet(client_view(client, MSG_users, &m));
+
+	return client_handle_run(client, m.data, m.len, MSG_user_update);
+error:
+	return 1;
+}
+
 int msg_handle_user_update(client_t *client) {
 	assert(client);
-	
-	uint16_t user_id;
-	uint8_t status, len;
-	msg_recv(client->socket, MSG_user_update, &user_id, &status, &len, &buf);
-	buf[len] = '\0';
-
-	user_t *user = user_get(client, user_id);
-	
-	if(status == US_IDENTIFY) {
+
+	msg_MSG_user_update_t m;
+	char name[256];
+
+	check_quiet(client_view(client, MSG_user_update, &m));
+	memcpy(name, m.name, m.len);
+	name[m.len] = '\0';
+
+	user_t *user = user_get(client, m.user_id);
+
+	if(m.status == US_IDENTIFY) {
 		/* Just joined, grab auto-assigned name and id */
-		client->id = user_id;
-		client_set_name(client, buf);
-	} else if(user_id == client->id) {
+		client->id = m.user_id;
+		client_set_name(client, name);
+	} else if(m.status == US_OFFLINE) {
+		/* Batches may tell of users that left before we heard of them, or
+		 * that had our id before us */
+		if(user)
+			user_del(client, user);
+	} else if(m.user_id == client->id) {
 		/* We just set our name/status: this is the response */
-		client->status = status;
-		client_set_name(client, buf);
+		client->status = m.status;
+		client_set_name(client, name);
 	} else if(!user) {
-		check(!user_add(client, user_id, status, buf),
+		check(!user_add(client, m.user_id, m.status, name),
 				"Couldn't add a new user.");
-	} else if(status == US_OFFLINE) {
-		user_del(client, user);
 	} else {
-		log_info("Setting a name: <%s>", buf);
-		user_set_name(client, user, buf);
-		user->status = status;
+		log_info("Setting a name: <%s>", name);
+		user_set_name(client, user, name);
+		user->status = m.status;
 	}
 
 	return 0;
@@ -135,16 +293,15 @@ error:
 int msg_handle_msg(client_t *client) {
 	assert(client);
 
-	uint16_t chat_id, sender_id, len;
+	msg_MSG_msg_t m;
 	chat_t *chat;
 
-	msg_recv(client->socket, MSG_msg, &chat_id, &sender_id, &len, &buf);
-	buf[len] = 0;
+	check_quiet(client_view(client, MSG_msg, &m));
 
-	check(chat = chat_get(client, chat_id),
+	check(chat = chat_get(client, m.chat_id),
 			"Couldn't handle message in nonexisting chat.");
 
-	chat_add_msg(client, chat, buf, sender_id);
+	chat_add_msg_len(client, chat, m.msg, m.len, m.sender_id);
 
 	return 0;
 error:
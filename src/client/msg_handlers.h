@@ -13,6 +13,11 @@ int msg_handle_send_file(struct _client_t *client);
 int msg_handle_file_part(struct _client_t *client);
 int msg_handle_user_update(struct _client_t *client);
 int msg_handle_msg(struct _client_t *client);
+int msg_handle_file_status(struct _client_t *client);
+int msg_handle_hello(struct _client_t *client);
+int msg_handle_packed(struct _client_t *client);
+int msg_handle_users(struct _client_t *client);
+int msg_handle_file_proof(struct _client_t *client);
 
 typedef int (*msg_handler_t)(struct _client_t *client);
 
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,6 +10,41 @@
 
 #include "transfer.h"
 #include "file.h"
+#include "msg.h"
+#include "macros.h"
+
+/* Bytes of a file mapped at a time, to hash it */
+#define TRANSFER_HASH_SZ (1<<24)
+
+/* Hex digits of the hash in the name of a partial download */
+#define TRANSFER_PART_HEX 16
+
+/* Partial downloads are kept beside their destination, under a name that
+ * ties them to the contents they are of, so that only a download of those
+ * contents picks one up again, and never a file it didn't write */
+static char *transfer_part_path(const char *path, const uint8_t hash[SHA256_LEN]) {
+	char *part, *p;
+
+	if(!(part = malloc(strlen(path) + 1 + TRANSFER_PART_HEX + sizeof(".part"))))
+		return NULL;
+
+	p = part + sprintf(part, "%s.", path);
+	for(int i=0; i<TRANSFER_PART_HEX/2; i++)
+		p += sprintf(p, "%02x", hash[i]);
+	strcpy(p, ".part");
+
+	return part;
+}
+
+/* Hashes len bytes of a file from off on */
+static void transfer_hash(int fd, uint64_t off, uint64_t len, sha256_t *hash) {
+	for(uint64_t end = off + len; off < end; off += TRANSFER_HASH_SZ) {
+		size_t n = min(TRANSFER_HASH_SZ, end - off);
+		void *buf = file_map(fd, PROT_READ, off, n);
+		sha256_update(hash, buf, n);
+		file_unmap(buf, n);
+	}
+}
 
 const char* transfer_begin_upload(transfer_t *transfer, const chat_t *chat, const char *name) {
 	assert(transfer);
@@ -18,7 +55,9 @@ const char* transfer_begin_upload(transfer_t *transfer, const chat_t *chat, cons
 
 	transfer->fname = strdup(name);
 	transfer->chat_id = chat->id;
+	transfer->file_id = 0; /* Until the server acknowledges the upload */
 	transfer->offset = 0;
+	transfer->hashed = 0;
 	transfer->sending = 1;
 
 	if((transfer->fd = open(name, O_RDONLY)) < 0) {
@@ -42,9 +81,58 @@ const char* transfer_begin_upload(transfer_t *transfer, const chat_t *chat, cons
 	fstat(transfer->fd, &f_stat);
 	transfer->fsize = f_stat.st_size;
 
+	if(!transfer->fsize) {
+		close(transfer->fd);
+		return "Cannot upload: empty file.";
+	}
+
+	/* Hashed later, off the UI thread: see transfer_hash_upload() */
+	sha256_init(&transfer->check);
+
 	return NULL;
 }
 
+/* Hashes the next piece of an upload, so that a large file doesn't hold
+ * up the net thread for long. Returns nonzero once the whole file is, and
+ * the upload can be announced: the server may have the contents already,
+ * and skip it */
+int transfer_hash_upload(transfer_t *transfer) {
+	assert(transfer);
+	assert(transfer->sending);
+	assert(transfer->hashed < transfer->fsize);
+
+	uint64_t len = min(TRANSFER_HASH_SZ, transfer->fsize - transfer->hashed);
+
+	transfer_hash(transfer->fd, transfer->hashed, len, &transfer->check);
+	transfer->hashed += len;
+	if(transfer->hashed < transfer->fsize)
+		return 0;
+
+	sha256_final(&transfer->check, transfer->hash);
+	return 1;
+}
+
+/* Answers the server's proof that an upload has the content it gave the
+ * hash of: see msg.h */
+void transfer_proof(const transfer_t *transfer, const char *nonce, uint8_t answer[SHA256_LEN]) {
+	assert(transfer);
+	assert(transfer->sending);
+	assert(nonce);
+
+	sha256_t hash;
+
+	sha256_init(&hash);
+	sha256_update(&hash, nonce, MSG_PROOF_NONCE);
+	for(unsigned i=0; i<MSG_PROOF_BLOCKS; i++) {
+		uint64_t offset = msg_proof_offset(nonce, i, transfer->fsize);
+		size_t len = min(FILE_BLOCK_SZ, transfer->fsize - offset);
+		void *buf = file_map(transfer->fd, PROT_READ, offset, len);
+		sha256_update(&hash, buf, len);
+		file_unmap(buf, len);
+	}
+	sha256_final(&hash, answer);
+}
+
 const char* transfer_begin_download(transfer_t *transfer, const char *name) {
 	assert(transfer);
 	assert(transfer->fsize > 0);
@@ -53,14 +141,62 @@ const char* transfer_begin_download(transfer_t *transfer, const char *name) {
 	if(transfer->sending)
 		return "You uploaded this file!";
 
+	/* Nothing is written over: the download only takes the name once it
+	 * is complete */
+	if(!access(name, F_OK))
+		return "Cannot download: file already exists.";
+
 	transfer->offset = 0;
-	if((transfer->fd = file_create(name, transfer->fsize)) == -1) {
-		switch(errno) {
-			case EEXIST:
-				return "Cannot download: file already exists.";
-		}
-		return "Cannot download: miscellaneous error.";
+	sha256_init(&transfer->check);
+	if(!(transfer->path = strdup(name))
+			|| !(transfer->part = transfer_part_path(name, transfer->hash)))
+		goto error;
+
+	if((transfer->fd = file_create(transfer->part, transfer->fsize)) != -1)
+		return NULL;
+
+	/* Left over from an earlier download of the same contents: fetch the
+	 * rest of it, picking up the hash of the whole file from what is there
+	 * already */
+	if(errno == EEXIST && (transfer->fd = file_open_partial(transfer->part, transfer->fsize,
+					&transfer->offset)) != -1) {
+		transfer_hash(transfer->fd, 0, transfer->offset, &transfer->check);
+		return NULL;
 	}
 
-	return NULL;
+error:
+	free(transfer->path);
+	free(transfer->part);
+	transfer->path = transfer->part = NULL;
+	return "Cannot download: miscellaneous error.";
+}
+
+/* Closes a download's file. Once complete, it is checked against the hash
+ * it was shared with, and takes its name if it matches, or is deleted if
+ * not; otherwise it is kept, for the next download of it to carry on from.
+ * Returns what went wrong, or NULL */
+const char* transfer_end_download(transfer_t *transfer) {
+	assert(transfer);
+	assert(transfer->fd != -1);
+
+	uint8_t digest[SHA256_LEN];
+	const char *err = NULL;
+
+	close(transfer->fd);
+	transfer->fd = -1;
+
+	if(transfer->offset == transfer->fsize) {
+		sha256_final(&transfer->check, digest);
+		if(memcmp(digest, transfer->hash, SHA256_LEN)) {
+			unlink(transfer->part);
+			err = "doesn't match the hash it was shared with.";
+		} else if(renameat2(AT_FDCWD, transfer->part, AT_FDCWD, transfer->path, RENAME_NOREPLACE))
+			err = errno == EEXIST ? "complete, but another file took its name; kept as .part."
+				: "complete, but couldn't be given its name; kept as .part.";
+	}
+
+	free(transfer->path);
+	free(transfer->part);
+	transfer->path = transfer->part = NULL;
+	return err;
 }
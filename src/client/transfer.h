@@ -4,19 +4,33 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include "chat.h"
+#include "sha256.h"
 
 typedef struct _transfer_t {
 	uint16_t chat_id, file_id, sender_id;
 	const char *fname;
 	int fd;
-	uint32_t fsize, offset;
+	/* Where a download goes once it is complete and checked, and the file
+	 * it is written to until then */
+	char *path, *part;
+	uint64_t fsize, offset;
+	uint64_t hashed; /* Of an upload, before it can be announced */
 	int sending;
+	/* Of the contents: an upload's own, or the one a download was
+	 * announced with, to check it against */
+	uint8_t hash[SHA256_LEN];
+	sha256_t check; /* Of what an upload has hashed, or a download written, so far */
+	/* Codecs an upload uses, or the server can send a download with */
+	uint8_t codecs;
 } transfer_t;
 
 int transfer_init(transfer_t *transfer);
 void transfer_free(transfer_t *transfer);
 
 const char* transfer_begin_upload(transfer_t *transfer, const chat_t *chat, const char *name);
+int transfer_hash_upload(transfer_t *transfer);
+void transfer_proof(const transfer_t *transfer, const char *nonce, uint8_t answer[SHA256_LEN]);
 const char* transfer_begin_download(transfer_t *transfer, const char *name);
+const char* transfer_end_download(transfer_t *transfer);
 
 #endif /* end of include guard: TRANSFER_H */
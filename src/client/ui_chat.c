@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #define __USE_XOPEN
 #include <wchar.h>
 
@@ -78,13 +79,13 @@ static void client_ui_chat_file_draw(client_t *client, client_ui_chat_t *ui, uns
 	unsigned percent = transfer->offset*100/transfer->fsize;
 
 	switch(percent) {
-		case 0: mvwprintw(ui->win, (*y)++, 0, "  % *s%s | File [%s] (%u bytes) | Ready to download",
+		case 0: mvwprintw(ui->win, (*y)++, 0, "  % *s%s | File [%s] (%" PRIu64 " bytes) | Ready to download",
 			name_width-utf8_scrlen(username), "", username, transfer->fname, transfer->fsize);
 			 break;
-		case 100: mvwprintw(ui->win, (*y)++, 0, "  % *s%s | File [%s] (%u bytes) | Finished",
+		case 100: mvwprintw(ui->win, (*y)++, 0, "  % *s%s | File [%s] (%" PRIu64 " bytes) | Finished",
 			name_width-utf8_scrlen(username), "", username, transfer->fname, transfer->fsize);
 			 break;
-		 default: mvwprintw(ui->win, (*y)++, 0, "  % *s%s | File [%s] (%u bytes) | %u%%",
+		 default: mvwprintw(ui->win, (*y)++, 0, "  % *s%s | File [%s] (%" PRIu64 " bytes) | %u%%",
 			name_width-utf8_scrlen(username), "", username, transfer->fname, transfer->fsize, percent);
 			 break;
 	}
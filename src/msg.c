@@ -6,58 +6,115 @@
 #include <inttypes.h>
 #include <netinet/in.h>
 #include <stdarg.h>
+#include <sys/uio.h>
 
 #include "msg.h"
 #include "debug.h"
 
-static int write_block(int fd, const void *buf, size_t len) {
+/* Writes out a whole iovec array, resuming after partial writes */
+static int writev_block(int fd, struct iovec *iov, int iovcnt) {
 	assert(fd >= 0);
-	assert(buf);
+	assert(iov);
 
-	const void *cur = buf;
-	do {
-		int ret = write(fd, cur, len);
+	while(iovcnt) {
+		ssize_t ret = writev(fd, iov, iovcnt);
+		if(ret < 0 && errno == EINTR)
+			continue;
 		check(ret >= 0, "Write error: %s", strerror(errno));
-		cur += ret;
-		len -= ret;
-	} while(len);
+
+		/* Skip the buffers that were written completely */
+		while(iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
 
 	return 0;
 error:
 	return 1;
 }
 
-static void read_block(int fd, void *buf, size_t len) {
-	assert(fd >= 0);
-	assert(buf);
-
-	void *cur = buf;
-	do {
-		int ret = recv(fd, cur, len, 0);
-		if(ret < 0) switch(errno) {
-			case EAGAIN:
-				ret = 0;
-				break;
-			default:
-				log_err("recv error: %s", strerror(errno));
-				abort();
-				break;
+/* Payloads are copied into the sink's inline buffer while they fit in this
+ * much of it; larger ones are referenced in place by their own iovec */
+#define MSG_INLINE_MAX 256
+#define MSG_MAX_IOV 16
+
+/* One member per message type, as large as its fixed size fields, type
+ * included: the union is as large as the most any message has */
+#define FIELD(type, name) + sizeof(msg_##type##_t)
+#define BYTES(len, name)
+#define IDS(len, name)
+#define X(name,fields) char name[1 fields];
+typedef union _msg_scalars_t { MSG_TYPES } msg_scalars_t;
+#undef X
+#undef FIELD
+#undef BYTES
+#undef IDS
+
+/* Destination of an encoded message: a file descriptor, written with a
+ * single writev() once the whole message is gathered. Fixed size fields are
+ * encoded in locals that don't outlive them, so they are always copied:
+ * room for them is kept on top of that for payloads */
+typedef struct _msg_sink_t {
+	int fd;
+
+	struct iovec iov[MSG_MAX_IOV];
+	int iovcnt;
+	char inline_buf[MSG_INLINE_MAX + sizeof(msg_scalars_t)];
+	size_t inline_len;
+} msg_sink_t;
+
+/* Adds a field to the message; copy is set for those that must be copied */
+static int msg_emit(msg_sink_t *sink, const void *data, size_t len, int copy) {
+	assert(sink);
+
+	if(!len)
+		return 0;
+
+	struct iovec *last = sink->iovcnt ? &sink->iov[sink->iovcnt-1] : NULL;
+
+	if(copy || sink->inline_len + len <= MSG_INLINE_MAX) {
+		assert(sink->inline_len + len <= sizeof(sink->inline_buf));
+		char *dst = sink->inline_buf + sink->inline_len;
+		memcpy(dst, data, len);
+		sink->inline_len += len;
+
+		/* Extend the previous iovec if it ends where this field begins */
+		if(last && (char *)last->iov_base + last->iov_len == dst) {
+			last->iov_len += len;
+			return 0;
 		}
-		cur += ret;
-		len -= ret;
-	} while(len);
+		data = dst;
+	}
+
+	check(sink->iovcnt < MSG_MAX_IOV, "Too many fields in message.");
+	sink->iov[sink->iovcnt++] = (struct iovec){.iov_base = (void *)data, .iov_len = len};
+
+	return 0;
+error:
+	return 1;
 }
 
-int _msg_send(int fd, const char *fmt, ...) {
-	assert(fd >= 0);
+static int msg_finish(msg_sink_t *sink) {
+	assert(sink);
+
+	if(!sink->iovcnt)
+		return 0;
+	return writev_block(sink->fd, sink->iov, sink->iovcnt);
+}
+
+static int msg_vencode(msg_sink_t *sink, const char *fmt, va_list ap) {
+	assert(sink);
 	assert(fmt);
 
-	va_list ap;
 	size_t prev_arg = 0;
 	const char *first = fmt;
 
-	va_start(ap, fmt);
-
 	while(*fmt) {
 		if(!strncmp(fmt, "%hhu", strlen("%hhu")))
 		{
@@ -65,7 +122,7 @@ int _msg_send(int fd, const char *fmt, ...) {
 			if(fmt == first) { /* Special case: check the message type */
 				assert(arg < MSG_NUM_TYPES);
 			}
-			check_quiet(!write_block(fd, &arg, sizeof(uint8_t)));
+			check_quiet(!msg_emit(sink, &arg, sizeof(uint8_t), 1));
 			fmt += strlen("%hhu");
 			prev_arg = arg;
 		}
@@ -73,32 +130,40 @@ int _msg_send(int fd, const char *fmt, ...) {
 		{
 			uint16_t arg = va_arg(ap, unsigned int),
 					 n_arg = ntohs(arg);
-			check_quiet(!write_block(fd, &n_arg, sizeof(uint16_t)));
+			check_quiet(!msg_emit(sink, &n_arg, sizeof(uint16_t), 1));
 			fmt += strlen("%hu");
 			prev_arg = arg;
 		}
 		else if(!strncmp(fmt, "%u", strlen("%u")))
 		{
-			uint32_t arg = htonl(va_arg(ap, unsigned int));
-			check_quiet(!write_block(fd, &arg, sizeof(uint32_t)));
+			uint32_t arg = va_arg(ap, unsigned int),
+					 n_arg = htonl(arg);
+			check_quiet(!msg_emit(sink, &n_arg, sizeof(uint32_t), 1));
 			fmt += strlen("%u");
 			prev_arg = arg;
 		}
+		else if(!strncmp(fmt, MSG_FMT_u64, strlen(MSG_FMT_u64)))
+		{
+			uint64_t arg = htobe64(va_arg(ap, uint64_t));
+			check_quiet(!msg_emit(sink, &arg, sizeof(uint64_t), 1));
+			fmt += strlen(MSG_FMT_u64);
+		}
 		else if(!strncmp(fmt, "%p", strlen("%p")))
 		{
 			const char *arg = va_arg(ap, const char *);
-			check_quiet(!write_block(fd, arg, prev_arg));
+			check_quiet(!msg_emit(sink, arg, prev_arg, 0));
 			fmt += strlen("%p");
 		}
 		else if(!strncmp(fmt, "%k", strlen("%k")))
 		{
+			/* Must outlive the loop: the sink may only reference it */
 			uint16_t *arg = va_arg(ap, uint16_t *);
-			uint16_t copy[prev_arg];
+			uint16_t *copy = alloca(prev_arg*sizeof(*arg));
 			memcpy(copy, arg, prev_arg*sizeof(*arg));
 			for(unsigned int i=0; i<prev_arg; i++) {
 				copy[i] = htons(copy[i]);
 			}
-			check_quiet(!write_block(fd, copy, prev_arg*2));
+			check_quiet(!msg_emit(sink, copy, prev_arg*2, 0));
 			fmt += strlen("%k");
 		}
 		else {
@@ -107,72 +172,44 @@ int _msg_send(int fd, const char *fmt, ...) {
 		}
 	}
 
-	va_end(ap);
-
-	return 0;
+	return msg_finish(sink);
 error:
 	return 1;
 }
 
-int _msg_recv(int fd, const char *fmt, ...) {
+int _msg_send(int fd, const char *fmt, ...) {
 	assert(fd >= 0);
 	assert(fmt);
 
 	va_list ap;
-	size_t prev_arg = 0;
+	msg_sink_t sink = {.fd = fd};
+	int r;
 
 	va_start(ap, fmt);
+	r = msg_vencode(&sink, fmt, ap);
+	va_end(ap);
 
-	while(*fmt) {
-		if(!strncmp(fmt, "%hhu", strlen("%hhu")))
-		{
-			uint8_t *arg = va_arg(ap, uint8_t *);
-			read_block(fd, arg, sizeof(uint8_t));
-			fmt += strlen("%hhu");
-			prev_arg = *arg;
-		}
-		else if(!strncmp(fmt, "%hu", strlen("%hu")))
-		{
-			uint16_t *arg = va_arg(ap, uint16_t *);
-			read_block(fd, arg, sizeof(uint16_t));
-			*arg = ntohs(*arg);
-			fmt += strlen("%hu");
-			prev_arg = *arg;
-		}
-		else if(!strncmp(fmt, "%u", strlen("%u")))
-		{
-			uint32_t *arg = va_arg(ap, uint32_t *);
-			read_block(fd, arg, sizeof(uint32_t));
-			*arg = ntohl(*arg);
-			fmt += strlen("%u");
-			prev_arg = *arg;
-		}
-		else if(!strncmp(fmt, "%p", strlen("%p")))
-		{
-			char **arg = va_arg(ap, char **);
-			*arg = realloc(*arg, prev_arg+1);
-			read_block(fd, *arg, prev_arg);
-			fmt += strlen("%p");
-		}
-		else if(!strncmp(fmt, "%k", strlen("%k")))
-		{
-			uint16_t **arg = va_arg(ap, uint16_t **);
-			*arg = realloc(*arg, prev_arg*2+1);
-			read_block(fd, *arg, prev_arg*2);
-			for(unsigned int i=0; i<prev_arg; i++) {
-				uint16_t old = (*arg)[i];
-				(*arg)[i] = ntohs((*arg)[i]);
-				debug("recv: %hu --> %hu", old, (*arg)[i]);
-			}
-			fmt += strlen("%k");
-		}
-		else {
-			debug("Invalid format specifier '%s'", fmt);
-			assert(0);
-		}
-	}
+	return r;
+}
 
-	va_end(ap);
+/* Length of the frame at the start of buf, by decoding it */
+ssize_t msg_frame_len(const void *buf, size_t len) {
+	assert(buf || !len);
 
-	return 0;
+	if(!len)
+		return 0;
+
+	switch(msg_get_type(*(const uint8_t *)buf)) {
+#define X(name,fields) \
+		case MSG_##name: { \
+			msg_MSG_##name##_t m; \
+			return msg_decode_MSG_##name(buf, len, &m); \
+		}
+		MSG_TYPES
+#undef X
+		case MSG_invalid:
+		case MSG_NUM_TYPES:
+		default:
+			return -1;
+	}
 }
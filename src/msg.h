@@ -3,36 +3,313 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
 
-/* Has to be less than sizeof(uint16_t)
- * Chosen to be a multiple of the page size to simplify mmap-ing */
+/* Revision of the protocol below, checked by the hello handshake */
+#define MSG_VERSION 7
+
+/* File blocks are a multiple of this, so that their offsets stay multiples
+ * of the page size, to simplify mmap-ing */
 #define FILE_BLOCK_SZ (1<<15)
 
+/* Largest file block either side may ask for in the handshake */
+#define MSG_MAX_CHUNK (1<<22)
+
+/* How a file block is encoded; sets of them are bit masks */
+#define MSG_CODEC_RAW     0
+#define MSG_CODEC_DEFLATE 1
+#define MSG_CODEC_BIT(codec) (1 << (codec))
+
+/* The codecs, besides raw, that this side knows */
+#define MSG_CODECS MSG_CODEC_BIT(MSG_CODEC_DEFLATE)
+
+/* Each message is a list of fields, sent in order in network byte order:
+ *   FIELD(type, name)  fixed size integer; type is one of u8, u16, u32, u64
+ *   BYTES(len, name)   len bytes, where len is an earlier field
+ *   IDS(len, name)     len uint16_t ids, where len is an earlier field
+ *
+ * File transfers are identified by a transfer_id, chosen by the client and
+ * unique among its transfers in progress, so that several uploads and
+ * downloads can share a connection. It is 0 in file announcements.
+ *
+ * Transfers can pick up where they left off after a reconnect: recv_file
+ * asks for a byte range of a file (a length of 0 meaning up to the end),
+ * and send_file with the id of a file whose upload was cut short resumes
+ * it. The server answers each send_file with a file_status, giving the
+ * file's id and the offset the upload carries on from.
+ *
+ * Files are identified by the SHA-256 of their contents: an upload gives it
+ * in send_file. Before anything else, the server answers a new upload with
+ * a file_proof holding MSG_PROOF_NONCE random bytes, and the client answers
+ * that with a file_proof holding the SHA-256 of the nonce followed by the
+ * MSG_PROOF_BLOCKS blocks of the file msg_proof_offset() picks with it. If
+ * the server has the content already and the answer matches it, it answers
+ * with a file_status at the end of the file and the upload is complete;
+ * the hash alone doesn't let anyone share a file they don't have.
+ * Otherwise the upload goes ahead, from the start.
+ * Announcements give it too, and both the server and the downloads check
+ * the file against it once they have all of it; the server withdraws a
+ * file that doesn't match, and refuses recv_file for it from then on.
+ * send_file resuming an upload gives it as well, to show the connection
+ * may carry the upload on.
+ *
+ * Each file_part gives the offset of its block in the file, and the
+ * CRC-32C of the block. Uploads send blocks of whole multiples of
+ * FILE_BLOCK_SZ, but for the last one. The server answers an upload's
+ * block that fails its check with a file_status giving the offset to carry
+ * on from, and drops the blocks already on their way after it, whose
+ * offsets no longer follow on.
+ *
+ * Blocks may be compressed, each on its own, with the codec given in
+ * file_part; len is then that of the compressed block, while the length
+ * rules above and the CRC are of the block itself. Which codecs a transfer
+ * may use is settled up front: an upload lists those it will use in
+ * send_file, the server lists those it can send with in announcements, and
+ * a download picks from those in recv_file. Raw blocks are always allowed,
+ * for blocks that don't compress.
+ *
+ * A connection starts with a hello from the client, giving the protocol
+ * version, the largest file block it wants and the codecs it takes the
+ * server's other messages in; the server answers with the block size both
+ * sides use on this connection, which it may lower, and the codec it picked,
+ * if any.
+ *
+ * With a codec picked, the server's messages after its hello, but for file
+ * blocks, go through a single deflate stream over the connection, so that
+ * the names and ids they repeat are sent once. Each packed message holds
+ * the stream up to a flush, and inflates to whole messages; the server
+ * flushes whenever it writes to the socket, so nothing waits on it. File
+ * blocks, which have codecs of their own, go in between as they are.
+ *
+ * The server tells clients who is online with users messages, each a run of
+ * whole user_update messages: once hello is answered, the new client gets
+ * its own id and name (with status US_IDENTIFY) and everyone online, and
+ * then batches of the changes since, with only the latest of each user's
+ * in a batch. A batch may tell of users that left before the client heard
+ * of them. Batches go out before any start_chat, so that chats only ever
+ * name users the client knows.
+ */
 #define MSG_TYPES \
-	X(start_chat , "%hu%hu%k"        , chat id; num ids; htons(ids)) \
-	X(leave_chat , "%hu%hu"          , chat id; user id) \
-	X(msg        , "%hu%hu%hu%p"     , chat id; sender id; length; msg[length]) \
-	X(send_file  , "%hu%u%hu%p%hu%hu", chat id; fsize; l; fname[l]; file id; sender) \
-	X(file_part  , "%hu%p"           , length; blob[length]) \
-	X(recv_file  , "%hu%u"           , chat id; file id) \
-	X(user_update, "%hu%hhu%hhu%p"   , userid; status; length; name[length]) \
+	X(start_chat , FIELD(u16, chat_id) FIELD(u16, num_ids) IDS(num_ids, ids)) \
+	X(leave_chat , FIELD(u16, chat_id) FIELD(u16, user_id)) \
+	X(msg        , FIELD(u16, chat_id) FIELD(u16, sender_id) FIELD(u16, len) BYTES(len, msg)) \
+	X(send_file  , FIELD(u16, chat_id) FIELD(u64, fsize) FIELD(u16, len) BYTES(len, fname) \
+	               FIELD(u16, file_id) FIELD(u16, sender_id) FIELD(u16, transfer_id) \
+	               FIELD(u8, hash_len) BYTES(hash_len, hash) FIELD(u8, codecs)) \
+	X(file_part  , FIELD(u16, transfer_id) FIELD(u64, offset) FIELD(u32, crc) \
+	               FIELD(u8, codec) FIELD(u32, len) BYTES(len, blob)) \
+	X(recv_file  , FIELD(u16, chat_id) FIELD(u32, file_id) FIELD(u16, transfer_id) \
+	               FIELD(u64, offset) FIELD(u64, length) FIELD(u8, codecs)) \
+	X(user_update, FIELD(u16, user_id) FIELD(u8, status) FIELD(u8, len) BYTES(len, name)) \
+	X(file_status, FIELD(u16, transfer_id) FIELD(u16, file_id) FIELD(u64, offset)) \
+	X(hello      , FIELD(u16, version) FIELD(u32, chunk) FIELD(u8, codecs)) \
+	X(packed     , FIELD(u32, len) BYTES(len, data)) \
+	X(users      , FIELD(u32, len) BYTES(len, data)) \
+	X(file_proof , FIELD(u16, transfer_id) FIELD(u8, len) BYTES(len, data)) \
+
+/*
+ * Field helpers
+ */
+
+typedef uint8_t  msg_u8_t;
+typedef uint16_t msg_u16_t;
+typedef uint32_t msg_u32_t;
+typedef uint64_t msg_u64_t;
+
+#define MSG_FMT_u8  "%hhu"
+#define MSG_FMT_u16 "%hu"
+#define MSG_FMT_u32 "%u"
+#define MSG_FMT_u64 "%" PRIu64
+
+/* Ids are given in host order when encoding; decoded messages point at the
+ * ids in network order inside the frame, read them with msg_ids_get() */
+typedef union _msg_ids_t {
+	const uint16_t *host;
+	const char *wire;
+} msg_ids_t;
+
+static inline char *msg_put_u8(char *out, uint8_t v) {
+	*out = v;
+	return out + sizeof(v);
+}
+
+static inline char *msg_put_u16(char *out, uint16_t v) {
+	v = htons(v);
+	memcpy(out, &v, sizeof(v));
+	return out + sizeof(v);
+}
+
+static inline char *msg_put_u32(char *out, uint32_t v) {
+	v = htonl(v);
+	memcpy(out, &v, sizeof(v));
+	return out + sizeof(v);
+}
+
+static inline char *msg_put_u64(char *out, uint64_t v) {
+	v = htobe64(v);
+	memcpy(out, &v, sizeof(v));
+	return out + sizeof(v);
+}
+
+static inline uint8_t msg_get_u8(const char *in) {
+	return *(const uint8_t *)in;
+}
+
+static inline uint16_t msg_get_u16(const char *in) {
+	uint16_t v;
+	memcpy(&v, in, sizeof(v));
+	return ntohs(v);
+}
+
+static inline uint32_t msg_get_u32(const char *in) {
+	uint32_t v;
+	memcpy(&v, in, sizeof(v));
+	return ntohl(v);
+}
+
+static inline uint64_t msg_get_u64(const char *in) {
+	uint64_t v;
+	memcpy(&v, in, sizeof(v));
+	return be64toh(v);
+}
+
+/* Simple loops over whole arrays, so that they vectorize */
+static inline char *msg_put_ids(char *out, const uint16_t *ids, size_t num) {
+	for(size_t i=0; i<num; i++)
+		msg_put_u16(out + i*sizeof(*ids), ids[i]);
+	return out + num*sizeof(*ids);
+}
+
+static inline uint16_t msg_ids_get(msg_ids_t ids, size_t i) {
+	return msg_get_u16(ids.wire + i*sizeof(uint16_t));
+}
+
+static inline void msg_ids_copy(uint16_t *dst, msg_ids_t ids, size_t num) {
+	for(size_t i=0; i<num; i++)
+		dst[i] = msg_ids_get(ids, i);
+}
+
+/* The proof that an upload has the content it gives the hash of: the
+ * nonce it is asked with, and the blocks of the file it covers */
+#define MSG_PROOF_NONCE 64
+#define MSG_PROOF_BLOCKS (MSG_PROOF_NONCE / sizeof(uint64_t))
+
+/* Where the i-th block of a proof starts: each of the file's blocks in
+ * turn, if it has no more than a proof covers, or else the one the i-th
+ * u64 of the nonce picks. Blocks are FILE_BLOCK_SZ long, but for the last */
+static inline uint64_t msg_proof_offset(const char *nonce, unsigned i, uint64_t fsize) {
+	uint64_t blocks = (fsize + FILE_BLOCK_SZ - 1) / FILE_BLOCK_SZ;
+	uint64_t pick = blocks <= MSG_PROOF_BLOCKS ? i : msg_get_u64(nonce + i*sizeof(uint64_t));
+	return pick % blocks * FILE_BLOCK_SZ;
+}
 
 /*
  * Automatically generated stuff below
  */
 
-#define X(name,fmt,comment) MSG_##name, 
+#define X(name,fields) MSG_##name,
 typedef enum _msg_type_t { MSG_invalid = -1, MSG_TYPES MSG_NUM_TYPES } msg_type_t;
 #undef X
 
-#define X(name,fmt,comment) static const char * const msg_format_send_MSG_##name = "%hhu" fmt;
-MSG_TYPES;
+/* Format strings, for the varargs encoder */
+#define FIELD(type, name) MSG_FMT_##type
+#define BYTES(len, name) "%p"
+#define IDS(len, name) "%k"
+
+#define X(name,fields) static const char * const msg_format_send_MSG_##name = "%hhu" fields;
+MSG_TYPES
 #undef X
 
-#define X(name,fmt,comment) static const char * const msg_format_recv_MSG_##name = fmt;
-MSG_TYPES;
+#undef FIELD
+#undef BYTES
+#undef IDS
+
+/* One struct per message type, with its fields in order: msg_MSG_<name>_t */
+#define FIELD(type, name) msg_##type##_t name;
+#define BYTES(len, name) const char *name;
+#define IDS(len, name) msg_ids_t name;
+
+#define X(name,fields) typedef struct { fields } msg_MSG_##name##_t;
+MSG_TYPES
 #undef X
 
+#undef FIELD
+#undef BYTES
+#undef IDS
+
+/* Encoded size of a message, type included: msg_size_MSG_<name>() */
+#define FIELD(type, name) n += sizeof(msg_##type##_t);
+#define BYTES(len, name) n += m->len;
+#define IDS(len, name) n += m->len*sizeof(uint16_t);
+
+#define X(name,fields) \
+	static inline size_t msg_size_MSG_##name(const msg_MSG_##name##_t *m) { \
+		size_t n = 1; \
+		(void)m; \
+		fields \
+		return n; \
+	}
+MSG_TYPES
+#undef X
+
+#undef FIELD
+#undef BYTES
+#undef IDS
+
+/* Encodes a message into out, which must hold msg_size_MSG_<name>() bytes;
+ * returns the end of the message: msg_encode_MSG_<name>() */
+#define FIELD(type, name) out = msg_put_##type(out, m->name);
+#define BYTES(len, name) memcpy(out, m->name, m->len); out += m->len;
+#define IDS(len, name) out = msg_put_ids(out, m->name.host, m->len);
+
+#define X(name,fields) \
+	static inline char *msg_encode_MSG_##name(char *out, const msg_MSG_##name##_t *m) { \
+		*out++ = MSG_##name; \
+		fields \
+		return out; \
+	}
+MSG_TYPES
+#undef X
+
+#undef FIELD
+#undef BYTES
+#undef IDS
+
+/* Decodes the frame at the start of buf, type included. Variable length
+ * fields point into buf. Returns the length of the frame, or 0 if buf
+ * doesn't hold all of it yet: msg_decode_MSG_<name>() */
+#define MSG_NEED(n) if((size_t)(end - cur) < (size_t)(n)) return 0;
+#define FIELD(type, name) \
+	MSG_NEED(sizeof(msg_##type##_t)) \
+	m->name = msg_get_##type(cur); cur += sizeof(msg_##type##_t);
+#define BYTES(len, name) \
+	MSG_NEED(m->len) \
+	m->name = cur; cur += m->len;
+#define IDS(len, name) \
+	MSG_NEED(m->len*sizeof(uint16_t)) \
+	m->name.wire = cur; cur += m->len*sizeof(uint16_t);
+
+#define X(name,fields) \
+	static inline size_t msg_decode_MSG_##name(const char *buf, size_t len, msg_MSG_##name##_t *m) { \
+		const char *cur = buf + 1, *end = buf + len; \
+		assert(len && *buf == MSG_##name); \
+		fields \
+		return cur - buf; \
+	}
+MSG_TYPES
+#undef X
+
+#undef MSG_NEED
+#undef FIELD
+#undef BYTES
+#undef IDS
+
 static inline msg_type_t msg_get_type(uint8_t type) {
 	return (type < MSG_NUM_TYPES) ? type : MSG_invalid;
 }
@@ -40,10 +317,10 @@ static inline msg_type_t msg_get_type(uint8_t type) {
 #define msg_send(fd, type, ...) \
 	_msg_send((fd), msg_format_send_##type, (uint8_t)(type), ##__VA_ARGS__)
 
-#define msg_recv(fd, type, ...) \
-	_msg_recv((fd), msg_format_recv_##type, ##__VA_ARGS__)
-
 extern int _msg_send(int fd, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
-extern int _msg_recv(int fd, const char *fmt, ...) __attribute__ ((format ( scanf, 2, 3)));
+
+/* Length of the frame (type included) at the start of buf: 0 if it isn't
+ * complete yet, -1 if the type is invalid */
+extern ssize_t msg_frame_len(const void *buf, size_t len);
 
 #endif
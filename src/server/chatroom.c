@@ -15,17 +15,42 @@ chatroom_t *chatroom_new(server_t *server) {
 	unsigned int id;
 
 	vector_init(&new_chatroom.clients, sizeof(uint16_t));
+	vector_init(&new_chatroom.files, sizeof(uint16_t));
 	id = sp_vector_add(&server->chatrooms, &new_chatroom);
 	return id ? sp_vector_get(&server->chatrooms, id) : NULL;
 }
 
+/* Drops the chat's files from the file table, then the chat itself */
+static void chatroom_close(server_t *server, chatroom_t *chatroom) {
+	assert(server);
+	assert(chatroom);
+	assert(!chatroom->clients.size);
+	assert(mutex_locked(&server->clients_mutex));
+
+	const uint16_t chat_id = sp_vector_indexof(&server->chatrooms, chatroom);
+	uint16_t *file_id;
+
+	/* Transfers still in progress keep their entries until they finish */
+	vector_foreach(&chatroom->files, file_id) {
+		file_entry_t *file = server_file(server, *file_id);
+		sp_vector_del(&server->files, *file_id);
+		file_entry_unref(&server->store, file);
+	}
+
+	log_info("Chatroom %hu has closed, with %zu files.", chat_id, chatroom->files.size);
+
+	vector_free(&chatroom->files);
+	vector_free(&chatroom->clients);
+	sp_vector_del(&server->chatrooms, chat_id);
+}
+
 int chatroom_client_add(server_t *server, chatroom_t *chatroom, client_t *client) {
 	assert(server);
 	assert(chatroom);
 	assert(client);
 	assert(mutex_locked(&server->clients_mutex));
 
-	uint16_t client_id = sp_vector_indexof(&server->clients, client),
+	uint16_t client_id = client->id,
 			 chatroom_id = sp_vector_indexof(&server->chatrooms, chatroom);
 
 	check_quiet(vector_add(&chatroom->clients, &client_id, 1));
@@ -45,35 +70,50 @@ void chatroom_start(server_t *server, chatroom_t *chatroom) {
 
 	const uint16_t chat_id = sp_vector_indexof(&server->chatrooms, chatroom);
 	const unsigned short num_clients = chatroom->clients.size;
-	uint16_t client_ids[chatroom->clients.size], *client_id;
-	unsigned int zzi = 0;
+	uint16_t *client_id;
+	outq_frame_t *frame;
 
-	vector_foreach(&chatroom->clients, client_id)
-		client_ids[zzi++] = *client_id;
+	/* The room's member list is already an array of ids */
+	check_quiet(frame = client_frame(MSG_start_chat, chat_id, num_clients,
+				{.host = chatroom->clients.data}));
 
 	vector_foreach(&chatroom->clients, client_id) {
-		client_t *client = sp_vector_get(&server->clients, *client_id);
+		client_t *client = server_client(server, *client_id);
 		log_info("Sending start_chat message to <%s>", client->name);
-		msg_send(client->fd, MSG_start_chat, chat_id, num_clients, client_ids);
+		client_send_frame(server, client, frame);
 	}
+
+	outq_frame_unref(frame);
+	return;
+error:
+	log_err("Couldn't start chat %hu.", chat_id);
 }
 
-int chatroom_send_msg(const server_t *server, const chatroom_t *chatroom, const client_t *from, const char *msg) {
+int chatroom_send_msg(server_t *server, const chatroom_t *chatroom, const client_t *from, const char *msg, uint16_t len) {
 	assert(server);
 	assert(chatroom);
 	assert(mutex_locked(&server->clients_mutex));
 
-	uint16_t *c_id;
+	uint16_t *c_id,
+			 chat_id = sp_vector_indexof(&server->chatrooms, chatroom),
+			 sender_id = from ? from->id : 0;
+	outq_frame_t *frame;
+
+	/* Encoded once, and shared by every member's queue */
+	check_quiet(frame = client_frame(MSG_msg, chat_id, sender_id, len, msg));
 
 	vector_foreach(&chatroom->clients, c_id) {
-		client_t *client = sp_vector_get(&server->clients, *c_id);
-		client_send_msg(server, chatroom, client, from, msg);
+		client_t *client = server_client(server, *c_id);
+		client_send_frame(server, client, frame);
 	}
 
+	outq_frame_unref(frame);
 	return 0;
+error:
+	return 1;
 }
 
-int chatroom_send_file(const server_t *server, const chatroom_t *chatroom, uint16_t file_id) {
+int chatroom_send_file(server_t *server, const chatroom_t *chatroom, uint16_t file_id) {
 	assert(server);
 	assert(chatroom);
 	assert(file_id);
@@ -81,17 +121,44 @@ int chatroom_send_file(const server_t *server, const chatroom_t *chatroom, uint1
 
 	uint16_t *c_id,
 			 chat_id = sp_vector_indexof(&server->chatrooms, chatroom);
-	file_entry_t *file = sp_vector_get(&server->files, file_id);
+	file_entry_t *file = server_file(server, file_id);
+	outq_frame_t *frame;
+
+	check_quiet(frame = client_frame(MSG_send_file, chat_id, file->fsize,
+				(uint16_t)strlen(file->fname), file->fname, file_id, file->sender, 0,
+				SHA256_LEN, (const char *)file->digest,
+				(uint8_t)(server->config.compress ? MSG_CODECS : 0)));
 
 	vector_foreach(&chatroom->clients, c_id) {
 		debug("Notifying %hu about file from %hu", *c_id, file->sender);
 		if(*c_id == file->sender) continue;
-		client_t *client = sp_vector_get(&server->clients, *c_id);
-		msg_send(client->fd, MSG_send_file, chat_id, file->fsize,
-				(uint16_t)strlen(file->fname), file->fname, file_id, file->sender);
+		client_t *client = server_client(server, *c_id);
+		client_send_frame(server, client, frame);
 	}
 
+	outq_frame_unref(frame);
 	return 0;
+error:
+	return 1;
+}
+
+int chatroom_add_file(chatroom_t *chatroom, uint16_t file_id) {
+	assert(chatroom);
+	assert(file_id);
+
+	return !vector_add(&chatroom->files, &file_id, 1);
+}
+
+void chatroom_del_file(chatroom_t *chatroom, uint16_t file_id) {
+	assert(chatroom);
+
+	uint16_t *id;
+	vector_foreach(&chatroom->files, id) {
+		if(*id == file_id) {
+			vector_del(&chatroom->files, vector_indexof(&chatroom->files, id));
+			return;
+		}
+	}
 }
 
 int chatroom_client_is_present(server_t *server, chatroom_t *chatroom, client_t *client) {
@@ -100,7 +167,7 @@ int chatroom_client_is_present(server_t *server, chatroom_t *chatroom, client_t
 	assert(client);
 	assert(mutex_locked(&server->clients_mutex));
 
-	uint16_t client_id = sp_vector_indexof(&server->clients, client), *c_id;
+	uint16_t client_id = client->id, *c_id;
 
 	vector_foreach(&chatroom->clients, c_id) {
 		if(*c_id == client_id)
@@ -116,15 +183,23 @@ void chatroom_client_leave(server_t *server, chatroom_t *chatroom, client_t *cli
 	assert(client);
 	assert(mutex_locked(&server->clients_mutex));
 
+	const uint16_t client_id = client->id,
+			 chat_id = sp_vector_indexof(&server->chatrooms, chatroom);
+	uint16_t *c_id;
+
+	/* Off the client's list first: client_disconnect() relies on it */
+	vector_foreach(&client->chatrooms, c_id) {
+		if(*c_id == chat_id) {
+			vector_del(&client->chatrooms, vector_indexof(&client->chatrooms, c_id));
+			break;
+		}
+	}
+
 	if(!chatroom_client_is_present(server, chatroom, client))
 		return;
 
 	/* TODO: chatroom vs chat */
 
-	const uint16_t client_id = sp_vector_indexof(&server->clients, client),
-			 chat_id = sp_vector_indexof(&server->chatrooms, chatroom);
-	uint16_t *c_id;
-
 	/* Remove that client from the list of clients in the room */
 	vector_foreach(&chatroom->clients, c_id) {
 		if(*c_id == client_id) {
@@ -134,10 +209,17 @@ void chatroom_client_leave(server_t *server, chatroom_t *chatroom, client_t *cli
 	}
 
 	/* ...and send it to each client in the chatroom */
-	vector_foreach(&chatroom->clients, c_id) {
-		client_t *other = sp_vector_get(&server->clients, *c_id);
-		msg_send(other->fd, MSG_leave_chat, chat_id, client_id);
+	outq_frame_t *frame = client_frame(MSG_leave_chat, chat_id, client_id);
+	if(frame) {
+		vector_foreach(&chatroom->clients, c_id) {
+			client_t *other = server_client(server, *c_id);
+			client_send_frame(server, other, frame);
+		}
+		outq_frame_unref(frame);
 	}
 
 	log_info("Client <%s> has left.", client->name);
+
+	if(!chatroom->clients.size)
+		chatroom_close(server, chatroom);
 }
@@ -5,16 +5,21 @@
 #include "client.h"
 #include "vector.h"
 
+/* A chat closes once its last member leaves, and the files shared in it
+ * go with it */
 typedef struct _chatroom_t {
 	vector_t clients;
+	vector_t files; /* Ids of the files shared in it */
 } chatroom_t;
 
 chatroom_t *chatroom_new(server_t *server);
 int chatroom_client_add(server_t *server, chatroom_t *chatroom, client_t *client);
 void chatroom_start(server_t *server, chatroom_t *chatroom);
 
-int chatroom_send_msg(const server_t *server, const chatroom_t *chatroom, const client_t *from, const char *msg);
-int chatroom_send_file(const server_t *server, const chatroom_t *chatroom, uint16_t file_id);
+int chatroom_send_msg(server_t *server, const chatroom_t *chatroom, const client_t *from, const char *msg, uint16_t len);
+int chatroom_send_file(server_t *server, const chatroom_t *chatroom, uint16_t file_id);
+int chatroom_add_file(chatroom_t *chatroom, uint16_t file_id);
+void chatroom_del_file(chatroom_t *chatroom, uint16_t file_id);
 
 int chatroom_client_is_present(server_t *server, chatroom_t *chatroom, client_t *client);
 void chatroom_client_leave(server_t *server, chatroom_t *chatroom, client_t *client);
@@ -1,85 +1,94 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/random.h>
+#include <sys/socket.h>
 
 #include "server.h"
 #include "chatroom.h"
 #include "client.h"
 #include "msg.h"
 #include "debug.h"
-#include "file.h"
 #include "file_entry.h"
+#include "store.h"
+#include "file.h"
+#include "codec.h"
 #include "macros.h"
 
+/* Bytes read from the middle of a block on disk, to judge whether it is
+ * worth reading it all in to compress it, rather than send it straight
+ * from the file */
+#define CLIENT_PROBE_SZ 4096
+
+static void client_mark_dirty(server_t *server, client_t *client);
+static int client_start_send(server_t *server, client_t *client);
+static void client_wake_readers(server_t *server, file_entry_t *file, int done);
+
 static void client_gen_name(server_t *server, client_t *client, char name[256]) {
 	assert(server);
 	assert(client);
 	assert(name);
 
-	unsigned int client_id = sp_vector_indexof(&server->clients, client);
-	snprintf(name, 256, "User_%u", client_id);
+	snprintf(name, 256, "User_%hu", client->id);
 }
 
-void client_connect(server_t *server, client_t *client, int fd) {
+void client_connect(server_t *server, client_t *client, uint16_t id, shard_t *shard, int fd) {
 	assert(server);
 	assert(client);
+	assert(id);
+	assert(shard);
 	assert(fd >= 0);
 
-	const uint16_t client_id = sp_vector_indexof(&server->clients, client);
-
 	memset(client, 0, sizeof(*client));
 
+	client->id = id;
+	client->shard = shard;
 	client->fd = fd;
-	client->file_fd = -1;
 	client_gen_name(server, client, client->name);
-	vector_init(&client->chatrooms, sizeof(uint32_t));
-
-	log_info("Client <%s> has connected.", client->name);
-
-	/* Inform the new client about its own id and name */
-	msg_send(client->fd, MSG_user_update, client_id,
-			(uint8_t)US_IDENTIFY, (uint8_t)strlen(client->name), client->name);
-
-	client_t *other;
-	sp_vector_foreach(&server->clients, other) {
-		if(other == client) continue;
-		uint16_t other_id = sp_vector_indexof(&server->clients, other);
+	vector_init(&client->chatrooms, sizeof(uint16_t));
+	vector_init(&client->transfers, sizeof(client_transfer_t));
+	outq_init(&client->out);
+	buffer_init(&client->in);
 
-		/* Inform the new client about all online users */
-		msg_send(client->fd, MSG_user_update, other_id,
-				(uint8_t)other->status, (uint8_t)strlen(other->name), other->name);
-
-		/* Inform all online clients about the new user */
-		msg_send(other->fd, MSG_user_update, client_id,
-				(uint8_t)client->status, (uint8_t)strlen(client->name), client->name);
+	if(server->config.backend == SERVER_URING) {
+		/* Requests can only be made from the shard's own thread */
+		client_wake(server, client);
+	} else {
+		client->events = EPOLLIN|SERVER_EPOLL_MODE;
+		check_warn(!shard_watch(shard, fd, client, client->events),
+				"Client <%s> won't be serviced.", client->name);
 	}
+
+	log_info("Client <%s> has connected.", client->name);
 }
 
-void client_send_msg(const server_t *server, const chatroom_t *chatroom, const client_t *to, const client_t *from, const char *buf) {
+/* Once the handshake has settled how messages are sent to it, inform the
+ * new client about its own id and name, and all online users, and them
+ * about it with the next presence batch */
+void client_greet(server_t *server, client_t *client) {
 	assert(server);
-	assert(chatroom);
-	assert(to);
-	assert(buf);
+	assert(client);
+	assert(mutex_locked(&server->clients_mutex));
 
-	uint16_t chatroom_id = sp_vector_indexof(&server->chatrooms, chatroom),
-			 sender_id = from ? sp_vector_indexof(&server->clients, from) : 0,
-			 len = strlen(buf);
-	msg_send(to->fd, MSG_msg, chatroom_id, sender_id, len, buf);
+	check_warn(!presence_snapshot(server, client),
+			"Couldn't tell <%s> who is online.", client->name);
 }
 
 /* The server has just received a message from the client, and should now send it
  * out to all other clients in the chatroom */
-int client_recv_msg(server_t *server, chatroom_t *chatroom, client_t *client, const char *buf) {
+int client_recv_msg(server_t *server, chatroom_t *chatroom, client_t *client, const char *buf, uint16_t len) {
 	assert(server);
 	assert(chatroom);
 	assert(client);
 	assert(buf);
 	assert(chatroom_client_is_present(server, chatroom, client));
 
-	log_info("<%s> (%zu): %s", client->name,
-			sp_vector_indexof(&server->clients, client), buf);
+	log_info("<%s> (%hu): %.*s", client->name,
+			client->id, (int)len, buf);
 
-	return chatroom_send_msg(server, chatroom, client, buf);
+	return chatroom_send_msg(server, chatroom, client, buf, len);
 }
 
 void client_disconnect(server_t *server, client_t *client) {
@@ -88,145 +97,1159 @@ void client_disconnect(server_t *server, client_t *client) {
 
 	log_info("Client <%s> is disconnecting...", client->name);
 
-	uint16_t *chatroom_id;
-
-	vector_foreach(&client->chatrooms, chatroom_id) {
-		chatroom_t *chatroom = sp_vector_get(&server->chatrooms, *chatroom_id);
-		chatroom_client_leave(server, chatroom, client);
+	/* Leaving a chat takes it off the list */
+	while(client->chatrooms.size) {
+		uint16_t *chatroom_id = vector_get(&client->chatrooms, client->chatrooms.size - 1);
+		chatroom_client_leave(server, sp_vector_get(&server->chatrooms, *chatroom_id), client);
 	}
 
 	vector_free(&client->chatrooms);
+
+	/* Its unfinished uploads may be resumed later, by it or anyone else in
+	 * the chat; their downloads wait meanwhile */
+	client_transfer_t *transfer;
+	vector_foreach(&client->transfers, transfer) {
+		if(transfer->upload)
+			transfer->file->uploading = 0;
+	}
+
+	if(server->config.backend == SERVER_URING)
+		shutdown(client->fd, SHUT_RDWR); /* Completes any request in flight */
+	else
+		shard_unwatch(client->shard, client->fd);
 	close(client->fd);
 
 	log_info("Client <%s> has disconnected.", client->name);
+	if(client->packing)
+		log_info("Messages to <%s> took %lu bytes, deflated from %lu.", client->name,
+				client->pack.z.total_out, client->pack.z.total_in);
+
+	/* Inform all online clients about the user leaving */
+	presence_note(server, client, 1);
+}
 
-	client_t *other;
-	sp_vector_foreach(&server->clients, other) {
-		if(other == client) continue;
-		uint16_t client_id = sp_vector_indexof(&server->clients, client);
+/* Releases the client's memory, once nothing refers to it any more */
+void client_free(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+	assert(!client->inflight);
 
-		/* Inform all online clients about the user leaving */
-		msg_send(other->fd, MSG_user_update, client_id,
-				(uint8_t)US_OFFLINE, (uint8_t)strlen(client->name), client->name);
+	client_transfer_t *transfer;
+	vector_foreach(&client->transfers, transfer) {
+		if(!transfer->upload)
+			file_entry_del_download(transfer->file);
+		file_entry_unref(&server->store, transfer->file);
 	}
+	vector_free(&client->transfers);
+
+	outq_free(&client->out);
+	buffer_free(&client->in);
+	free(client->block.out);
+	if(client->packing)
+		codec_stream_free(&client->pack);
+	if(client->read_block.body)
+		outq_frame_unref(client->read_block.body);
+	free(client);
 }
 
-int client_start_file_send(client_t *client, char *fname, uint32_t fsize, uint16_t chat_id) {
+/* Transfer in progress with the given id, or NULL */
+static client_transfer_t *client_get_transfer(client_t *client, uint16_t id) {
+	assert(client);
+
+	client_transfer_t *transfer;
+	vector_foreach(&client->transfers, transfer) {
+		if(transfer->id == id)
+			return transfer;
+	}
+
+	return NULL;
+}
+
+/* Adds a transfer to the table, if its id is free; NULL on failure. The
+ * transfer holds a reference to the file */
+static client_transfer_t *client_add_transfer(client_t *client, uint16_t id, int upload, uint16_t file_id, file_entry_t *file) {
+	assert(client);
+	assert(file);
+
+	client_transfer_t transfer = {.id = id, .upload = upload, .file_id = file_id, .file = file}, *added;
+
+	check(!client_get_transfer(client, id), "Client <%s> reused transfer id %hu.",
+			client->name, id);
+	check(client->transfers.size < CLIENT_MAX_TRANSFERS,
+			"Client <%s> has too many transfers in progress.", client->name);
+
+	check_quiet(added = vector_add(&client->transfers, &transfer, 1));
+	file_entry_ref(file);
+	if(!upload)
+		file_entry_add_download(file);
+	return added;
+error:
+	return NULL;
+}
+
+static void client_del_transfer(server_t *server, client_t *client, client_transfer_t *transfer) {
+	assert(server);
+	assert(client);
+	assert(transfer);
+
+	if(!transfer->upload)
+		file_entry_del_download(transfer->file);
+	else {
+		free(client->block.out);
+		client->block.out = NULL;
+		client->block.out_sz = 0;
+	}
+	file_entry_unref(&server->store, transfer->file);
+	vector_del(&client->transfers, vector_indexof(&client->transfers, transfer));
+}
+
+/* Wakes the clients waiting for more of an upload; once it is complete,
+ * they are woken one last time, to finish */
+static void client_wake_readers(server_t *server, file_entry_t *file, int done) {
+	assert(server);
+	assert(file);
+	assert(mutex_locked(&server->clients_mutex));
+
+	uint16_t *id;
+	vector_foreach(&file->readers, id) {
+		/* Ids are reused; waking some other client does no harm */
+		client_t *reader = server_client(server, *id);
+		if(reader)
+			client_wake(server, reader);
+	}
+
+	if(done) {
+		file->streaming = 0;
+		vector_free(&file->readers);
+	}
+}
+
+/* The file is announced straight away, so that the chat can download it
+ * while it is being uploaded. If the store has its contents already, by
+ * their hash, there is nothing to upload */
+/* Shares a new upload in its chat, taking over a reference to it: complete
+ * straight away if the client proved the store has its contents already,
+ * or else once the client has sent them */
+static int client_share_file(server_t *server, client_t *client, uint16_t transfer_id, file_entry_t *file, uint8_t codecs) {
+	assert(server);
+	assert(client);
+	assert(file);
+	assert(mutex_locked(&server->clients_mutex));
+
+	chatroom_t *chatroom = NULL;
+	client_transfer_t *transfer;
+	size_t file_id = 0;
+
+	/* Unless it has closed since the upload was offered */
+	check(file->chat_id <= server->chatrooms.largest_id
+			&& (chatroom = sp_vector_get(&server->chatrooms, file->chat_id)),
+			"Chat %hu of '%s' from <%s> has closed.", file->chat_id, file->fname, client->name);
+
+	if(file->contents) {
+		log_info("Already have '%s' from <%s>.", file->fname, client->name);
+		file->committed = file->fsize;
+		check_quiet(file_id = sp_vector_add(&server->files, &file));
+		check_quiet(!chatroom_add_file(chatroom, file_id));
+		check_warn(!client_send(server, client, MSG_file_status, transfer_id, file_id, file->fsize),
+				"<%s> doesn't know its upload is complete.", client->name);
+		chatroom_send_file(server, chatroom, file_id);
+		return 0;
+	}
+
+	file->streaming = file->uploading = 1;
+	sha256_init(&file->hash);
+	check_quiet(file->contents = store_create(&server->store, file->fsize));
+	check_quiet(file_id = sp_vector_add(&server->files, &file));
+	check_quiet(!chatroom_add_file(chatroom, file_id));
+	check_quiet(transfer = client_add_transfer(client, transfer_id, 1, file_id, file));
+	transfer->codecs = codecs;
+
+	/* The uploader needs the file's id to resume the upload, should it be
+	 * cut short */
+	check_warn(!client_send(server, client, MSG_file_status, transfer_id, file_id, 0),
+			"<%s> won't be able to resume its upload.", client->name);
+	chatroom_send_file(server, chatroom, file_id);
+
+	return 0;
+error:
+	if(file_id) {
+		chatroom_del_file(chatroom, file_id);
+		sp_vector_del(&server->files, file_id);
+	}
+	file_entry_unref(&server->store, file);
+	return 1;
+}
+
+/* The answer to the proof of an upload's content, from the stored copy of
+ * it: see msg.h */
+static int client_proof(server_t *server, file_entry_t *file, const char *nonce, uint8_t proof[SHA256_LEN]) {
+	assert(server);
+	assert(file);
+	assert(file->contents);
+	assert(nonce);
+
+	store_file_t *contents;
+	sha256_t hash;
+	int fd, err = 0;
+
+	check_quiet(contents = store_pin(&server->store, &file->contents, &fd));
+
+	sha256_init(&hash);
+	sha256_update(&hash, nonce, MSG_PROOF_NONCE);
+	for(unsigned i=0; i<MSG_PROOF_BLOCKS && !err; i++) {
+		uint64_t offset = msg_proof_offset(nonce, i, file->fsize);
+		err = store_hash(contents, fd, offset, min(FILE_BLOCK_SZ, file->fsize - offset), &hash);
+	}
+	sha256_final(&hash, proof);
+
+	store_unpin(contents);
+	return err;
+error:
+	return 1;
+}
+
+/* Offers a new upload: the client is asked to prove it has the content
+ * before it is shared, whether the store has it or not, so that the
+ * question gives nothing away */
+int client_start_file_send(server_t *server, client_t *client, uint16_t transfer_id, const char *fname, uint16_t fname_len, uint64_t fsize, uint16_t chat_id, const char *hash, uint8_t hash_len, uint8_t codecs) {
+	assert(server);
 	assert(client);
 	assert(fname);
-	assert(strlen(fname)<256);
-	assert(chat_id);
+	assert(mutex_locked(&server->clients_mutex));
 
-	if(client->file_fd != -1) {
-		/* TODO: what to do if there's already a transfer? */
-		/* TODO: send a start transfer failed msg */
-		return 1;
+	file_entry_t *file = NULL;
+	client_transfer_t *transfer;
+	char nonce[MSG_PROOF_NONCE];
+	uint8_t proof[SHA256_LEN] = {0};
+
+	check(fname_len < sizeof(file->fname), "Filename too long.");
+	check(fsize > 0, "Empty file from <%s>.", client->name);
+	check(hash_len == SHA256_LEN, "Bad file hash from <%s>.", client->name);
+	check(!(codecs & ~MSG_CODECS), "Unknown codecs %#hhx from <%s>.", codecs, client->name);
+	check(chat_id && chat_id <= server->chatrooms.largest_id
+			&& sp_vector_get(&server->chatrooms, chat_id),
+			"Invalid chat id %hu from <%s>.", chat_id, client->name);
+	check(getrandom(nonce, sizeof(nonce), 0) == sizeof(nonce),
+			"Couldn't make a nonce: %s", strerror(errno));
+
+	check_mem(file = calloc(1, sizeof(*file)));
+	file->refs = 1;
+	file->blocks_lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	file->fsize = fsize;
+	file->chat_id = chat_id;
+	file->sender = client->id;
+	vector_init(&file->readers, sizeof(uint16_t));
+	memcpy(file->fname, fname, fname_len);
+	file->fname[fname_len] = '\0';
+	memcpy(file->digest, hash, SHA256_LEN);
+
+	if((file->contents = store_find(&server->store, file->digest, fsize)))
+		check_quiet(!client_proof(server, file, nonce, proof));
+
+	/* Held by the transfer, without a file id, until the client answers */
+	check_quiet(transfer = client_add_transfer(client, transfer_id, 1, 0, file));
+	transfer->codecs = codecs;
+	memcpy(transfer->proof, proof, SHA256_LEN);
+	file_entry_unref(&server->store, file);
+
+	check_warn(!client_send(server, client, MSG_file_proof, transfer_id,
+				(uint8_t)MSG_PROOF_NONCE, nonce),
+			"<%s> can't prove it has '%s'.", client->name, file->fname);
+
+	return 0;
+error:
+	if(file)
+		file_entry_unref(&server->store, file);
+	return 1;
+}
+
+int client_prove_file_send(server_t *server, client_t *client, uint16_t transfer_id, const char *answer, uint8_t len) {
+	assert(server);
+	assert(client);
+	assert(answer || !len);
+	assert(mutex_locked(&server->clients_mutex));
+
+	client_transfer_t *transfer = client_get_transfer(client, transfer_id);
+	file_entry_t *file;
+	uint8_t codecs;
+
+	check(transfer && transfer->upload && !transfer->file_id,
+			"No upload %hu waiting on its proof from <%s>.", transfer_id, client->name);
+
+	file = file_entry_ref(transfer->file);
+	codecs = transfer->codecs;
+
+	/* Without the stored copy, the content has to come from the client,
+	 * and match its hash */
+	if(file->contents && (len != SHA256_LEN || memcmp(answer, transfer->proof, SHA256_LEN))) {
+		log_warn("<%s> didn't prove it has '%s': taking the upload.", client->name, file->fname);
+		store_release(&server->store, file->contents);
+		file->contents = NULL;
+	}
+	client_del_transfer(server, client, transfer);
+
+	return client_share_file(server, client, transfer_id, file, codecs);
+error:
+	return 1;
+}
+
+/* Files a complete upload in the store, under the hash of what landed. Its
+ * blocks passed their checks, so one that doesn't match the hash it was
+ * sent with changed on the uploader's side meanwhile: it is withdrawn from
+ * its chat instead, so that recv_file turns it down, and its spool file
+ * goes with the last transfer of it. Downloads under way run to the end,
+ * and turn it down themselves */
+static void client_store_file(server_t *server, uint16_t file_id, file_entry_t *file) {
+	assert(server);
+	assert(file);
+	assert(mutex_locked(&server->clients_mutex));
+
+	uint8_t digest[SHA256_LEN];
+
+	sha256_final(&file->hash, digest);
+	if(memcmp(digest, file->digest, SHA256_LEN)) {
+		log_err("Upload of '%s' doesn't match the hash it was sent with; withdrawing it.",
+				file->fname);
+
+		/* Unless its chat has closed, and taken it out already */
+		if(server_file(server, file_id) == file) {
+			chatroom_del_file(sp_vector_get(&server->chatrooms, file->chat_id), file_id);
+			sp_vector_del(&server->files, file_id);
+			file_entry_unref(&server->store, file);
+		}
+		return;
 	}
 
-	check((client->file_fd = file_create("", fsize)) != -1,
-			"Couldn't create a temporary file for a file transfer.");
-	strcpy(client->fname, fname);
-	client->fsize = fsize;
-	client->offset = 0;
-	client->fchat = chat_id;
+	check_warn(!store_commit(&server->store, &file->contents, digest),
+			"Keeping '%s' out of the store.", file->fname);
+	store_log_stats(&server->store);
+}
+
+/* Picks up an upload cut short by a disconnect, from where the spool file
+ * ends; the file has been announced already. Ids go with connections, so
+ * the uploader comes back under another one, outside the chat: it shows
+ * it may carry on with the file's hash, which only it and the chat have.
+ * What it sends must still match the hash, or the file is withdrawn */
+int client_resume_file_send(server_t *server, client_t *client, uint16_t transfer_id, uint16_t file_id, uint64_t fsize, uint16_t chat_id, const char *hash, uint8_t hash_len, uint8_t codecs) {
+	assert(server);
+	assert(client);
+	assert(file_id);
+	assert(mutex_locked(&server->clients_mutex));
+
+	file_entry_t *file;
+	client_transfer_t *transfer;
+
+	check(file = server_file(server, file_id), "Invalid file id %hu from <%s>.",
+			file_id, client->name);
+	check(file->chat_id == chat_id && file->fsize == fsize,
+			"<%s> tried to resume a different file as %hu.", client->name, file_id);
+	check(hash_len == SHA256_LEN && !memcmp(hash, file->digest, SHA256_LEN),
+			"<%s> tried to resume file %hu without its hash.", client->name, file_id);
+	check(file->streaming, "File %hu is already complete.", file_id);
+	check(!file->uploading, "File %hu is already being uploaded.", file_id);
+	check(!(codecs & ~MSG_CODECS), "Unknown codecs %#hhx from <%s>.", codecs, client->name);
+
+	check_quiet(transfer = client_add_transfer(client, transfer_id, 1, file_id, file));
+	transfer->offset = __atomic_load_n(&file->committed, __ATOMIC_RELAXED);
+	transfer->codecs = codecs;
+	file->uploading = 1;
+	file->sender = client->id;
+
+	check_quiet(!client_send(server, client, MSG_file_status, transfer_id, file_id,
+				transfer->offset));
 
 	return 0;
 error:
-	assert(client->file_fd == -1);
 	return 1;
 }
 
-int client_start_file_recv(server_t *server, client_t *client, uint16_t chat_id, uint32_t file_id) {
+/* Sends length bytes of a file from offset, or the rest of it if length is
+ * 0, compressed with those of the given codecs the server sends with */
+int client_start_file_recv(server_t *server, client_t *client, uint16_t transfer_id, uint16_t chat_id, uint32_t file_id, uint64_t offset, uint64_t length, uint8_t codecs) {
 	assert(server);
 	assert(client);
 	assert(chat_id);
+	assert(mutex_locked(&server->clients_mutex));
 
 	file_entry_t *file;
+	client_transfer_t *transfer;
 
-	check(client->file_fd == -1, "Client already transferring a file.");
-	check(file_id <= server->files.largest_id, "Invalid file id");
-	check(file = sp_vector_get(&server->files, file_id), "Invalid file id");
+	check(file = server_file(server, file_id), "Invalid file id");
 	check(file->chat_id == chat_id, "Client not permitted to receive this file.");
 
-	assert(file->fd >= 0);
+	assert(file->contents);
 	assert(file->fsize > 0);
 	assert(strlen(file->fname) > 0);
 
-	client->sending = 1;
-	client->file_fd = file->fd;
-	client->fsize = file->fsize;
-	client->offset = 0;
-	strcpy(client->fname, file->fname);
+	if(!length)
+		length = file->fsize - min(offset, file->fsize);
+	check(offset < file->fsize && length <= file->fsize - offset,
+			"Bad range %" PRIu64 "+%" PRIu64 " of file %u from <%s>.",
+			offset, length, file_id, client->name);
+
+	check_quiet(transfer = client_add_transfer(client, transfer_id, 0, file_id, file));
+	transfer->offset = offset;
+	transfer->end = offset + length;
+	transfer->codecs = server->config.compress ? codecs & MSG_CODECS : 0;
+	if(file->streaming)
+		check_warn(vector_add(&file->readers, &client->id, 1),
+				"<%s> may wait for the upload of file %u.", client->name, file_id);
+
+	client_mark_dirty(server, client);
 
 	return 0;
 error:
 	return 1;
 }
 
-int client_recv_file_part(server_t *server, client_t *client, char *buf, uint16_t len) {
+/* Damaged on the way: asks for an upload's block again, rather than let it
+ * reach the spool, and the downloads */
+static int client_resend_file_part(server_t *server, client_t *client, const client_transfer_t *transfer) {
 	assert(server);
 	assert(client);
+	assert(transfer);
+
+	log_warn("Block at %" PRIu64 " of '%s' from <%s> failed its check.",
+			transfer->offset, transfer->file->fname, client->name);
+	return client_send(server, client, MSG_file_status, transfer->id, transfer->file_id,
+			transfer->offset);
+}
+
+/* Decodes and checks a block, and writes it to the spool */
+static client_block_status_t client_take_block(client_t *client, const msg_MSG_file_part_t *m) {
+	assert(client);
+	assert(m);
+
+	client_block_t *block = &client->block;
+	client_transfer_t *transfer = client_get_transfer(client, m->transfer_id);
+	const char *buf = m->blob;
+	uint32_t len = m->len;
+	file_entry_t *file;
+	ssize_t raw_len;
+
+	/* Turned away before the handshake, by msg_handle() */
+	if(!client->chunk)
+		return CLIENT_BLOCK_BAD;
 
-	check(client->file_fd != -1, "No file transfer currently ongoing for <%s>.", client->name);
+	check(transfer && transfer->upload && transfer->file_id, "No upload %hu in progress for <%s>.",
+			m->transfer_id, client->name);
+	file = transfer->file;
 
-	len = min(len, client->fsize - client->offset);
+	/* Sent before the client heard it had to go back */
+	if(m->offset != transfer->offset)
+		return CLIENT_BLOCK_STALE;
 
-	assert(client->fsize - client->offset > 0);
-	check(len, "Bad block length from client.");
+	assert(file->fsize - transfer->offset > 0);
 
-	void *file = file_map(client->file_fd, PROT_WRITE, client->offset, len);
-	memcpy(file, buf, len);
-	client->offset += len;
+	/* The checks below are of the block itself */
+	if(m->codec != MSG_CODEC_RAW) {
+		check(m->codec == MSG_CODEC_DEFLATE && transfer->codecs & MSG_CODEC_BIT(MSG_CODEC_DEFLATE),
+				"Block in codec %hhu from <%s>, which its upload didn't list.",
+				m->codec, client->name);
+		if((raw_len = codec_decompress_to(&client->shard->codec, buf, len,
+						min(client->chunk, file->fsize - m->offset),
+						&block->out, &block->out_sz)) < 0)
+			return CLIENT_BLOCK_DAMAGED;
+		buf = block->out;
+		len = raw_len;
+	}
 
-	file_unmap(file, len);
+	check(len && len <= client->chunk && len <= file->fsize - m->offset
+			&& (len % FILE_BLOCK_SZ == 0 || len == file->fsize - m->offset),
+			"Bad block length from client.");
 
-	assert(client->offset <= client->fsize);
-	if(client->offset == client->fsize) {
-		unsigned file_entry_id;
-		file_entry_t file_entry = {
-			.fd = client->file_fd,
-			.fsize = client->fsize,
-			.chat_id = client->fchat,
-			.sender = sp_vector_indexof(&server->clients, client)
-		};
-		strcpy(file_entry.fname, client->fname);
+	if(store_checksum(file->contents, buf, len, m->offset) != m->crc)
+		return CLIENT_BLOCK_DAMAGED;
 
-		check_quiet((file_entry_id = sp_vector_add(&server->files, &file_entry)));
-		client->file_fd = -1;
+	/* Straight from the receive buffer, or the inflated copy, into the
+	 * spool file; the downloads only get to it once it is committed */
+	check_quiet(!store_write(file->contents, buf, len, m->offset));
+	block->hash = file->hash;
+	sha256_update(&block->hash, buf, len);
+	block->len = len;
 
-		chatroom_t *chatroom = sp_vector_get(&server->chatrooms, client->fchat);
+	return CLIENT_BLOCK_OK;
+error:
+	return CLIENT_BLOCK_BAD;
+}
 
-		chatroom_send_file(server, chatroom, file_entry_id);
+/* The work on a file block that doesn't need the lock, done ahead of its
+ * handler by the client's shard, if one is at the front of the receive
+ * buffer: the upload's state is the client's own, and none of its other
+ * messages can come in between */
+void client_check_file_part(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+	assert(client->shard == shard_self);
+
+	client_block_t *block = &client->block;
+	const char *frame = buffer_data(&client->in);
+	ssize_t len = msg_frame_len(frame, buffer_len(&client->in));
+	msg_MSG_file_part_t m;
+
+	if(len <= 0 || msg_get_type(*frame) != MSG_file_part || block->frame == frame)
+		return;
+
+	block->frame = frame;
+	if(!msg_decode_MSG_file_part(frame, len, &m))
+		block->status = CLIENT_BLOCK_BAD;
+	else
+		block->status = client_take_block(client, &m);
+}
+
+int client_recv_file_part(server_t *server, client_t *client, uint16_t transfer_id) {
+	assert(server);
+	assert(client);
+	assert(client->block.frame == client->frame);
+	assert(mutex_locked(&server->clients_mutex));
+
+	client_transfer_t *transfer = client_get_transfer(client, transfer_id);
+	file_entry_t *file;
 
-		log_info("File upload finished: size = %u, chat = %hu",
-				file_entry.fsize, file_entry.chat_id);
+	switch(client->block.status) {
+		case CLIENT_BLOCK_OK:
+			break;
+		case CLIENT_BLOCK_STALE:
+			return 0;
+		case CLIENT_BLOCK_DAMAGED:
+			return client_resend_file_part(server, client, transfer);
+		default:
+			/* Its upload can't go on from here, and every block after this
+			 * one would be taken for stale: drop the client, which lets it
+			 * know, and it can resume the upload once it reconnects */
+			log_err("Dropping <%s> over a bad file block.", client->name);
+			client_kick(server, client);
+			return 1;
 	}
 
+	assert(transfer && transfer->upload);
+	file = transfer->file;
+
+	file->hash = client->block.hash;
+	transfer->offset += client->block.len;
+	__atomic_store_n(&file->committed, transfer->offset, __ATOMIC_RELEASE);
+
+	assert(transfer->offset <= file->fsize);
+	if(transfer->offset == file->fsize) {
+		log_info("File upload finished: size = %" PRIu64 ", chat = %hu",
+				file->fsize, file->chat_id);
+
+		file->uploading = 0;
+		client_store_file(server, transfer->file_id, file);
+		client_wake_readers(server, file, 1);
+		client_del_transfer(server, client, transfer);
+	} else
+		client_wake_readers(server, file, 0);
+
+	return 0;
+}
+
+/* Lets go of the descriptor a frame was read from or refers to */
+static void client_unpin_file(void *contents) {
+	store_unpin(contents);
+}
+
+/* Encodes the header of a file_part, which its block follows */
+static void client_file_part_head(outq_frame_t *frame, const msg_MSG_file_part_t *m) {
+	char *p = msg_put_u8(frame->data, MSG_file_part);
+	p = msg_put_u64(msg_put_u16(p, m->transfer_id), m->offset);
+	msg_put_u32(msg_put_u8(msg_put_u32(p, m->crc), m->codec), m->len);
+}
+
+/* Sets a block's body from its data: deflated, if the download takes that
+ * and it comes out smaller, or else as it is, in raw if given, or in a copy
+ * of data. Takes over the reference to raw; the body is NULL on failure */
+static void client_pack_block(client_t *client, const client_transfer_t *transfer, file_block_t *block, const char *data, outq_frame_t *raw) {
+	assert(client);
+	assert(transfer);
+	assert(block);
+	assert(data);
+
+	codec_t *codec = &client->shard->codec;
+	size_t len;
+
+	block->codec = MSG_CODEC_RAW;
+	block->body = raw;
+
+	if((transfer->codecs & MSG_CODEC_BIT(MSG_CODEC_DEFLATE)) && codec_worth_it(data, block->len)
+			&& (len = codec_compress(codec, data, block->len))) {
+		if(raw)
+			outq_frame_unref(raw);
+		if((block->body = outq_frame_new(len))) {
+			memcpy(block->body->data, codec->out, len);
+			block->codec = MSG_CODEC_DEFLATE;
+		}
+	} else if(!raw && (block->body = outq_frame_new(block->len)))
+		memcpy(block->body->data, data, block->len);
+}
+
+/* Whether a block on disk looks worth compressing, by a sample of it */
+static int client_probe_block(int fd, const file_block_t *block) {
+	assert(fd >= 0);
+	assert(block);
+
+	char buf[CLIENT_PROBE_SZ];
+	size_t len = min(sizeof(buf), block->len);
+
+	return !file_read(fd, buf, len, block->offset + (block->len - len)/2)
+		&& codec_worth_it(buf, len);
+}
+
+/* Reads a block of the file being sent straight into its body, with
+ * io_uring; it is queued once the read completes. The body holds the pin
+ * on fd */
+static void client_read_file_part(server_t *server, client_t *client, const client_transfer_t *transfer, const file_block_t *block, store_file_t *contents, int fd) {
+	assert(server);
+	assert(client);
+	assert(transfer);
+	assert(block);
+	assert(contents);
+	assert(!client->read_busy);
+
+	struct io_uring_sqe *sqe;
+	outq_frame_t *body;
+
+	if(!(body = outq_frame_new(block->len))) {
+		store_unpin(contents);
+		goto error;
+	}
+	body->release = client_unpin_file;
+	body->release_arg = contents;
+
+	if(!(sqe = uring_sqe(&client->shard->ring))) {
+		outq_frame_unref(body);
+		goto error;
+	}
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)body->data;
+	sqe->len = block->len;
+	sqe->off = block->offset;
+	sqe->user_data = shard_tag(client, SHARD_OP_READ);
+
+	client->read_block = *block;
+	client->read_block.body = body;
+	client->read_transfer = transfer->id;
+	client->read_busy = 1;
+	client->inflight++;
+
+	return;
+error:
+	log_err("Couldn't read file for <%s>.", client->name);
+	client_kick(server, client);
+}
+
+/* Moves a download on by len bytes, which have been queued; finished
+ * downloads leave the table */
+static void client_file_advance(server_t *server, client_t *client, client_transfer_t *transfer, uint32_t len) {
+	assert(server);
+	assert(client);
+	assert(transfer);
+
+	const file_entry_t *file = transfer->file;
+
+	transfer->offset += len;
+	assert(transfer->offset <= transfer->end);
+
+	debug("Sending %hu... %" PRIu64 "/%" PRIu64, transfer->id, transfer->offset, file->fsize);
+
+	if(transfer->offset == transfer->end) {
+		debug("Done sending %hu... %" PRIu64 "/%" PRIu64, transfer->id, transfer->offset, file->fsize);
+		client_del_transfer(server, client, transfer);
+	}
+}
+
+/* Queues a block of a download behind a header of its own, taking over
+ * the reference to its body, and moves the download on */
+static int client_queue_file_part(server_t *server, client_t *client, client_transfer_t *transfer, const file_block_t *block) {
+	assert(server);
+	assert(client);
+	assert(transfer);
+	assert(block);
+
+	const msg_MSG_file_part_t m = {.transfer_id = transfer->id, .offset = block->offset,
+		.crc = block->crc, .codec = block->codec, .len = outq_frame_size(block->body)};
+	outq_frame_t *frame;
+
+	check_quiet(frame = outq_frame_body(msg_size_MSG_file_part(&m) - m.len, block->body));
+	client_file_part_head(frame, &m);
+	check_quiet(!client_queue(server, client, frame, 1));
+
+	client_file_advance(server, client, transfer, block->len);
 	return 0;
 error:
 	return 1;
 }
 
-void client_send_file_part(client_t *client) {
+/* Bytes of a download that can be sent now: it may not overtake the
+ * upload, nor run past the end of its range */
+static uint64_t client_file_available(const client_transfer_t *transfer) {
+	assert(transfer);
+	assert(!transfer->upload);
+
+	uint64_t committed = __atomic_load_n(&transfer->file->committed, __ATOMIC_ACQUIRE);
+
+	return committed > transfer->offset ? min(committed, transfer->end) - transfer->offset : 0;
+}
+
+/* Queues a block of the next download in turn that has data; returns 0 if
+ * none has */
+int client_send_file_part(server_t *server, client_t *client) {
+	assert(server);
 	assert(client);
 
-	if(!client->sending)
+	client_transfer_t *transfer = NULL;
+	uint64_t avail = 0;
+
+	/* Round robin over the downloads, so that they share the connection */
+	for(size_t i=0; i<client->transfers.size && !avail; i++) {
+		size_t index = (client->next_transfer + i) % client->transfers.size;
+		transfer = vector_get(&client->transfers, index);
+		if(!transfer->upload && (avail = client_file_available(transfer)))
+			client->next_transfer = index + 1;
+	}
+	if(!avail)
+		return 0;
+
+	/* Blocks end on a multiple of the block size, so that downloads of the
+	 * same file line up, and can share them */
+	file_block_t block = {.offset = transfer->offset,
+		.len = min(client->chunk - transfer->offset % client->chunk, avail)};
+	store_file_t *contents;
+	int fd;
+
+	if(!file_entry_get_block(transfer->file, block.offset, block.len, transfer->codecs, &block)) {
+		check_quiet(!client_queue_file_part(server, client, transfer, &block));
+		return 1;
+	}
+
+	check_quiet(contents = store_pin(&server->store, &transfer->file->contents, &fd));
+	if(store_crc(contents, fd, block.offset, block.len, &block.crc)) {
+		store_unpin(contents);
+		goto error;
+	}
+
+	if(contents->mem) {
+		/* Small files are kept in memory: take the block straight from there */
+		client_pack_block(client, transfer, &block, contents->mem + block.offset, NULL);
+		store_unpin(contents);
+	} else if(server->config.backend == SERVER_URING) {
+		client_read_file_part(server, client, transfer, &block, contents, fd);
+		return 1;
+	} else if(transfer->codecs && client_probe_block(fd, &block)) {
+		/* Read in to be compressed */
+		outq_frame_t *raw = outq_frame_new(block.len);
+		if(raw && file_read(fd, raw->data, block.len, block.offset)) {
+			outq_frame_unref(raw);
+			raw = NULL;
+		}
+		store_unpin(contents);
+		if(raw)
+			client_pack_block(client, transfer, &block, raw->data, raw);
+	} else if((block.body = outq_frame_file(0, fd, block.offset, block.len))) {
+		/* The kernel copies the block itself from the file to the socket */
+		block.body->release = client_unpin_file;
+		block.body->release_arg = contents;
+	} else
+		store_unpin(contents);
+
+	check_quiet(block.body);
+	file_entry_put_block(transfer->file, &block);
+	check_quiet(!client_queue_file_part(server, client, transfer, &block));
+
+	return 1;
+error:
+	log_err("Couldn't send file to <%s>.", client->name);
+	client_kick(server, client);
+	return 0;
+}
+
+/* Whether any download has data waiting to be sent */
+static int client_file_ready(const client_t *client) {
+	assert(client);
+
+	client_transfer_t *transfer;
+	vector_foreach(&client->transfers, transfer) {
+		if(!transfer->upload && client_file_available(transfer))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Write interest is only armed while there is output pending; sockets are
+ * nearly always writable, so an idle client would otherwise wake the loop
+ * continuously */
+static uint32_t client_wanted_events(const client_t *client) {
+	assert(client);
+
+	uint32_t events = EPOLLIN|SERVER_EPOLL_MODE;
+	if(client->out.bytes || client_file_ready(client))
+		events |= EPOLLOUT;
+	return events;
+}
+
+void client_update_events(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+
+	uint32_t events = client_wanted_events(client);
+
+	if(events != client->events && !shard_modify(client->shard, client->fd, client, events))
+		client->events = events;
+}
+
+/* Queue the client to be flushed by the event loop */
+static void client_mark_dirty(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+
+	assert(client->shard == shard_self);
+
+	if(client->dirty)
 		return;
-	assert(client->file_fd != -1);
 
-	uint16_t len = min(FILE_BLOCK_SZ, client->fsize - client->offset);
-	char *buf = file_map(client->file_fd, PROT_READ, client->offset, len);
-	msg_send(client->fd, MSG_file_part, len, buf);
-	file_unmap(buf, len);
+	if(vector_add(&client->shard->dirty, &client, 1))
+		client->dirty = 1;
+}
 
-	client->offset += len;
-	assert(client->offset <= client->fsize);
+/* Queue the client to be dropped by the event loop; clients can't be removed
+ * directly, as the caller may be iterating over them */
+void client_kick(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+
+	assert(client->shard == shard_self);
+
+	if(client->closing)
+		return;
+
+	check_quiet(vector_add(&client->shard->closing, &client, 1));
+	client->closing = 1;
+
+	return;
+error:
+	log_err("Couldn't kick <%s>.", client->name);
+}
+
+/* Has the client's shard look at it again: keeps a receive request in
+ * flight, and flushes it, picking up any new file data. May be called from
+ * any thread */
+void client_wake(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+
+	if(client->shard != shard_self) {
+		check_warn(!shard_post(client->shard, client, NULL, 0),
+				"Couldn't wake <%s> up.", client->name);
+		return;
+	}
+
+	if(client->closing)
+		return;
+
+	if(client->shard->uring && client_start_recv(server, client)) {
+		client_kick(server, client);
+		return;
+	}
+	client_mark_dirty(server, client);
+}
+
+/* Applies the slow consumer policy before queueing len more bytes; returns
+ * 0 if the message may be queued */
+static int client_admit(server_t *server, client_t *client, size_t len, int bulk) {
+	assert(server);
+	assert(client);
 
-	debug("Sending... %u/%u", client->offset, client->fsize);
+	if(client->closing)
+		return 1;
+
+	/* File data is throttled by the caller, through the low watermark */
+	if(!bulk && client->out.bytes + len > server->config.out_high_wm) {
+		switch(server->config.out_policy) {
+			case OUTQ_DROP:
+				if(!client->dropping)
+					log_warn("Queue for <%s> full, dropping messages.", client->name);
+				client->dropping = 1;
+				return 1;
+			case OUTQ_DISCONNECT:
+				log_warn("Queue for <%s> full, disconnecting.", client->name);
+				client_kick(server, client);
+				return 1;
+			case OUTQ_PAUSE:
+			default:
+				break;
+		}
+	}
+
+	return 0;
+}
 
-	if(client->offset == client->fsize) {
-		debug("Done sending... %u/%u", client->offset, client->fsize);
-		client->sending = 0;
-		client->file_fd = -1;
+/* Queues a frame, taking over the caller's reference. Clients owned by
+ * another shard get it through that shard's inbox, which applies the slow
+ * consumer policy once it is delivered */
+int client_queue(server_t *server, client_t *client, outq_frame_t *frame, int bulk) {
+	assert(server);
+	assert(client);
+	assert(frame);
+
+	if(client->shard != shard_self)
+		return shard_post(client->shard, client, frame, bulk);
+
+	if(client_admit(server, client, outq_frame_size(frame), bulk)) {
+		outq_frame_unref(frame);
+		return 1;
 	}
+
+	if(client->packing && !bulk) {
+		/* Into the stream, until the next flush */
+		assert(!frame->file_len && !frame->body);
+		int err = codec_stream_write(&client->pack, frame->data, frame->len);
+		outq_frame_unref(frame);
+		if(err) {
+			/* The stream can't go on without it */
+			log_err("Couldn't deflate a message for <%s>.", client->name);
+			client_kick(server, client);
+			return 1;
+		}
+		client->pack_pending = 1;
+	} else
+		check_quiet(!outq_push(&client->out, frame, bulk));
+	client_mark_dirty(server, client);
+
+	return 0;
+error:
+	return 1;
+}
+
+/* Queues what the stream has taken since the last flush as a packed
+ * message, ahead of the file blocks that are to fill the queue up */
+static int client_pack_flush(client_t *client) {
+	assert(client);
+
+	codec_stream_t *pack = &client->pack;
+	outq_frame_t *frame;
+
+	if(!client->pack_pending)
+		return 0;
+
+	check_quiet(!codec_stream_flush(pack));
+	const msg_MSG_packed_t m = {.len = pack->out_len, .data = pack->out};
+	check_quiet(frame = outq_frame_new(msg_size_MSG_packed(&m)));
+	msg_encode_MSG_packed(frame->data, &m);
+	check_quiet(!outq_push(&client->out, frame, 0));
+
+	pack->out_len = 0;
+	client->pack_pending = 0;
+
+	return 0;
+error:
+	log_err("Couldn't deflate messages for <%s>.", client->name);
+	return 1;
+}
+
+/* Queues a frame that is shared with other clients; the caller keeps its
+ * reference */
+int client_send_frame(server_t *server, client_t *client, outq_frame_t *frame) {
+	assert(server);
+	assert(client);
+	assert(frame);
+
+	return client_queue(server, client, outq_frame_ref(frame), 0);
+}
+
+/* Write out as much queued data as the socket takes, topping the queue up
+ * with file data while it is below the low watermark */
+int client_flush(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+
+	ssize_t left;
+
+	check_quiet(!client_pack_flush(client));
+
+	if(server->config.backend == SERVER_URING) {
+		while(!client->read_busy && !client->closing
+				&& client->out.bytes <= server->config.out_low_wm
+				&& client_send_file_part(server, client));
+		return client_start_send(server, client);
+	}
+
+	while(1) {
+		int refilled = 0;
+
+		check_quiet((left = outq_flush(&client->out, client->fd)) >= 0);
+		if(!left)
+			client->dropping = 0;
+		if(left)
+			break;
+
+		while(!client->closing && client->out.bytes <= server->config.out_low_wm
+				&& client_send_file_part(server, client))
+			refilled = 1;
+		if(!refilled)
+			break;
+	}
+
+	client_update_events(server, client);
+
+	return 0;
+error:
+	return 1;
+}
+
+/* Keeps a receive request in flight while the client is connected; only
+ * called once the last one's data has been handled, as the buffer may be
+ * compacted before the next */
+int client_start_recv(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+	assert(client->shard == shard_self);
+
+	struct io_uring_sqe *sqe;
+	char *dst;
+
+	if(client->recv_busy || client->closing)
+		return 0;
+
+	check_mem(dst = buffer_reserve(&client->in, SERVER_RECV_SZ));
+	check_quiet(sqe = uring_sqe(&client->shard->ring));
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client->fd;
+	sqe->addr = (uintptr_t)dst;
+	sqe->len = SERVER_RECV_SZ;
+	sqe->user_data = shard_tag(client, SHARD_OP_RECV);
+
+	client->recv_busy = 1;
+	client->inflight++;
+
+	return 0;
+error:
+	return 1;
+}
+
+void client_recv_done(server_t *server, client_t *client, int res) {
+	assert(server);
+	assert(client);
+	assert(client->recv_busy);
+
+	client->recv_busy = 0;
+	client->inflight--;
+
+	if(client->closing)
+		return;
+
+	if(res > 0) {
+		buffer_commit(&client->in, res);
+	} else if(res == 0) {
+		client_kick(server, client);
+		return;
+	} else if(res != -EINTR && res != -EAGAIN) {
+		log_warn("Couldn't read from <%s>: %s", client->name, strerror(-res));
+		client_kick(server, client);
+		return;
+	}
+
+	/* Handled, and the request renewed, with the rest of the ready clients */
+	if(!client->ready && vector_add(&client->shard->ready, &client, 1))
+		client->ready = 1;
+}
+
+/* Hands the front of the queue to the kernel, unless it already has some */
+static int client_start_send(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+	assert(client->shard == shard_self);
+
+	struct io_uring_sqe *sqe;
+
+	if(client->send_busy || !client->out.bytes)
+		return 0;
+
+	client->send_msg = (struct msghdr){
+		.msg_iov = client->send_iov,
+		.msg_iovlen = outq_prepare(&client->out, client->send_iov, CLIENT_URING_IOV)
+	};
+
+	check_quiet(sqe = uring_sqe(&client->shard->ring));
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = client->fd;
+	sqe->addr = (uintptr_t)&client->send_msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = shard_tag(client, SHARD_OP_SEND);
+
+	client->send_busy = 1;
+	client->inflight++;
+
+	return 0;
+error:
+	return 1;
+}
+
+void client_send_done(server_t *server, client_t *client, int res) {
+	assert(server);
+	assert(client);
+	assert(client->send_busy);
+
+	client->send_busy = 0;
+	client->inflight--;
+
+	if(client->closing)
+		return;
+
+	if(res < 0 && res != -EINTR && res != -EAGAIN) {
+		log_warn("Couldn't write to <%s>: %s", client->name, strerror(-res));
+		client_kick(server, client);
+		return;
+	}
+
+	if(res > 0)
+		outq_consume(&client->out, res);
+	if(!client->out.bytes)
+		client->dropping = 0;
+
+	/* Send the rest, and top the queue up with file data */
+	client_mark_dirty(server, client);
+}
+
+void client_read_done(server_t *server, client_t *client, int res) {
+	assert(server);
+	assert(client);
+	assert(client->read_busy);
+
+	file_block_t block = client->read_block;
+
+	client->read_block.body = NULL;
+	client->read_busy = 0;
+	client->inflight--;
+
+	if(client->closing) {
+		outq_frame_unref(block.body);
+		return;
+	}
+
+	/* Downloads only leave the table once their last block is queued */
+	client_transfer_t *transfer = client_get_transfer(client, client->read_transfer);
+	assert(transfer && !transfer->upload);
+
+	if(res < 0 || (uint32_t)res != block.len) {
+		log_err("Couldn't read file for <%s>: %s", client->name,
+				res < 0 ? strerror(-res) : "short read");
+		outq_frame_unref(block.body);
+		client_kick(server, client);
+		return;
+	}
+
+	/* Compressed here, if at all, now that it is in memory */
+	client_pack_block(client, transfer, &block, block.body->data, block.body);
+	if(!block.body) {
+		log_err("Couldn't send file to <%s>.", client->name);
+		client_kick(server, client);
+		return;
+	}
+
+	file_entry_put_block(transfer->file, &block);
+	if(client_queue_file_part(server, client, transfer, &block))
+		client_kick(server, client);
 }
@@ -5,32 +5,149 @@
 #include "server.h"
 #include "vector.h"
 #include "status.h"
+#include "outq.h"
+#include "buffer.h"
+#include "msg.h"
+#include "file_entry.h"
+#include "codec.h"
 
 struct _chatroom_t;
 
+/* Frames handed to a single io_uring sendmsg request */
+#define CLIENT_URING_IOV 16
+
+/* File transfers a single connection may have in progress */
+#define CLIENT_MAX_TRANSFERS 64
+
+/* A file being uploaded by the client, or downloaded to it. A new upload
+ * has no file id until the client has answered the proof of its content */
+typedef struct _client_transfer_t {
+	uint16_t id; /* Chosen by the client */
+	int upload;
+	uint16_t file_id;
+	file_entry_t *file;
+	uint64_t offset, end; /* Downloads stop at end */
+	uint8_t codecs; /* Those an upload uses, or a download takes */
+	uint8_t proof[SHA256_LEN]; /* The answer expected, if the content is stored */
+} client_transfer_t;
+
+/* What came of checking a file block, see client_check_file_part() */
+typedef enum _client_block_status_t {
+	CLIENT_BLOCK_OK, /* Written to the spool, and to be taken in */
+	CLIENT_BLOCK_STALE, /* Sent before the client heard it had to go back */
+	CLIENT_BLOCK_DAMAGED, /* To be asked for again */
+	CLIENT_BLOCK_BAD, /* Refused */
+} client_block_status_t;
+
+/* The file block at the front of the receive buffer, decoded, checked and
+ * written out ahead of its handler, without the lock */
+typedef struct _client_block_t {
+	const char *frame; /* It came in; NULL if there is none */
+	client_block_status_t status;
+	uint32_t len; /* Raw */
+	sha256_t hash; /* The upload's, taken on over the block */
+	/* Deflated blocks are inflated into this, which is kept while the
+	 * client has an upload in progress */
+	char *out;
+	size_t out_sz;
+} client_block_t;
+
+/* Everything but the name, status and chat list is owned by the client's
+ * shard, and only touched from its thread */
 typedef struct _client_t {
+	uint16_t id;
+	shard_t *shard;
 	int fd;
+	uint32_t events; /* Currently registered epoll events */
+	outq_t out;
+	buffer_t in;
+	/* Message being handled, valid until its handler returns */
+	const char *frame;
+	size_t frame_len;
+	int ready, dirty, closing, dropping;
 	char name[256];
 	user_status_t status;
 	vector_t chatrooms;
 
-	/* File transfer information */
-	char fname[256];
-	uint32_t fsize, offset;
-	int file_fd;
-	int sending;
-	uint16_t fchat;
+	/* File transfers in progress; downloads take turns sending a block,
+	 * starting from next_transfer */
+	vector_t transfers;
+	size_t next_transfer;
+	/* File block size agreed in the handshake; 0 until then */
+	uint32_t chunk;
+	client_block_t block;
+	/* Its change in the presence batch, plus one, or 0 if there is none,
+	 * and how many of the batch's changes it knows of from its snapshot */
+	size_t presence, presence_seen;
+	/* Deflates the messages other than file blocks, if agreed in the
+	 * handshake; what it has taken since the last flush goes out as a
+	 * single packed message */
+	codec_stream_t pack;
+	int packing, pack_pending;
+
+	/* io_uring backend: requests in flight, which refer to the client's
+	 * memory, and the state they use */
+	unsigned int inflight;
+	int recv_busy, send_busy, read_busy;
+	struct msghdr send_msg;
+	struct iovec send_iov[CLIENT_URING_IOV];
+	file_block_t read_block; /* Its body is the read's buffer */
+	uint16_t read_transfer;
 } client_t;
 
-void client_send_msg(const server_t *server, const struct _chatroom_t *chatroom, const client_t *to, const client_t *from, const char *buf);
-int client_recv_msg(server_t *server, struct _chatroom_t *chatroom, client_t *client, const char *buf);
+/* Queues a message for the client; the arguments are the message's fields,
+ * in order. Evaluates to 0 on success */
+#define client_send(server, client, type, ...) \
+	_client_send((server), (client), 0, type, __VA_ARGS__)
+
+/* Encodes a message into a new frame, to be queued for several clients with
+ * client_send_frame(). Evaluates to NULL on failure */
+#define client_frame(type, ...) ({ \
+	const msg_##type##_t _msg = { __VA_ARGS__ }; \
+	outq_frame_t *_frame = outq_frame_new(msg_size_##type(&_msg)); \
+	if(_frame) \
+		msg_encode_##type(_frame->data, &_msg); \
+	_frame; \
+})
 
-void client_connect(server_t *server, client_t *client, int fd);
+#define _client_send(server, client, bulk, type, ...) ({ \
+	outq_frame_t *_frame = client_frame(type, __VA_ARGS__); \
+	_frame ? client_queue((server), (client), _frame, (bulk)) : 1; \
+})
+
+/* Decodes the message being handled into a msg_<type>_t view, whose
+ * variable length fields point into the receive buffer */
+#define client_view(client, type, m) \
+	msg_decode_##type((client)->frame, (client)->frame_len, (m))
+
+int client_queue(server_t *server, client_t *client, outq_frame_t *frame, int bulk);
+int client_send_frame(server_t *server, client_t *client, outq_frame_t *frame);
+int client_flush(server_t *server, client_t *client);
+void client_kick(server_t *server, client_t *client);
+void client_wake(server_t *server, client_t *client);
+
+int client_recv_msg(server_t *server, struct _chatroom_t *chatroom, client_t *client, const char *buf, uint16_t len);
+
+void client_connect(server_t *server, client_t *client, uint16_t id, shard_t *shard, int fd);
+void client_greet(server_t *server, client_t *client);
 void client_disconnect(server_t *server, client_t *client);
+void client_free(server_t *server, client_t *client);
+
+/* io_uring backend */
+int client_start_recv(server_t *server, client_t *client);
+void client_recv_done(server_t *server, client_t *client, int res);
+void client_send_done(server_t *server, client_t *client, int res);
+void client_read_done(server_t *server, client_t *client, int res);
+
+int client_start_file_send(server_t *server, client_t *client, uint16_t transfer_id, const char *fname, uint16_t fname_len, uint64_t fsize, uint16_t chat_id, const char *hash, uint8_t hash_len, uint8_t codecs);
+/* Takes the answer to the proof asked for by client_start_file_send() */
+int client_prove_file_send(server_t *server, client_t *client, uint16_t transfer_id, const char *answer, uint8_t len);
+int client_resume_file_send(server_t *server, client_t *client, uint16_t transfer_id, uint16_t file_id, uint64_t fsize, uint16_t chat_id, const char *hash, uint8_t hash_len, uint8_t codecs);
+int client_start_file_recv(server_t *server, client_t *client, uint16_t transfer_id, uint16_t chat_id, uint32_t file_id, uint64_t offset, uint64_t length, uint8_t codecs);
+void client_check_file_part(server_t *server, client_t *client);
+int client_recv_file_part(server_t *server, client_t *client, uint16_t transfer_id);
+int client_send_file_part(server_t *server, client_t *client);
 
-int client_start_file_send(client_t *client, char *fname, uint32_t fsize, uint16_t chat_id);
-int client_start_file_recv(server_t *server, client_t *client, uint16_t chat_id, uint32_t file_id);
-int client_recv_file_part(server_t *server, client_t *client, char *buf, uint16_t len);
-void client_send_file_part(client_t *client);
+void client_update_events(server_t *server, client_t *client);
 
 #endif
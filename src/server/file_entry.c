@@ -0,0 +1,128 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "file_entry.h"
+#include "msg.h"
+
+/* Slot of the block at offset. Blocks are a multiple of FILE_BLOCK_SZ
+ * apart, by as many as the connection agreed on, so the offset is hashed to
+ * spread them out over the slots */
+static inline size_t file_entry_slot(uint64_t offset) {
+	return ((offset / FILE_BLOCK_SZ) * 0x9e3779b97f4a7c15ULL >> 32) % FILE_ENTRY_BLOCKS;
+}
+
+static void file_entry_drop_block(file_entry_t *file, file_block_t *block) {
+	file->blocks_sz -= block->body->len;
+	outq_frame_unref(block->body);
+	block->body = NULL;
+}
+
+/* Lets go of the blocks kept; under blocks_lock */
+static void file_entry_drop_blocks(file_entry_t *file) {
+	if(!file->blocks)
+		return;
+
+	for(size_t i=0; i<FILE_ENTRY_BLOCKS; i++) {
+		if(file->blocks[i].body)
+			file_entry_drop_block(file, &file->blocks[i]);
+	}
+	free(file->blocks);
+	file->blocks = NULL;
+	assert(!file->blocks_sz);
+}
+
+void file_entry_unref(store_t *store, file_entry_t *file) {
+	assert(store);
+	assert(file);
+	assert(__atomic_load_n(&file->refs, __ATOMIC_RELAXED) > 0);
+
+	if(__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	/* The blocks pin the contents */
+	assert(!file->downloads);
+	file_entry_drop_blocks(file);
+	pthread_mutex_destroy(&file->blocks_lock);
+
+	if(file->contents)
+		store_release(store, file->contents);
+	vector_free(&file->readers);
+	free(file);
+}
+
+void file_entry_add_download(file_entry_t *file) {
+	assert(file);
+
+	pthread_mutex_lock(&file->blocks_lock);
+	file->downloads++;
+	pthread_mutex_unlock(&file->blocks_lock);
+}
+
+void file_entry_del_download(file_entry_t *file) {
+	assert(file);
+
+	pthread_mutex_lock(&file->blocks_lock);
+	assert(file->downloads > 0);
+	if(--file->downloads < 2)
+		file_entry_drop_blocks(file);
+	pthread_mutex_unlock(&file->blocks_lock);
+}
+
+int file_entry_get_block(file_entry_t *file, uint64_t offset, uint32_t len, uint8_t codecs, file_block_t *block) {
+	assert(file);
+	assert(block);
+
+	const file_block_t *b;
+	int found = 0;
+
+	pthread_mutex_lock(&file->blocks_lock);
+	if(file->blocks && (b = &file->blocks[file_entry_slot(offset)])->body
+			&& b->offset == offset && b->len <= len
+			&& (b->codec == MSG_CODEC_RAW || codecs & MSG_CODEC_BIT(b->codec))) {
+		*block = *b;
+		outq_frame_ref(block->body);
+		found = 1;
+	}
+	pthread_mutex_unlock(&file->blocks_lock);
+
+	return !found;
+}
+
+void file_entry_put_block(file_entry_t *file, const file_block_t *block) {
+	assert(file);
+	assert(block);
+	assert(block->body);
+	assert(block->body->len <= FILE_ENTRY_BLOCKS_SZ);
+
+	file_block_t *slot;
+
+	pthread_mutex_lock(&file->blocks_lock);
+
+	if(file->downloads < 2)
+		goto out;
+	if(!file->blocks && !(file->blocks = calloc(FILE_ENTRY_BLOCKS, sizeof(*file->blocks))))
+		goto out;
+
+	slot = &file->blocks[file_entry_slot(block->offset)];
+	if(slot->body)
+		file_entry_drop_block(file, slot);
+
+	/* Make room by dropping the blocks furthest back, which the
+	 * downloads have most likely all sent by now */
+	while(file->blocks_sz + block->body->len > FILE_ENTRY_BLOCKS_SZ) {
+		file_block_t *oldest = NULL;
+		for(size_t i=0; i<FILE_ENTRY_BLOCKS; i++) {
+			file_block_t *b = &file->blocks[i];
+			if(b->body && b->body->len && (!oldest || b->offset < oldest->offset))
+				oldest = b;
+		}
+		file_entry_drop_block(file, oldest);
+	}
+
+	*slot = *block;
+	outq_frame_ref(slot->body);
+	file->blocks_sz += slot->body->len;
+
+out:
+	pthread_mutex_unlock(&file->blocks_lock);
+}
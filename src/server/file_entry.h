@@ -2,12 +2,91 @@
 #define FILE_ENTRY_H
 
 #include <stdint.h>
+#include <pthread.h>
+#include "vector.h"
+#include "sha256.h"
+#include "store.h"
+#include "outq.h"
 
+/* Blocks of a file kept for its concurrent downloads, and the most bytes
+ * of them kept in memory; blocks sent with sendfile() only take up a slot */
+#define FILE_ENTRY_BLOCKS 1024
+#define FILE_ENTRY_BLOCKS_SZ (16<<20)
+
+/* A block read, checksummed and maybe compressed for one download, which
+ * the others can send as it is, with a header of their own */
+typedef struct _file_block_t {
+	uint64_t offset;
+	uint32_t len, crc; /* Of the block itself */
+	uint8_t codec; /* The body's */
+	outq_frame_t *body; /* Holds the block's data, or its file range; NULL
+	                       if the slot is free */
+} file_block_t;
+
+/* A file shared in a chat. It is announced as soon as its upload starts,
+ * and downloads follow the upload as its blocks land in the spool file.
+ * An upload cut short by a disconnect can be resumed later, by its id, and
+ * the downloads wait for it meanwhile. Downloads read committed without the
+ * lock, from their own shards, so entries are allocated separately and
+ * never move.
+ * Entries are reference counted: the file table holds one until the chat
+ * the file was shared in closes, and each transfer of it holds one.
+ * While several clients download the file at once, the blocks last sent
+ * are kept, so that downloads in step with each other read and checksum
+ * each block once between them. Those further behind read their own, from
+ * the page cache by then */
 typedef struct _file_entry_t {
-	int fd;
+	unsigned int refs; /* Atomic */
+	store_file_t *contents; /* Read through store_pin() */
 	char fname[256];
-	uint32_t fsize;
+	uint64_t fsize;
 	uint16_t chat_id, sender;
+
+	/* Bytes of the upload in the spool so far; atomic */
+	uint64_t committed;
+
+	/* The SHA-256 the uploader gave for the contents, which the downloads
+	 * check them against. The upload is hashed as it lands in its temporary
+	 * spool file, to check it too: each block by the uploader's shard,
+	 * before the lock, and the result taken on under it */
+	uint8_t digest[SHA256_LEN];
+	sha256_t hash;
+
+	/* Until the upload is complete: whether a client is uploading it right
+	 * now, and the ids of the clients downloading it, to wake up when more
+	 * of it lands. Under the clients lock */
+	int streaming, uploading;
+	vector_t readers;
+
+	/* Downloads in progress, and the blocks lately sent to them, in slots
+	 * picked by offset; those furthest back go first when the memory runs
+	 * out. Allocated only while there are several downloads. Under
+	 * blocks_lock, as downloads run on their own shards */
+	pthread_mutex_t blocks_lock;
+	unsigned int downloads;
+	file_block_t *blocks;
+	size_t blocks_sz;
 } file_entry_t;
 
+static inline file_entry_t *file_entry_ref(file_entry_t *file) {
+	__atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+	return file;
+}
+
+/* The last reference frees the entry, and releases its contents */
+void file_entry_unref(store_t *store, file_entry_t *file);
+
+/* Counts a download in or out; the blocks kept go once none is left */
+void file_entry_add_download(file_entry_t *file);
+void file_entry_del_download(file_entry_t *file);
+
+/* A block kept from offset, of at most len bytes, and raw or in one of the
+ * given codecs, with a reference to its body for the caller; 0 if there is
+ * one */
+int file_entry_get_block(file_entry_t *file, uint64_t offset, uint32_t len, uint8_t codecs, file_block_t *block);
+
+/* Keeps a block for the other downloads, if there are any; block->body
+ * stays the caller's */
+void file_entry_put_block(file_entry_t *file, const file_block_t *block);
+
 #endif
@@ -3,34 +3,34 @@
 #include "client.h"
 #include "chatroom.h"
 #include "debug.h"
+#include "macros.h"
 #include "utilities/file.h"
 
-char *buf = NULL;
-
 int msg_handle_start_chat(server_t *server, client_t *client) {
 	assert(server);
 	assert(client);
 
-	uint16_t num_ids, *client_ids, unused;
+	msg_MSG_start_chat_t m;
 	client_t **clients;
 
-	check_quiet(!msg_recv(client->fd, MSG_start_chat, &unused, &num_ids, &buf));
+	check_quiet(client_view(client, MSG_start_chat, &m));
+
+	/* Those invited must know everyone in the chat */
+	presence_flush(server);
 
-	client_ids = (uint16_t *)&buf[0];
-	clients = alloca(sizeof(*clients)*num_ids);
+	clients = alloca(sizeof(*clients)*m.num_ids);
 
 	/* Ensure all ids are valid */
-	for(unsigned int i=0; i<num_ids; i++) {
-		/* FIXME: move to sp_vector */
-		check_quiet(client_ids[i] <= server->clients.largest_id);
-		check_quiet(clients[i] = sp_vector_get(&server->clients, client_ids[i]));
+	for(unsigned int i=0; i<m.num_ids; i++) {
+		uint16_t client_id = msg_ids_get(m.ids, i);
+		check_quiet(clients[i] = server_client(server, client_id));
 	}
 
 	/* Create the new chatroom */
 	chatroom_t *chatroom;
 	check_quiet(chatroom = chatroom_new(server));
 	chatroom_client_add(server, chatroom, client);
-	for(unsigned int i=0; i<num_ids; i++)
+	for(unsigned int i=0; i<m.num_ids; i++)
 		chatroom_client_add(server, chatroom, clients[i]);
 
 	chatroom_start(server, chatroom);
@@ -44,12 +44,12 @@ int msg_handle_leave_chat(server_t *server, client_t *client) {
 	assert(server);
 	assert(client);
 
-	uint16_t chat_id, unused;
+	msg_MSG_leave_chat_t m;
 	chatroom_t *chatroom;
 
-	check_quiet(!msg_recv(client->fd, MSG_leave_chat, &chat_id, &unused));
-	check_quiet(chat_id <= server->chatrooms.largest_id);;
-	check_quiet(chatroom = sp_vector_get(&server->chatrooms, chat_id));
+	check_quiet(client_view(client, MSG_leave_chat, &m));
+	check_quiet(m.chat_id && m.chat_id <= server->chatrooms.largest_id);
+	check_quiet(chatroom = sp_vector_get(&server->chatrooms, m.chat_id));
 	chatroom_client_leave(server, chatroom, client);
 
 	return 0;
@@ -61,14 +61,14 @@ int msg_handle_msg(server_t *server, client_t *client) {
 	assert(server);
 	assert(client);
 
-	uint16_t chat_id, len, unused;
+	msg_MSG_msg_t m;
 	chatroom_t *chatroom;
 
-	check_quiet(!msg_recv(client->fd, MSG_msg, &chat_id, &unused, &len, &buf));
-	check_quiet(chatroom = sp_vector_get(&server->chatrooms, chat_id));
+	check_quiet(client_view(client, MSG_msg, &m));
+	check_quiet(m.chat_id && m.chat_id <= server->chatrooms.largest_id);
+	check_quiet(chatroom = sp_vector_get(&server->chatrooms, m.chat_id));
 	check_quiet(chatroom_client_is_present(server, chatroom, client));
-	buf[len] = 0;
-	client_recv_msg(server, chatroom, client, buf);
+	client_recv_msg(server, chatroom, client, m.msg, m.len);
 
 	return 0;
 error:
@@ -79,18 +79,36 @@ int msg_handle_send_file(server_t *server, client_t *client) {
 	assert(server);
 	assert(client);
 
-	uint16_t chat_id, len, unused;
-	uint32_t fsize;
-	check_quiet(!msg_recv(client->fd,
-				MSG_send_file, &chat_id, &fsize, &len, &buf, &unused, &unused));
-	buf[len] = 0;
+	msg_MSG_send_file_t m;
+
+	check_quiet(client_view(client, MSG_send_file, &m));
+
+	if(m.file_id) {
+		log_info("Resuming upload of file %hu from client <%s>", m.file_id, client->name);
+		check_quiet(!client_resume_file_send(server, client, m.transfer_id, m.file_id, m.fsize, m.chat_id,
+					m.hash, m.hash_len, m.codecs));
+		return 0;
+	}
 
-	log_info("Beginning to receive file '%s' from client <%s>: size %u",
-			buf, client->name, fsize);
+	log_info("Beginning to receive file '%.*s' from client <%s>: size %" PRIu64,
+			(int)m.len, m.fname, client->name, m.fsize);
 
-	/* FIXME: assumes buf is null-terminated, is it? */
-	check(len < 256, "Filename too long.");
-	check_quiet(!client_start_file_send(client, buf, fsize, chat_id));
+	check_quiet(!client_start_file_send(server, client, m.transfer_id, m.fname, m.len, m.fsize, m.chat_id,
+				m.hash, m.hash_len, m.codecs));
+
+	return 0;
+error:
+	return 1;
+}
+
+int msg_handle_file_proof(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+
+	msg_MSG_file_proof_t m;
+
+	check_quiet(client_view(client, MSG_file_proof, &m));
+	check_quiet(!client_prove_file_send(server, client, m.transfer_id, m.data, m.len));
 
 	return 0;
 error:
@@ -101,13 +119,15 @@ int msg_handle_recv_file(server_t *server, client_t *client) {
 	assert(server);
 	assert(client);
 
-	uint16_t chat_id;
-	uint32_t file_id;
+	msg_MSG_recv_file_t m;
 
-	log_info("Beginning to send file to client <%s>, %d", client->name, client->file_fd);
+	check_quiet(client_view(client, MSG_recv_file, &m));
 
-	check_quiet(!msg_recv(client->fd, MSG_recv_file, &chat_id, &file_id));
-	check_quiet(client_start_file_recv(server, client, chat_id, file_id));
+	log_info("Beginning to send file %u to client <%s>, from offset %" PRIu64,
+			m.file_id, client->name, m.offset);
+
+	check_quiet(!client_start_file_recv(server, client, m.transfer_id, m.chat_id, m.file_id,
+				m.offset, m.length, m.codecs));
 
 	return 0;
 error:
@@ -118,10 +138,10 @@ int msg_handle_file_part(server_t *server, client_t *client) {
 	assert(server);
 	assert(client);
 
-	uint16_t len;
+	msg_MSG_file_part_t m;
 
-	check_quiet(!msg_recv(client->fd, MSG_file_part, &len, &buf));
-	check_quiet(!client_recv_file_part(server, client, buf, len));
+	check_quiet(client_view(client, MSG_file_part, &m));
+	check_quiet(!client_recv_file_part(server, client, m.transfer_id));
 
 	return 0;
 error:
@@ -132,37 +152,75 @@ int msg_handle_user_update(struct _server_t *server, struct _client_t *client) {
 	assert(server);
 	assert(client);
 
-	uint16_t unused;
-	uint8_t status, len;
-	client_t *other;
+	msg_MSG_user_update_t m;
+	client_t **other;
 
-	check_quiet(!msg_recv(client->fd, MSG_user_update, &unused, &status, &len, &buf));
-	buf[len] = 0;
+	check_quiet(client_view(client, MSG_user_update, &m));
 
 	/* Check other clients' names */
 	sp_vector_foreach(&server->clients, other) {
-		if(other == client) continue;
-		if(!strcmp(buf, other->name)) {
+		if(*other == client) continue;
+		if(strlen((*other)->name) == m.len && !memcmp(m.name, (*other)->name, m.len)) {
 			goto skip_set_name;
 		}
 	}
 
 	/* Set name */
-	strncpy(client->name, buf, sizeof(client->name));
+	memcpy(client->name, m.name, m.len);
+	client->name[m.len] = '\0';
 
 skip_set_name:
 
 	/* Set status */
-	if(status < US_NUM_STATUSES)
-		client->status = status;
+	if(m.status < US_NUM_STATUSES)
+		client->status = m.status;
 
-	/* Distribute notification message: also tell the client */
-	sp_vector_foreach(&server->clients, other) {
-		msg_send(other->fd, MSG_user_update,
-				(uint16_t)sp_vector_indexof(&server->clients, client),
-				status, (uint8_t)strlen(client->name), client->name);
+	/* Tell the client straight away, and everyone with the next batch */
+	check_quiet(!client_send(server, client, MSG_user_update, client->id,
+				(uint8_t)client->status, (uint8_t)strlen(client->name), client->name));
+	presence_note(server, client, 0);
+
+	return 0;
+error:
+	return 1;
+}
+
+/* Agrees on the file block size: the smaller of the client's and ours, in
+ * whole blocks */
+int msg_handle_hello(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+
+	msg_MSG_hello_t m;
+
+	check_quiet(client_view(client, MSG_hello, &m));
+	check(!client->chunk, "<%s> said hello twice.", client->name);
+
+	if(m.version != MSG_VERSION) {
+		log_err("<%s> speaks protocol version %hu, not %u.", client->name,
+				m.version, MSG_VERSION);
+		client_kick(server, client);
+		return 1;
 	}
 
+	client->chunk = min(m.chunk, server->config.chunk);
+	client->chunk = max(client->chunk - client->chunk % FILE_BLOCK_SZ, FILE_BLOCK_SZ);
+
+	log_info("<%s> uses %u byte file blocks.", client->name, client->chunk);
+
+	/* Everything after the answer goes through the stream, if both sides
+	 * want it; it is freed with the client */
+	uint8_t codecs = 0;
+	if(server->config.pack && (m.codecs & MSG_CODEC_BIT(MSG_CODEC_DEFLATE))
+			&& !codec_stream_init(&client->pack, server->config.pack))
+		codecs = MSG_CODEC_BIT(MSG_CODEC_DEFLATE);
+
+	int err = client_send(server, client, MSG_hello, MSG_VERSION, client->chunk, codecs);
+	client->packing = codecs != 0;
+	check_quiet(!err);
+
+	client_greet(server, client);
+
 	return 0;
 error:
 	return 1;
@@ -14,6 +14,11 @@ int msg_handle_send_file(struct _server_t *server, struct _client_t *client);
 int msg_handle_file_part(struct _server_t *server, struct _client_t *client);
 int msg_handle_recv_file(struct _server_t *server, struct _client_t *client);
 int msg_handle_user_update(struct _server_t *server, struct _client_t *client);
+#define msg_handle_file_status NULL
+int msg_handle_hello(struct _server_t *server, struct _client_t *client);
+#define msg_handle_packed NULL
+#define msg_handle_users NULL
+int msg_handle_file_proof(struct _server_t *server, struct _client_t *client);
 
 typedef int (*msg_handler_t)(struct _server_t *server, struct _client_t *client);
 
@@ -0,0 +1,286 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "outq.h"
+#include "debug.h"
+
+static const char * const outq_policy_names[OUTQ_NUM_POLICIES] = {
+	[OUTQ_DROP]       = "drop",
+	[OUTQ_DISCONNECT] = "disconnect",
+	[OUTQ_PAUSE]      = "pause",
+};
+
+/* Initial size of a queue's ring */
+#define OUTQ_MIN_CAP 16
+
+void outq_init(outq_t *q) {
+	assert(q);
+
+	memset(q, 0, sizeof(*q));
+}
+
+static inline outq_frame_t *outq_at(const outq_ring_t *r, size_t i) {
+	assert(i < r->count);
+
+	return r->frames[(r->head + i) & (r->cap - 1)];
+}
+
+static void outq_ring_free(outq_ring_t *r) {
+	for(size_t i=0; i<r->count; i++)
+		outq_frame_unref(outq_at(r, i));
+	free(r->frames);
+}
+
+void outq_free(outq_t *q) {
+	assert(q);
+
+	outq_ring_free(&q->wire);
+	outq_ring_free(&q->bulk);
+	outq_init(q);
+}
+
+outq_frame_t *outq_frame_new(size_t len) {
+	assert(len > 0);
+
+	return outq_frame_file(len, -1, 0, 0);
+}
+
+outq_frame_t *outq_frame_file(size_t len, int fd, off_t off, size_t file_len) {
+	assert(len > 0 || file_len > 0);
+	assert((fd >= 0) == (file_len > 0));
+
+	outq_frame_t *frame;
+	check_mem(frame = malloc(sizeof(*frame) + len));
+	frame->refs = 1;
+	frame->len = len;
+	frame->fd = fd;
+	frame->file_off = off;
+	frame->file_len = file_len;
+	frame->body = NULL;
+	frame->release = NULL;
+	frame->release_arg = NULL;
+
+	return frame;
+error:
+	return NULL;
+}
+
+outq_frame_t *outq_frame_body(size_t len, outq_frame_t *body) {
+	assert(body);
+	assert(!body->body);
+
+	outq_frame_t *frame;
+
+	if(!(frame = outq_frame_new(len))) {
+		outq_frame_unref(body);
+		return NULL;
+	}
+	frame->body = body;
+
+	return frame;
+}
+
+outq_frame_t *outq_frame_ref(outq_frame_t *frame) {
+	assert(frame);
+	assert(__atomic_load_n(&frame->refs, __ATOMIC_RELAXED) > 0);
+
+	__atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+	return frame;
+}
+
+void outq_frame_unref(outq_frame_t *frame) {
+	assert(frame);
+	assert(__atomic_load_n(&frame->refs, __ATOMIC_RELAXED) > 0);
+
+	if(__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	if(frame->release)
+		frame->release(frame->release_arg);
+	if(frame->body)
+		outq_frame_unref(frame->body);
+	free(frame);
+}
+
+/* Doubles the ring, unwrapping it so that the head is at index 0 */
+static int outq_grow(outq_ring_t *r) {
+	assert(r);
+
+	size_t cap = r->cap ? 2*r->cap : OUTQ_MIN_CAP;
+	outq_frame_t **frames;
+
+	check_mem(frames = malloc(cap*sizeof(*frames)));
+	for(size_t i=0; i<r->count; i++)
+		frames[i] = outq_at(r, i);
+
+	free(r->frames);
+	r->frames = frames;
+	r->cap = cap;
+	r->head = 0;
+
+	return 0;
+error:
+	return 1;
+}
+
+static int outq_ring_push(outq_ring_t *r, outq_frame_t *frame) {
+	if(r->count == r->cap)
+		check_quiet(!outq_grow(r));
+
+	r->frames[(r->head + r->count++) & (r->cap - 1)] = frame;
+
+	return 0;
+error:
+	return 1;
+}
+
+static outq_frame_t *outq_ring_pop(outq_ring_t *r) {
+	outq_frame_t *frame = outq_at(r, 0);
+
+	r->head = (r->head + 1) & (r->cap - 1);
+	r->count--;
+
+	return frame;
+}
+
+int outq_push(outq_t *q, outq_frame_t *frame, int bulk) {
+	assert(q);
+	assert(frame);
+
+	/* Bulk frames move onto an empty wire queue, which must have room */
+	if(bulk && !q->wire.cap)
+		check_quiet(!outq_grow(&q->wire));
+
+	check_quiet(!outq_ring_push(bulk ? &q->bulk : &q->wire, frame));
+	q->bytes += outq_frame_size(frame);
+
+	return 0;
+error:
+	outq_frame_unref(frame);
+	return 1;
+}
+
+int outq_prepare(outq_t *q, struct iovec *iov, int max) {
+	assert(q);
+	assert(iov);
+	assert(max > 0);
+
+	int n = 0;
+
+	/* The wire is idle: let the next bulk frame through */
+	if(!q->wire.count && q->bulk.count) {
+		assert(q->wire.cap);
+		outq_ring_push(&q->wire, outq_ring_pop(&q->bulk));
+	}
+
+	for(size_t i=0; i<q->wire.count && n < max; i++) {
+		outq_frame_t *frame = outq_at(&q->wire, i);
+		size_t off = i ? 0 : q->head_off;
+
+		/* The frame's data, then its body's */
+		for(; frame && n < max; frame = frame->body) {
+			if(off < frame->len) {
+				iov[n++] = (struct iovec){
+					.iov_base = frame->data + off,
+					.iov_len = frame->len - off
+				};
+			}
+			off = off > frame->len ? off - frame->len : 0;
+			if(frame->file_len)
+				return n;
+		}
+	}
+
+	return n;
+}
+
+void outq_consume(outq_t *q, size_t len) {
+	assert(q);
+	assert(len <= q->bytes);
+
+	q->bytes -= len;
+
+	/* Release every frame that has been written completely */
+	len += q->head_off;
+	while(q->wire.count && len >= outq_frame_size(outq_at(&q->wire, 0))) {
+		outq_frame_t *frame = outq_ring_pop(&q->wire);
+		len -= outq_frame_size(frame);
+		outq_frame_unref(frame);
+	}
+	q->head_off = len;
+}
+
+ssize_t outq_flush(outq_t *q, int fd) {
+	assert(q);
+	assert(fd >= 0);
+
+	while(q->bytes) {
+		struct iovec iov[OUTQ_MAX_IOV];
+		struct msghdr msg = {.msg_iov = iov};
+		int n = outq_prepare(q, iov, OUTQ_MAX_IOV);
+		outq_frame_t *head = outq_at(&q->wire, 0);
+		ssize_t r;
+
+		if(!n) {
+			/* The head frame is down to its file range, or its body's */
+			size_t data = head->len;
+			if(head->body) {
+				data += head->body->len;
+				head = head->body;
+			}
+			assert(q->head_off >= data);
+			off_t off = head->file_off + (q->head_off - data);
+			r = sendfile(fd, head->fd, &off, head->file_len - (q->head_off - data));
+		} else {
+			/* Gather as many frames as possible into one call. No MSG_MORE
+			 * before a file range: it stalls the socket for a while if the
+			 * range then doesn't fit under TCP_NOTSENT_LOWAT, and autocorking
+			 * joins the two anyway */
+			msg.msg_iovlen = n;
+			r = sendmsg(fd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+		}
+
+		if(r < 0) switch(errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				return q->bytes;
+			default:
+				log_warn("Couldn't write to socket %d: %s", fd, strerror(errno));
+				return -1;
+		}
+
+		/* sendfile() reaching the end of the file early: it is shorter than
+		 * the range queued from it, and never will have the rest */
+		if(!r && !n) {
+			log_warn("File for socket %d ended before its range did.", fd);
+			return -1;
+		}
+
+		outq_consume(q, r);
+	}
+
+	assert(!q->bytes);
+	assert(!q->head_off);
+	return 0;
+}
+
+const char *outq_policy_name(outq_policy_t policy) {
+	assert(0 <= policy && policy < OUTQ_NUM_POLICIES);
+
+	return outq_policy_names[policy];
+}
+
+outq_policy_t outq_policy_parse(const char *name) {
+	assert(name);
+
+	for(int i=0; i<OUTQ_NUM_POLICIES; i++) {
+		if(!strcmp(name, outq_policy_names[i]))
+			return i;
+	}
+	return OUTQ_NUM_POLICIES;
+}
@@ -0,0 +1,94 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Maximum number of frames handed to a single sendmsg() */
+#define OUTQ_MAX_IOV 64
+
+/* What to do with a client whose queue has grown past the high watermark */
+typedef enum _outq_policy_t {
+	OUTQ_DROP,       /* Discard further messages until it drains */
+	OUTQ_DISCONNECT, /* Kick the client */
+	OUTQ_PAUSE,      /* Keep queueing messages; only file data waits */
+	OUTQ_NUM_POLICIES,
+} outq_policy_t;
+
+/* An encoded frame; broadcasts are encoded once and the same frame is
+ * queued for every recipient, so frames are reference counted. Recipients
+ * may live on different threads, so the count is atomic.
+ * A frame may end with a range of a file, sent with sendfile() after the
+ * encoded data, so that file contents never pass through user space.
+ * Or it may end with a body instead: another frame, sent after its data,
+ * which frames with different headers can share */
+typedef struct _outq_frame_t {
+	unsigned int refs;
+	size_t len;       /* Encoded bytes in data */
+	int fd;           /* File the range is taken from, or -1 */
+	off_t file_off;
+	size_t file_len;
+	struct _outq_frame_t *body; /* Without a body of its own */
+	/* Called with release_arg when the frame is freed, if set: whatever
+	 * keeps fd open, or the file it was read from, can let go then */
+	void (*release)(void *arg);
+	void *release_arg;
+	char data[];
+} outq_frame_t;
+
+/* FIFO of frames, kept as a ring of frame pointers */
+typedef struct _outq_ring_t {
+	outq_frame_t **frames;
+	size_t cap;   /* Size of the ring, a power of two */
+	size_t head;  /* Index of the first frame */
+	size_t count; /* Number of frames queued */
+} outq_ring_t;
+
+/* Encoded frames waiting to be written to a socket, in two classes:
+ * interactive frames (chat, presence, control) go straight onto the wire
+ * queue, while bulk frames (file data) wait, and are only moved onto it
+ * one at a time, once everything ahead has been written. A chat message
+ * thus never waits behind more than one file block in user space */
+typedef struct _outq_t {
+	outq_ring_t wire; /* Frames in the order they are written */
+	outq_ring_t bulk; /* Bulk frames waiting for the wire to be idle */
+	size_t head_off;  /* Bytes of the first wire frame already written */
+	size_t bytes;     /* Total bytes still to be written */
+} outq_t;
+
+void outq_init(outq_t *q);
+void outq_free(outq_t *q);
+
+/* New frames hold a single reference, owned by the caller */
+outq_frame_t *outq_frame_new(size_t len);
+outq_frame_t *outq_frame_file(size_t len, int fd, off_t off, size_t file_len);
+/* Takes over the caller's reference to body */
+outq_frame_t *outq_frame_body(size_t len, outq_frame_t *body);
+outq_frame_t *outq_frame_ref(outq_frame_t *frame);
+void outq_frame_unref(outq_frame_t *frame);
+
+/* Bytes the frame puts on the wire */
+static inline size_t outq_frame_size(const outq_frame_t *frame) {
+	return frame->len + frame->file_len + (frame->body ? outq_frame_size(frame->body) : 0);
+}
+
+/* Queues the frame in the given class, taking over one of the caller's
+ * references; on failure the reference is dropped */
+int outq_push(outq_t *q, outq_frame_t *frame, int bulk);
+
+/* Writes as much as the socket accepts; returns -1 on error, else the
+ * number of bytes still queued */
+ssize_t outq_flush(outq_t *q, int fd);
+
+/* The two halves of outq_flush(), for asynchronous writes: describe up to
+ * max frames at the front of the wire queue, then release the len bytes
+ * that were written. File ranges can't be described by an iovec: the
+ * description stops before them */
+int outq_prepare(outq_t *q, struct iovec *iov, int max);
+void outq_consume(outq_t *q, size_t len);
+
+const char *outq_policy_name(outq_policy_t policy);
+outq_policy_t outq_policy_parse(const char *name);
+
+#endif
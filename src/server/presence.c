@@ -0,0 +1,217 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "presence.h"
+#include "server.h"
+#include "client.h"
+#include "debug.h"
+
+static uint64_t presence_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+void presence_init(presence_t *presence, unsigned int interval) {
+	assert(presence);
+
+	memset(presence, 0, sizeof(*presence));
+	presence->interval = interval;
+	vector_init(&presence->changes, sizeof(presence_change_t));
+}
+
+void presence_free(presence_t *presence) {
+	assert(presence);
+
+	vector_free(&presence->changes);
+}
+
+static inline msg_MSG_user_update_t presence_update(uint16_t id, uint8_t status, const char *name) {
+	return (msg_MSG_user_update_t){.user_id = id, .status = status,
+		.len = (uint8_t)strlen(name), .name = name};
+}
+
+/* Encodes the updates one after another; offs is filled in with where each
+ * one starts, and where the last one ends */
+static char *presence_encode(const msg_MSG_user_update_t *updates, size_t num, size_t *offs) {
+	char *data, *out;
+
+	offs[0] = 0;
+	for(size_t i=0; i<num; i++)
+		offs[i+1] = offs[i] + msg_size_MSG_user_update(&updates[i]);
+
+	check_mem(out = data = malloc(offs[num]));
+	for(size_t i=0; i<num; i++)
+		out = msg_encode_MSG_user_update(out, &updates[i]);
+
+	return data;
+error:
+	return NULL;
+}
+
+/* Adds the client's change to the batch, merged with the one it has there
+ * already if no snapshot was taken since; returns 0 on success */
+static int presence_add(presence_t *presence, client_t *client, int left) {
+	presence_change_t *change;
+
+	if(client->presence > presence->snapshot)
+		change = vector_get(&presence->changes, client->presence - 1);
+	else {
+		check_mem(change = vector_add(&presence->changes, NULL, 1));
+		client->presence = presence->changes.size;
+	}
+
+	change->id = client->id;
+	change->status = left ? US_OFFLINE : client->status;
+	strcpy(change->name, client->name);
+	if(left)
+		client->presence = 0;
+
+	return 0;
+error:
+	return 1;
+}
+
+/* Sends the batch after the interval, or now if there is none */
+static void presence_schedule(server_t *server) {
+	presence_t *presence = &server->presence;
+
+	if(!presence->interval)
+		presence_flush(server);
+	else if(!presence->due)
+		__atomic_store_n(&presence->due, presence_now() + presence->interval, __ATOMIC_RELEASE);
+}
+
+int presence_snapshot(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+	assert(client->chunk);
+	assert(mutex_locked(&server->clients_mutex));
+
+	presence_t *presence = &server->presence;
+	msg_MSG_user_update_t *updates;
+	size_t *offs = NULL, num = 0;
+	outq_frame_t *frame = NULL;
+	char *data = NULL;
+	client_t **other;
+
+	check_mem(updates = malloc(sizeof(*updates)*server->clients.size));
+
+	updates[num++] = presence_update(client->id, US_IDENTIFY, client->name);
+	sp_vector_foreach(&server->clients, other) {
+		/* Those yet to say hello are announced once they have */
+		if(*other != client && (*other)->chunk)
+			updates[num++] = presence_update((*other)->id, (*other)->status, (*other)->name);
+	}
+
+	if((offs = malloc(sizeof(*offs)*(num + 1))) && (data = presence_encode(updates, num, offs)))
+		frame = client_frame(MSG_users, (uint32_t)offs[num], data);
+	free(updates);
+	free(offs);
+	free(data);
+	check_quiet(frame);
+	check_quiet(!client_queue(server, client, frame, 0));
+
+	/* It knows the batch so far, and its own joining */
+	check_quiet(!presence_add(presence, client, 0));
+	presence->snapshot = client->presence_seen = presence->changes.size;
+	presence_schedule(server);
+
+	return 0;
+error:
+	return 1;
+}
+
+void presence_note(server_t *server, client_t *client, int left) {
+	assert(server);
+	assert(client);
+	assert(mutex_locked(&server->clients_mutex));
+
+	/* The others only hear of a client once it has said hello */
+	if(!client->chunk)
+		return;
+
+	if(presence_add(&server->presence, client, left))
+		log_err("Couldn't note the presence of <%s>.", client->name);
+	else
+		presence_schedule(server);
+}
+
+void presence_flush(server_t *server) {
+	assert(server);
+	assert(mutex_locked(&server->clients_mutex));
+
+	presence_t *presence = &server->presence;
+	const size_t num = presence->changes.size;
+	msg_MSG_user_update_t *updates;
+	const presence_change_t *change;
+	outq_frame_t **frames = NULL;
+	size_t *offs = NULL, i = 0;
+	char *data = NULL;
+	client_t **other;
+
+	if(!num)
+		return;
+
+	if((updates = malloc(sizeof(*updates)*num))) {
+		vector_foreach(&presence->changes, change)
+			updates[i++] = presence_update(change->id, change->status, change->name);
+		if((offs = malloc(sizeof(*offs)*(num + 1))))
+			data = presence_encode(updates, num, offs);
+		free(updates);
+	}
+
+	if(data)
+		frames = calloc(num, sizeof(*frames));
+	if(!frames)
+		log_err("Couldn't send %zu presence changes.", num);
+
+	/* Clients get what they don't know of yet, and those that joined at
+	 * the same point share the frame; all start afresh in the next batch */
+	sp_vector_foreach(&server->clients, other) {
+		size_t seen = (*other)->presence_seen;
+
+		(*other)->presence = (*other)->presence_seen = 0;
+		if(!frames || !(*other)->chunk || seen == num)
+			continue;
+
+		if(!frames[seen] && !(frames[seen] = client_frame(MSG_users,
+						(uint32_t)(offs[num] - offs[seen]), data + offs[seen]))) {
+			log_err("Couldn't send presence changes to <%s>.", (*other)->name);
+			continue;
+		}
+		client_send_frame(server, *other, frames[seen]);
+	}
+
+	for(i=0; frames && i<num; i++) {
+		if(frames[i])
+			outq_frame_unref(frames[i]);
+	}
+	free(frames);
+	free(offs);
+	free(data);
+
+	presence->changes.size = presence->snapshot = 0;
+	__atomic_store_n(&presence->due, 0, __ATOMIC_RELEASE);
+}
+
+void presence_tick(server_t *server) {
+	assert(server);
+	assert(mutex_locked(&server->clients_mutex));
+
+	if(server->presence.due && server->presence.due <= presence_now())
+		presence_flush(server);
+}
+
+int presence_timeout(presence_t *presence) {
+	assert(presence);
+
+	uint64_t due = __atomic_load_n(&presence->due, __ATOMIC_ACQUIRE), now;
+
+	if(!due)
+		return -1;
+	now = presence_now();
+	return due > now ? (int)(due - now) : 0;
+}
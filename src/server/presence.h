@@ -0,0 +1,52 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stdint.h>
+#include "vector.h"
+
+struct _server_t;
+struct _client_t;
+
+/* What a user changed to, or that it left */
+typedef struct _presence_change_t {
+	uint16_t id;
+	uint8_t status;
+	char name[256];
+} presence_change_t;
+
+/* Joins, leaves, renames and status changes go out to every client in a
+ * single users message at most every interval ms, rather than a user_update
+ * each, so that a crowd reconnecting at once doesn't cost a message per pair
+ * of users. A user's changes waiting in the batch are merged into one, but
+ * for its leaving: a newcomer may take its id before the batch goes out.
+ * Clients that joined meanwhile only get the changes after their snapshot,
+ * so none may be merged into one from before it.
+ * Under the clients lock, but for presence_timeout() */
+typedef struct _presence_t {
+	unsigned int interval; /* 0 to send each change straight away */
+	vector_t changes; /* Of presence_change_t, oldest first */
+	size_t snapshot; /* Changes before the latest snapshot */
+	uint64_t due; /* When the batch goes out, in CLOCK_MONOTONIC ms; 0 if empty. Atomic */
+} presence_t;
+
+void presence_init(presence_t *presence, unsigned int interval);
+void presence_free(presence_t *presence);
+
+/* Queues a new client its own id and name, and everyone online, in a single
+ * users message, and notes its joining; returns 0 on success */
+int presence_snapshot(struct _server_t *server, struct _client_t *client);
+
+/* Adds the client's name and status, or its leaving, to the batch */
+void presence_note(struct _server_t *server, struct _client_t *client, int left);
+
+/* Sends the batch to every client now, if there is one */
+void presence_flush(struct _server_t *server);
+
+/* Sends the batch if it is due */
+void presence_tick(struct _server_t *server);
+
+/* Milliseconds until the batch is due, for the event loops to wait for, or
+ * -1 if there is none */
+int presence_timeout(presence_t *presence);
+
+#endif
@@ -1,12 +1,15 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdarg.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <limits.h>
 #include <signal.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "server.h"
 #include "client.h"
@@ -17,16 +20,25 @@
 #include "debug.h"
 #include "macros.h"
 
+/* Maximum number of events taken from epoll_wait() per iteration */
+#define SERVER_MAX_EVENTS 64
+
 server_t *g_server; /* Yuck, used for sigint handler */
 
 static void *server_accept_thread(void *server);
 
-#define X(name,fmt,fmt_comment) msg_handle_##name,
+#define X(name,fields) msg_handle_##name,
 msg_handler_t msg_handlers[MSG_NUM_TYPES]= { MSG_TYPES };
 #undef X
 
 void sigint_handler(__attribute__((unused)) int num) {
+	int saved_errno = errno;
+
 	g_server->running = 0;
+	/* The signal may be delivered to any thread, so wake every loop */
+	server_wake(g_server);
+
+	errno = saved_errno;
 }
 
 void sigusr1_handler(__attribute__((unused)) int num) {
@@ -39,6 +51,7 @@ static inline int msg_handle(msg_type_t type, server_t *server, client_t *client
 
 	check(type != MSG_invalid, "Invalid message code '%d'", type);
 	check(msg_handlers[type], "Invalid message type '%d'", type);
+	check(client->chunk || type == MSG_hello, "Message type '%d' before the handshake", type);
 	check_quiet(!msg_handlers[type](server, client));
 
 	return 0;
@@ -46,17 +59,51 @@ error:
 	return 1;
 }
 
-int server_init(server_t *server, unsigned int port) {
+static const char * const server_backend_names[SERVER_NUM_BACKENDS] = {
+	[SERVER_EPOLL] = "epoll",
+	[SERVER_URING] = "uring",
+};
+
+static const char *server_backend_name(server_backend_t backend) {
+	assert(0 <= backend && backend < SERVER_NUM_BACKENDS);
+
+	return server_backend_names[backend];
+}
+
+static server_backend_t server_backend_parse(const char *name) {
+	assert(name);
+
+	for(int i=0; i<SERVER_NUM_BACKENDS; i++) {
+		if(!strcmp(name, server_backend_names[i]))
+			return i;
+	}
+	return SERVER_NUM_BACKENDS;
+}
+
+int server_init(server_t *server, const server_config_t *config) {
 	assert(server);
+	assert(config);
+	assert(config->threads > 0);
 
 	log_info("Server starting...");
 
 	struct sockaddr_in server_addr;
 
-	sp_vector_init(&server->clients, sizeof(client_t));
+	sp_vector_init(&server->clients, sizeof(client_t *));
 	sp_vector_init(&server->chatrooms, sizeof(chatroom_t));
-	sp_vector_init(&server->files, sizeof(file_entry_t));
+	sp_vector_init(&server->files, sizeof(file_entry_t *));
+	server->config = *config;
 	server->clients_mutex = ((pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER);
+	server->next_shard = 0;
+	presence_init(&server->presence, config->presence);
+
+	check_quiet(!store_init(&server->store, config->spool, config->spool_quota, config->spool_fds,
+				config->spool_mem_max, config->spool_mem_quota));
+
+	check_mem(server->shards = calloc(config->threads, sizeof(*server->shards)));
+	for(server->num_shards = 0; server->num_shards < config->threads; server->num_shards++)
+		check_quiet(!shard_init(&server->shards[server->num_shards], server, server->num_shards,
+					config->backend == SERVER_URING, config->compress));
 
 	server->socket = socket(AF_INET, SOCK_STREAM, 0);
 	check(server->socket != -1, "Couldn't create socket: %s", strerror(errno));
@@ -67,23 +114,30 @@ int server_init(server_t *server, unsigned int port) {
 
 	memset(&server_addr, 0, sizeof(server_addr));
 	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(port);
+	server_addr.sin_port = htons(config->port);
 	server_addr.sin_addr.s_addr = INADDR_ANY;
 
 	check(!bind(server->socket, (struct sockaddr*) &server_addr, sizeof(server_addr)),
-			"Couldn't bind socket to port %u: %s", port, strerror(errno));
+			"Couldn't bind socket to port %u: %s", config->port, strerror(errno));
 	listen(server->socket, 0);
 
 	server->running = 1;
-	check(!pthread_create(&server->accept_thread, NULL, server_accept_thread, server),
-		"Couldn't create accept thread: %s", strerror(errno));
+	/* With io_uring, the first shard accepts connections itself */
+	if(config->backend == SERVER_EPOLL) {
+		check(!pthread_create(&server->accept_thread, NULL, server_accept_thread, server),
+			"Couldn't create accept thread: %s", strerror(errno));
+	}
 
 	struct sigaction int_handler = {.sa_handler=sigint_handler};
 	sigaction(SIGINT, &int_handler, 0);
 	struct sigaction usr1_handler = {.sa_handler=sigusr1_handler};
 	sigaction(SIGUSR1, &usr1_handler, 0);
+	/* sendfile() has no MSG_NOSIGNAL; a closed socket shows up as EPIPE */
+	struct sigaction pipe_handler = {.sa_handler=SIG_IGN};
+	sigaction(SIGPIPE, &pipe_handler, 0);
 
-	log_info("Server started.");
+	log_info("Server started with %u %s thread%s.", server->num_shards,
+			server_backend_name(config->backend), server->num_shards == 1 ? "" : "s");
 
 	return 0;
 error:
@@ -95,130 +149,585 @@ void server_free(server_t *server) {
 
 	log_info("Server stopping...");
 
-	client_t *client;
+	client_t **client;
 
 	pthread_mutex_lock(&server->clients_mutex);
 
 	sp_vector_foreach(&server->clients, client)
-		client_disconnect(server, client);
+		client_disconnect(server, *client);
 
 	server->running = 0;
-	pthread_kill(server->accept_thread, SIGUSR1);
-	pthread_join(server->accept_thread, NULL);
+	if(server->config.backend == SERVER_EPOLL) {
+		pthread_kill(server->accept_thread, SIGUSR1);
+		pthread_join(server->accept_thread, NULL);
+	}
 	close(server->socket);
 
+	/* Before the clients: closing a ring cancels its requests. After the
+	 * clients have left: their goodbyes are still in the inboxes */
+	for(unsigned int i=0; i<server->num_shards; i++)
+		shard_free(&server->shards[i]);
+	free(server->shards);
+
+	sp_vector_foreach(&server->clients, client) {
+		(*client)->inflight = 0;
+		client_free(server, *client);
+	}
+
 	sp_vector_free(&server->clients);
 	sp_vector_free(&server->chatrooms);
 
+	/* The chats closed as their members left, and took their files along */
+	assert(!server->files.size);
+	sp_vector_free(&server->files);
+	store_log_stats(&server->store);
+	store_free(&server->store);
+	presence_free(&server->presence);
+
 	pthread_mutex_unlock(&server->clients_mutex);
 	pthread_mutex_destroy(&server->clients_mutex);
 
 	log_info("Server stopped.");
 }
 
+/* Sets up a newly accepted connection, and hands it to a shard */
+static void server_accept_client(server_t *server, int fd) {
+	assert(server);
+	assert(fd >= 0);
+
+	client_t *client;
+	size_t id;
+
+	/* Clients are shared out between the shards in turn */
+	shard_t *shard = &server->shards[server->next_shard++ % server->num_shards];
+
+	int inflight = server->config.out_inflight;
+	if(inflight)
+		check_warn(!setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &inflight, sizeof(inflight)),
+				"Couldn't limit unsent data: %s", strerror(errno));
+
+	check_mem(client = malloc(sizeof(*client)));
+
+	pthread_mutex_lock(&server->clients_mutex);
+
+	if(!(id = sp_vector_add(&server->clients, &client))) {
+		pthread_mutex_unlock(&server->clients_mutex);
+		goto error;
+	}
+	client_connect(server, client, id, shard, fd);
+
+	pthread_mutex_unlock(&server->clients_mutex);
+	return;
+error:
+	free(client);
+	close(fd);
+}
+
 static void *server_accept_thread(void *s) {
 	server_t *server = s;
 
 	while(server->running) {
-		client_t new_client, *client;
 		struct sockaddr_in client_addr;
 		socklen_t client_len = sizeof(client_addr);
-		size_t id;
 		int fd;
 
-		fd = accept(server->socket, (struct sockaddr *) &client_addr, &client_len);
+		fd = accept4(server->socket, (struct sockaddr *) &client_addr, &client_len,
+				SOCK_NONBLOCK|SOCK_CLOEXEC);
 		if(fd < 0) switch(errno) {
 			case EINTR:
 				continue;
 			default:
 				log_warn("Couldn't accept connection: %s %d", strerror(errno), errno);
-				break;
+				continue;
 		}
 
-		pthread_mutex_lock(&server->clients_mutex);
+		server_accept_client(server, fd);
+	}
 
-		/* TODO: when the client connects, we have to tell all the other clients, */
-		/* before we start any new chats, otherwise a client might immediately    */
-		/* jump into a group chat and invite someone who doesn't know about the   */
-		/* new client yet, and they'll get a client_id that isn't in their list   */
-		/* of clients */
+	return NULL;
+}
 
-		check_quiet(id = sp_vector_add(&server->clients, &new_client));
-		client = sp_vector_get(&server->clients, id);
-		client_connect(server, client, fd);
+/* Interrupt every shard's epoll_wait(); async-signal-safe */
+void server_wake(server_t *server) {
+	assert(server);
+
+	for(unsigned int i=0; i<server->num_shards; i++)
+		shard_wake(&server->shards[i]);
+}
+
+/* Disconnects the client; its memory is only released once the shard is
+ * done with the current batch, which may still refer to it */
+static void server_drop_client(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+	assert(mutex_locked(&server->clients_mutex));
+
+	client_disconnect(server, client);
+	sp_vector_del(&server->clients, client->id);
+	check_warn(vector_add(&client->shard->dead, &client, 1),
+			"Leaking client <%s>.", client->name);
+}
+
+/* Handle every complete message in the client's receive buffer */
+static int server_client_parse(server_t *server, client_t *client) {
+	assert(server);
+	assert(client);
+
+	buffer_t *in = &client->in;
+	ssize_t len;
+
+	while(!client->closing && (len = msg_frame_len(buffer_data(in), buffer_len(in))) > 0) {
+		const char *frame = buffer_data(in);
+
+		/* File blocks are checked first, without the lock: go round again
+		 * once this one is */
+		if(msg_get_type(*frame) == MSG_file_part && client->block.frame != frame) {
+			client->ready = 1;
+			return 0;
+		}
+
+		client->frame = frame;
+		client->frame_len = len;
+		msg_handle(msg_get_type(*frame), server, client);
+		client->frame = NULL;
+		client->block.frame = NULL;
+
+		buffer_consume(in, len);
+	}
+
+	check(client->closing || len == 0, "Invalid message code '%hhu' from <%s>",
+			*buffer_data(in), client->name);
+	check(client->closing || buffer_len(in) <= server->config.chunk + SERVER_MAX_MSG,
+			"Oversized message from <%s>.", client->name);
+
+	return 0;
 error:
+	return 1;
+}
+
+/* Read everything waiting on the socket; messages are handled later, with
+ * the lock held, for all ready clients at once */
+static void server_client_readable(server_t *server, shard_t *shard, client_t *client) {
+	assert(server);
+	assert(shard);
+	assert(client);
+
+	while(1) {
+		ssize_t r = buffer_recv(&client->in, client->fd, SERVER_RECV_SZ);
+
+		if(r == 0) {
+			client_kick(server, client);
+			return;
+		} else if(r < 0) switch(errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				return;
+			default:
+				log_warn("Couldn't read from <%s>: %s", client->name, strerror(errno));
+				client_kick(server, client);
+				return;
+		}
+
+		if(!client->ready && vector_add(&shard->ready, &client, 1))
+			client->ready = 1;
+
+		/* A short read drained the socket; edge-triggered sockets must be
+		 * read until EAGAIN regardless */
+		if(!(SERVER_EPOLL_MODE & EPOLLET) && r < SERVER_RECV_SZ)
+			return;
+	}
+}
+
+/* Work that needs the lock: deliver frames posted by other threads, handle
+ * the messages that came in, and drop kicked clients. The inbox is always
+ * emptied first, so no message is left in it for a client dropped here */
+static void server_shard_sync(server_t *server, shard_t *shard) {
+	assert(server);
+	assert(shard);
+	assert(mutex_locked(&server->clients_mutex));
+
+	shard_msg_t *msg, *next;
+	client_t *client;
+
+	for(msg = shard_take(shard); msg; msg = next) {
+		next = msg->next;
+		if(!msg->frame)
+			client_wake(server, msg->client);
+		else
+			client_queue(server, msg->client, msg->frame, msg->bulk);
+		free(msg);
+	}
+
+	size_t left = 0;
+	for(size_t i=0; i<shard->ready.size; i++) {
+		client = *(client_t **)vector_get(&shard->ready, i);
+		client->ready = 0;
+		if(!client->closing && server_client_parse(server, client))
+			client_kick(server, client);
+
+		/* Stopped short of a file block, and still ready */
+		if(client->ready && !client->closing) {
+			vector_set(&shard->ready, left++, &client, 1);
+			continue;
+		}
+
+		/* The buffer is settled again: receive some more */
+		if(shard->uring && client_start_recv(server, client))
+			client_kick(server, client);
+	}
+	shard->ready.size = left;
+
+	for(size_t i=0; i<shard->closing.size; i++) {
+		client = *(client_t **)vector_get(&shard->closing, i);
+		server_drop_client(server, client);
+	}
+	shard->closing.size = 0;
+
+	presence_tick(server);
+}
+
+/* Handles what came in: the file blocks at the front of the ready clients'
+ * buffers are checked ahead of the lock, and clients that get to another
+ * one go round again, until every client is done */
+static void server_shard_handle(server_t *server, shard_t *shard) {
+	assert(server);
+	assert(shard);
+
+	do {
+		for(size_t i=0; i<shard->ready.size; i++) {
+			client_t *client = *(client_t **)vector_get(&shard->ready, i);
+			if(!client->closing)
+				client_check_file_part(server, client);
+		}
+
+		pthread_mutex_lock(&server->clients_mutex);
+		server_shard_sync(server, shard);
 		pthread_mutex_unlock(&server->clients_mutex);
+	} while(shard->ready.size);
+}
+
+/* Flush clients that had messages queued, and drop kicked clients; dropping
+ * a client notifies the others, so repeat until both lists are empty */
+static void server_flush_pending(server_t *server, shard_t *shard) {
+	assert(server);
+	assert(shard);
+
+	client_t *client;
+
+	while(shard->dirty.size || shard->closing.size) {
+		for(size_t i=0; i<shard->dirty.size; i++) {
+			client = *(client_t **)vector_get(&shard->dirty, i);
+			if(!client->dirty)
+				continue;
+
+			client->dirty = 0;
+			if(!client->closing && client_flush(server, client))
+				client_kick(server, client);
+		}
+		shard->dirty.size = 0;
+
+		if(shard->closing.size) {
+			pthread_mutex_lock(&server->clients_mutex);
+			server_shard_sync(server, shard);
+			pthread_mutex_unlock(&server->clients_mutex);
+		}
 	}
 
-	return NULL;
+	/* Clients can only be freed once the kernel is done with their buffers */
+	size_t left = 0;
+	for(size_t i=0; i<shard->dead.size; i++) {
+		client = *(client_t **)vector_get(&shard->dead, i);
+		if(client->inflight)
+			vector_set(&shard->dead, left++, &client, 1);
+		else
+			client_free(server, client);
+	}
+	shard->dead.size = left;
 }
 
-void server_loop(server_t *server) {
+/* Completion of an io_uring request */
+static void server_uring_complete(server_t *server, shard_t *shard, const struct io_uring_cqe *cqe) {
 	assert(server);
+	assert(shard);
+	assert(cqe);
+
+	client_t *client = shard_tag_client(cqe->user_data);
+
+	switch(shard_tag_op(cqe->user_data)) {
+		case SHARD_OP_WAKE: {
+			uint64_t count;
+			check_warn(read(shard->wake_fd, &count, sizeof(count)) == sizeof(count),
+					"Couldn't read wakeup eventfd: %s", strerror(errno));
+			check_warn(!shard_arm_wake(shard), "Shard %u won't wake up.", shard->id);
+			break;
+		}
+		case SHARD_OP_ACCEPT:
+			if(cqe->res >= 0)
+				server_accept_client(server, cqe->res);
+			else
+				log_warn("Couldn't accept connection: %s", strerror(-cqe->res));
+			check_warn(!shard_arm_accept(shard, server->socket),
+					"No longer accepting connections.");
+			break;
+		case SHARD_OP_RECV:
+			client_recv_done(server, client, cqe->res);
+			break;
+		case SHARD_OP_SEND:
+			client_send_done(server, client, cqe->res);
+			break;
+		case SHARD_OP_READ:
+			client_read_done(server, client, cqe->res);
+			break;
+		case SHARD_OP_TIMEOUT:
+			shard->timing = 0;
+			break;
+		default:
+			log_err("Unknown io_uring completion %llx", (unsigned long long)cqe->user_data);
+			break;
+	}
+}
+
+/* Each iteration submits every request made since the last one, and waits
+ * for completions, with a single system call */
+static void *server_shard_loop_uring(void *s) {
+	shard_t *shard = s;
+	server_t *server = shard->server;
+
+	shard_self = shard;
+
+	check_quiet(!shard_arm_wake(shard));
+	if(shard->id == 0)
+		check_quiet(!shard_arm_accept(shard, server->socket));
 
 	while(server->running) {
-		client_t *client;
-		unsigned i;
-		struct pollfd fds[server->clients.size];
-
-		/* We just build an array of pollfd structs on the stack for now;
-		 * TODO: keep this array in between iterations. This adds complications;
-		 * We cannot modify fds[] during a poll() call, so we have to interrupt
-		 * the call to poll, then rebuild the array. This would allow us to
-		 * remove the timeout to poll() however (see below)*/
-		i=0;
-		sp_vector_foreach(&server->clients, client) {
-			fds[i++] = (struct pollfd){.fd = client->fd, .events=POLLIN|POLLOUT};
+		struct io_uring_cqe *cqe;
+
+		/* Wake up in time for the presence batch */
+		int timeout = presence_timeout(&server->presence);
+		if(timeout >= 0 && !shard->timing)
+			check_quiet(!shard_arm_timeout(shard, timeout));
+
+		check_quiet(!uring_submit(&shard->ring, 1));
+
+		while((cqe = uring_cqe(&shard->ring))) {
+			server_uring_complete(server, shard, cqe);
+			uring_cqe_seen(&shard->ring);
 		}
 
-		/* A timeout is necesary because a new client may connect after poll()
-		 * is called; without a timeout the client would be ignored until after
-		 * another message was sent/received, and poll() was called again.
-		 * The alternative is interrupting poll() with a system call whenever
-		 * a client is added or removed, before rebuilding the pollfd table */
-		check_warn(poll(fds, sizeof(fds)/sizeof(*fds), 100) >= 0,
-				"Error polling sockets: %s", strerror(errno));
+		if(shard->ready.size || shard->closing.size || shard_has_mail(shard)
+				|| !presence_timeout(&server->presence))
+			server_shard_handle(server, shard);
 
-		pthread_mutex_lock(&server->clients_mutex);
+		server_flush_pending(server, shard);
+	}
 
-		i=0;
-		sp_vector_foreach(&server->clients, client) {
-			if(fds[i].revents & POLLIN) {
-				uint8_t type;
-				int r = read(client->fd, &type, 1);
-
-				if(r == 0) {
-					client_disconnect(server, client);
-					size_t client_id = sp_vector_indexof(&server->clients, client);
-					sp_vector_del(&server->clients, client_id);
-				} else if(r > 0) {
-					msg_handle(msg_get_type(type), server, client);
-				}
-			} else if(fds[i].revents & POLLOUT) {
-				client_send_file_part(client);
+	return NULL;
+error:
+	log_err("Shard %u stopped.", shard->id);
+	server->running = 0;
+	server_wake(server);
+	return NULL;
+}
+
+static void *server_shard_loop(void *s) {
+	shard_t *shard = s;
+	server_t *server = shard->server;
+
+	struct epoll_event events[SERVER_MAX_EVENTS];
+
+	shard_self = shard;
+
+	while(server->running) {
+		int n = epoll_wait(shard->epoll_fd, events, SERVER_MAX_EVENTS,
+				presence_timeout(&server->presence));
+		if(n < 0) {
+			check_warn(errno == EINTR, "Error waiting for events: %s", strerror(errno));
+			continue;
+		}
+
+		/* Socket I/O happens without the lock */
+		for(int i=0; i<n; i++) {
+			client_t *client = events[i].data.ptr;
+
+			if(!client) {
+				uint64_t count;
+				check_warn(read(shard->wake_fd, &count, sizeof(count)) == sizeof(count),
+						"Couldn't read wakeup eventfd: %s", strerror(errno));
+				continue;
+			}
+
+			/* The client may have been kicked earlier in this batch */
+			if(client->closing)
+				continue;
+
+			if(events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+				server_client_readable(server, shard, client);
+
+			if(!client->closing && events[i].events & EPOLLOUT) {
+				if(client_flush(server, client))
+					client_kick(server, client);
 			}
-			i++;
 		}
 
-		pthread_mutex_unlock(&server->clients_mutex);
+		if(shard->ready.size || shard->closing.size || shard_has_mail(shard)
+				|| !presence_timeout(&server->presence))
+			server_shard_handle(server, shard);
+
+		server_flush_pending(server, shard);
+	}
+
+	return NULL;
+}
+
+/* Runs every shard in its own thread until the server is stopped */
+void server_loop(server_t *server) {
+	assert(server);
+
+	unsigned int i;
+
+	for(i=0; i<server->num_shards; i++) {
+		shard_t *shard = &server->shards[i];
+		check(!pthread_create(&shard->thread, NULL,
+					shard->uring ? server_shard_loop_uring : server_shard_loop, shard),
+				"Couldn't create shard thread: %s", strerror(errno));
 	}
+
+error:
+	/* Stop any shards that did start */
+	if(i < server->num_shards) {
+		server->running = 0;
+		server_wake(server);
+	}
+	while(i--)
+		pthread_join(server->shards[i].thread, NULL);
+}
+
+static void server_usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [options] [port]\n"
+			"  -H bytes   outbound queue high watermark (default %u)\n"
+			"  -L bytes   outbound queue low watermark (default %u)\n"
+			"  -B bytes   unsent bytes a socket may hold, 0 for no limit (default %u)\n"
+			"  -k bytes   largest file block sent or accepted (default %u)\n"
+			"  -z level   deflate level for file blocks sent, 0 to send them raw (default %d)\n"
+			"  -Z level   deflate level for other messages, 0 to send them raw (default %d)\n"
+			"  -p ms      longest wait before presence changes go out, 0 for none (default %u)\n"
+			"  -d dir     spool directory for shared files (default %s)\n"
+			"  -q bytes   spool size quota, 0 for no limit (default %llu)\n"
+			"  -f n       spool files kept open (default %u)\n"
+			"  -m bytes   largest file kept in memory rather than on disk (default %u)\n"
+			"  -M bytes   memory for such files, 0 for no limit (default %u)\n"
+			"  -s policy  slow consumer policy: drop, disconnect or pause (default %s)\n"
+			"  -t n       number of event loop threads (default: one per core)\n"
+			"  -b backend I/O backend: epoll or uring (default %s)\n",
+			name, SERVER_OUT_HIGH_WM, SERVER_OUT_LOW_WM, SERVER_OUT_INFLIGHT, SERVER_CHUNK, SERVER_COMPRESS, SERVER_PACK,
+			SERVER_PRESENCE_MS, SERVER_SPOOL,
+			SERVER_SPOOL_QUOTA, SERVER_SPOOL_FDS, SERVER_SPOOL_MEM_MAX, SERVER_SPOOL_MEM_QUOTA,
+			outq_policy_name(OUTQ_PAUSE),
+			server_backend_name(SERVER_EPOLL));
 }
 
 int main(int argc, char **argv) {
 	server_t server;
+	server_config_t config = {
+		.port = 1024,
+		.out_high_wm = SERVER_OUT_HIGH_WM,
+		.out_low_wm = SERVER_OUT_LOW_WM,
+		.out_inflight = SERVER_OUT_INFLIGHT,
+		.out_policy = OUTQ_PAUSE,
+		.chunk = SERVER_CHUNK,
+		.compress = SERVER_COMPRESS,
+		.pack = SERVER_PACK,
+		.presence = SERVER_PRESENCE_MS,
+		.spool = SERVER_SPOOL,
+		.spool_quota = SERVER_SPOOL_QUOTA,
+		.spool_fds = SERVER_SPOOL_FDS,
+		.spool_mem_max = SERVER_SPOOL_MEM_MAX,
+		.spool_mem_quota = SERVER_SPOOL_MEM_QUOTA,
+	};
 	long int port;
+	int opt;
 
 	g_server = &server;
 
-	if(argc >= 2) {
-		check_warn(argc == 2, "Excess arguments ignored");
-		check((port = strtol(argv[1], NULL, 10)) != LONG_MIN,
-				"Invalid port number '%s'", argv[1]);
-	} else
-		port = 1024;
-	log_info("Using port %ld", port);
+	while((opt = getopt(argc, argv, "H:L:B:k:z:Z:p:d:q:f:m:M:s:t:b:h")) != -1) switch(opt) {
+		case 'H':
+			config.out_high_wm = strtoul(optarg, NULL, 10);
+			break;
+		case 'L':
+			config.out_low_wm = strtoul(optarg, NULL, 10);
+			break;
+		case 'B':
+			config.out_inflight = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			config.chunk = strtoul(optarg, NULL, 10);
+			break;
+		case 'z':
+			config.compress = strtol(optarg, NULL, 10);
+			break;
+		case 'Z':
+			config.pack = strtol(optarg, NULL, 10);
+			break;
+		case 'p':
+			config.presence = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			config.spool = optarg;
+			break;
+		case 'q':
+			config.spool_quota = strtoull(optarg, NULL, 10);
+			break;
+		case 'f':
+			config.spool_fds = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			config.spool_mem_max = strtoull(optarg, NULL, 10);
+			break;
+		case 'M':
+			config.spool_mem_quota = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			check((config.out_policy = outq_policy_parse(optarg)) != OUTQ_NUM_POLICIES,
+					"Invalid slow consumer policy '%s'", optarg);
+			break;
+		case 't':
+			config.threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			check((config.backend = server_backend_parse(optarg)) != SERVER_NUM_BACKENDS,
+					"Invalid I/O backend '%s'", optarg);
+			break;
+		case 'h':
+		default:
+			server_usage(argv[0]);
+			return opt != 'h';
+	}
+
+	if(!config.threads) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		config.threads = cores > 0 ? cores : 1;
+	}
+
+	check(config.spool_fds > 0, "At least one spool file must be kept open");
+	check(config.out_low_wm < config.out_high_wm,
+			"Low watermark must be below the high watermark");
+	check(FILE_BLOCK_SZ <= config.chunk && config.chunk <= MSG_MAX_CHUNK
+			&& config.chunk % FILE_BLOCK_SZ == 0,
+			"File block size must be a multiple of %u, up to %u", FILE_BLOCK_SZ, MSG_MAX_CHUNK);
+	check(config.compress >= 0 && config.compress <= 9 && config.pack >= 0 && config.pack <= 9,
+			"Deflate levels must be from 0 to 9");
+
+	if(optind < argc) {
+		check_warn(optind + 1 == argc, "Excess arguments ignored");
+		check((port = strtol(argv[optind], NULL, 10)) != LONG_MIN,
+				"Invalid port number '%s'", argv[optind]);
+		config.port = port;
+	}
+	log_info("Using port %u", config.port);
 
-	check(!server_init(&server, port), "Couldn't start server, sorry!");
+	check(!server_init(&server, &config), "Couldn't start server, sorry!");
 	server_loop(&server);
 	server_free(&server);
 
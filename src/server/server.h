@@ -2,17 +2,142 @@
 #define SERVER_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include "sp_vector.h"
+#include "vector.h"
+#include "outq.h"
+#include "shard.h"
+#include "store.h"
+#include "presence.h"
+
+/* Client sockets are registered level-triggered by default; build with
+ * -DSERVER_EPOLL_ET to register them edge-triggered instead. The loop
+ * drains each socket until EAGAIN, so both modes behave the same */
+#ifdef SERVER_EPOLL_ET
+#define SERVER_EPOLL_MODE EPOLLET
+#else
+#define SERVER_EPOLL_MODE 0
+#endif
+
+/* Bytes requested from a client socket per recv() */
+#define SERVER_RECV_SZ (1<<16)
+
+/* Default outbound queue watermarks, in bytes */
+#define SERVER_OUT_HIGH_WM (1<<20)
+#define SERVER_OUT_LOW_WM  (1<<16)
+
+/* Default limit on unsent bytes in a client socket's kernel buffer */
+#define SERVER_OUT_INFLIGHT (1<<18)
+
+/* Default spool directory, for the files shared in chats, its size quota,
+ * and how many of its files may be kept open while idle */
+#define SERVER_SPOOL "/tmp/chatserver"
+#define SERVER_SPOOL_QUOTA (8ULL<<30)
+#define SERVER_SPOOL_FDS 256
+
+/* Default size up to which files are kept in memory instead, and the
+ * memory they may take up */
+#define SERVER_SPOOL_MEM_MAX (64<<10)
+#define SERVER_SPOOL_MEM_QUOTA (64<<20)
+
+/* Default largest file block agreed with clients */
+#define SERVER_CHUNK (1<<20)
+
+/* Default deflate level for the file blocks sent to clients that take
+ * them compressed: the fastest, which still shrinks text severalfold */
+#define SERVER_COMPRESS 1
+
+/* Default deflate level for the stream of other messages to clients that
+ * take it, off: presence and chat repeat the same names and ids over and
+ * over, but every connection then needs about 40 KiB for its stream, and
+ * a chat message deflated for each recipient rather than framed once */
+#define SERVER_PACK 0
+
+/* Default longest wait, in ms, before presence changes go out, so that those
+ * made meanwhile go out together */
+#define SERVER_PRESENCE_MS 50
+
+/* Room for any message other than a file block; incomplete messages any
+ * longer than this plus the block size are refused */
+#define SERVER_MAX_MSG (1<<18)
+
+/* How the shards wait for and perform socket I/O */
+typedef enum _server_backend_t {
+	SERVER_EPOLL, /* Readiness with epoll, then non-blocking system calls */
+	SERVER_URING, /* Batched asynchronous requests through io_uring */
+	SERVER_NUM_BACKENDS,
+} server_backend_t;
+
+typedef struct _server_config_t {
+	unsigned int port;
+	unsigned int threads; /* Number of shards; 0 for one per core */
+	server_backend_t backend;
+	/* Past the high watermark the slow consumer policy applies; file data
+	 * is only queued while the queue is below the low watermark */
+	size_t out_high_wm, out_low_wm;
+	/* Bytes a socket may hold unsent (TCP_NOTSENT_LOWAT), so that bulk data
+	 * already handed to the kernel can't delay chat for long; 0 for none */
+	size_t out_inflight;
+	outq_policy_t out_policy;
+	/* Largest file block agreed with a client: larger blocks mean fewer
+	 * frames, but chat waits longer behind each one */
+	uint32_t chunk;
+	/* Deflate level for downloads, or 0 to send them raw; compressed
+	 * uploads are taken either way */
+	int compress;
+	/* Deflate level for the other messages, or 0 to send them raw */
+	int pack;
+	/* Presence changes are batched for this many ms, or sent as they happen */
+	unsigned int presence;
+	const char *spool;
+	/* Unused files are deleted, oldest first, to keep the spool within its
+	 * quota; uploads that still don't fit are refused */
+	unsigned long long spool_quota;
+	unsigned int spool_fds;
+	/* Small files skip the file system, within a memory quota of their
+	 * own; larger ones, or those that don't fit, go to the spool */
+	unsigned long long spool_mem_max, spool_mem_quota;
+} server_config_t;
 
 typedef struct _server_t {
-	sp_vector_t clients;
+	server_config_t config;
+	sp_vector_t clients; /* Of client_t *, which must not move */
 	sp_vector_t chatrooms;
-	sp_vector_t files;
+	sp_vector_t files; /* Of file_entry_t *, which must not move */
+	store_t store; /* Where their contents are kept */
+	presence_t presence; /* Changes yet to be sent out */
+	/* Guards the tables above and client state shared between shards;
+	 * held while handling messages, but not for socket I/O */
 	pthread_mutex_t clients_mutex;
 	int socket;
+	shard_t *shards;
+	unsigned int num_shards, next_shard;
 	pthread_t accept_thread;
 	int running;
 } server_t;
 
+void server_wake(server_t *server);
+
+static inline struct _client_t *server_client(const server_t *server, size_t id) {
+	assert(server);
+
+	struct _client_t **client;
+	if(!id || id > server->clients.largest_id
+			|| !(client = sp_vector_get(&server->clients, id)))
+		return NULL;
+	return *client;
+}
+
+static inline struct _file_entry_t *server_file(const server_t *server, size_t id) {
+	assert(server);
+
+	struct _file_entry_t **file;
+	if(!id || id > server->files.largest_id
+			|| !(file = sp_vector_get(&server->files, id)))
+		return NULL;
+	return *file;
+}
+
 #endif
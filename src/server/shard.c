@@ -0,0 +1,210 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "shard.h"
+#include "debug.h"
+
+__thread shard_t *shard_self;
+
+/* Size of each shard's submission queue */
+#define SHARD_URING_ENTRIES 1024
+
+int shard_init(shard_t *shard, struct _server_t *server, unsigned int id, int uring, int compress) {
+	assert(shard);
+	assert(server);
+
+	memset(shard, 0, sizeof(*shard));
+	shard->server = server;
+	shard->id = id;
+	shard->uring = uring;
+	shard->epoll_fd = shard->wake_fd = shard->ring.fd = -1;
+	vector_init(&shard->ready, sizeof(struct _client_t *));
+	vector_init(&shard->dirty, sizeof(struct _client_t *));
+	vector_init(&shard->closing, sizeof(struct _client_t *));
+	vector_init(&shard->dead, sizeof(struct _client_t *));
+	codec_init(&shard->codec, compress);
+
+	shard->wake_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	check(shard->wake_fd != -1, "Couldn't create wakeup eventfd: %s", strerror(errno));
+
+	if(uring) {
+		check_quiet(!uring_init(&shard->ring, SHARD_URING_ENTRIES));
+	} else {
+		shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		check(shard->epoll_fd != -1, "Couldn't create epoll instance: %s", strerror(errno));
+		check_quiet(!shard_watch(shard, shard->wake_fd, NULL, EPOLLIN));
+	}
+
+	return 0;
+error:
+	return 1;
+}
+
+void shard_free(shard_t *shard) {
+	assert(shard);
+
+	/* Nobody is left to deliver these */
+	shard_msg_t *msg = shard_take(shard), *next;
+	for(; msg; msg = next) {
+		next = msg->next;
+		if(msg->frame)
+			outq_frame_unref(msg->frame);
+		free(msg);
+	}
+
+	if(shard->wake_fd != -1)
+		close(shard->wake_fd);
+	if(shard->epoll_fd != -1)
+		close(shard->epoll_fd);
+	if(shard->ring.fd != -1)
+		uring_free(&shard->ring);
+
+	vector_free(&shard->ready);
+	vector_free(&shard->dirty);
+	vector_free(&shard->closing);
+	vector_free(&shard->dead);
+	codec_free(&shard->codec);
+}
+
+int shard_watch(shard_t *shard, int fd, struct _client_t *client, uint32_t events) {
+	assert(shard);
+	assert(fd >= 0);
+
+	struct epoll_event ev = {.events = events, .data.ptr = client};
+	check(!epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &ev),
+			"Couldn't add fd %d to epoll set: %s", fd, strerror(errno));
+
+	return 0;
+error:
+	return 1;
+}
+
+int shard_modify(shard_t *shard, int fd, struct _client_t *client, uint32_t events) {
+	assert(shard);
+	assert(fd >= 0);
+
+	struct epoll_event ev = {.events = events, .data.ptr = client};
+	check(!epoll_ctl(shard->epoll_fd, EPOLL_CTL_MOD, fd, &ev),
+			"Couldn't modify fd %d in epoll set: %s", fd, strerror(errno));
+
+	return 0;
+error:
+	return 1;
+}
+
+void shard_unwatch(shard_t *shard, int fd) {
+	assert(shard);
+	assert(fd >= 0);
+
+	check_warn(!epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, fd, NULL),
+			"Couldn't remove fd %d from epoll set: %s", fd, strerror(errno));
+}
+
+/* Interrupt epoll_wait(); async-signal-safe */
+void shard_wake(shard_t *shard) {
+	assert(shard);
+
+	uint64_t one = 1;
+	if(write(shard->wake_fd, &one, sizeof(one)) < 0) {
+		/* Counter saturated: the loop is already due to wake up */
+	}
+}
+
+int shard_arm_wake(shard_t *shard) {
+	assert(shard);
+	assert(shard->uring);
+
+	struct io_uring_sqe *sqe;
+	check_quiet(sqe = uring_sqe(&shard->ring));
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = shard->wake_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = shard_tag(NULL, SHARD_OP_WAKE);
+
+	return 0;
+error:
+	return 1;
+}
+
+int shard_arm_accept(shard_t *shard, int socket) {
+	assert(shard);
+	assert(shard->uring);
+	assert(socket >= 0);
+
+	struct io_uring_sqe *sqe;
+	check_quiet(sqe = uring_sqe(&shard->ring));
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = socket;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = shard_tag(NULL, SHARD_OP_ACCEPT);
+
+	return 0;
+error:
+	return 1;
+}
+
+int shard_arm_timeout(shard_t *shard, unsigned int ms) {
+	assert(shard);
+	assert(shard->uring);
+	assert(!shard->timing);
+
+	struct io_uring_sqe *sqe;
+	check_quiet(sqe = uring_sqe(&shard->ring));
+	shard->timeout.tv_sec = ms / 1000;
+	shard->timeout.tv_nsec = (ms % 1000) * 1000000LL;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uintptr_t)&shard->timeout;
+	sqe->len = 1;
+	sqe->user_data = shard_tag(NULL, SHARD_OP_TIMEOUT);
+	shard->timing = 1;
+
+	return 0;
+error:
+	return 1;
+}
+
+int shard_post(shard_t *shard, struct _client_t *client, outq_frame_t *frame, int bulk) {
+	assert(shard);
+	assert(client);
+
+	shard_msg_t *msg;
+	check_mem(msg = malloc(sizeof(*msg)));
+	msg->client = client;
+	msg->frame = frame;
+	msg->bulk = bulk;
+
+	msg->next = __atomic_load_n(&shard->inbox, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&shard->inbox, &msg->next, msg,
+				1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* Only the first message of a batch needs to wake the shard up */
+	if(!msg->next)
+		shard_wake(shard);
+
+	return 0;
+error:
+	if(frame)
+		outq_frame_unref(frame);
+	return 1;
+}
+
+shard_msg_t *shard_take(shard_t *shard) {
+	assert(shard);
+
+	shard_msg_t *msg = __atomic_exchange_n(&shard->inbox, NULL, __ATOMIC_ACQUIRE),
+				*prev = NULL, *next;
+
+	/* The inbox is a stack: reverse it to restore the posting order */
+	for(; msg; msg = next) {
+		next = msg->next;
+		msg->next = prev;
+		prev = msg;
+	}
+
+	return prev;
+}
@@ -0,0 +1,104 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "vector.h"
+#include "outq.h"
+#include "uring.h"
+#include "codec.h"
+
+struct _server_t;
+struct _client_t;
+
+/* io_uring requests are tagged with what they are for, and the client they
+ * belong to if any; clients are allocated with malloc(), so the low bits of
+ * their address are free */
+typedef enum _shard_op_t {
+	SHARD_OP_WAKE,
+	SHARD_OP_ACCEPT,
+	SHARD_OP_RECV,
+	SHARD_OP_SEND,
+	SHARD_OP_READ,
+	SHARD_OP_TIMEOUT,
+} shard_op_t;
+
+#define SHARD_OP_MASK 7
+
+static inline uint64_t shard_tag(struct _client_t *client, shard_op_t op) {
+	return (uintptr_t)client | op;
+}
+
+static inline shard_op_t shard_tag_op(uint64_t tag) {
+	return tag & SHARD_OP_MASK;
+}
+
+static inline struct _client_t *shard_tag_client(uint64_t tag) {
+	return (struct _client_t *)(uintptr_t)(tag & ~(uint64_t)SHARD_OP_MASK);
+}
+
+/* A frame queued for a client owned by another shard; no frame means the
+ * shard should take another look at the client, see client_wake() */
+typedef struct _shard_msg_t {
+	struct _shard_msg_t *next;
+	struct _client_t *client;
+	outq_frame_t *frame;
+	int bulk;
+} shard_msg_t;
+
+/* One event loop thread. Each client belongs to a single shard, and only
+ * that shard's thread touches the client's socket and queues; everyone else
+ * hands frames over through the shard's inbox */
+typedef struct _shard_t {
+	struct _server_t *server;
+	unsigned int id;
+	pthread_t thread;
+	int wake_fd;
+	int epoll_fd; /* With the epoll backend */
+	uring_t ring; /* With the io_uring backend */
+	int uring;
+	/* io_uring backend: a timeout is pending, which reads its time from here */
+	int timing;
+	struct __kernel_timespec timeout;
+
+	/* Lock-free stack of messages from other threads, newest first */
+	shard_msg_t *inbox;
+
+	/* Clients with unhandled input, to flush, to drop and to free */
+	vector_t ready, dirty, closing, dead;
+
+	/* For the file blocks of the shard's clients */
+	codec_t codec;
+} shard_t;
+
+/* The shard run by the calling thread, if any */
+extern __thread shard_t *shard_self;
+
+int shard_init(shard_t *shard, struct _server_t *server, unsigned int id, int uring, int compress);
+void shard_free(shard_t *shard);
+
+int shard_watch(shard_t *shard, int fd, struct _client_t *client, uint32_t events);
+int shard_modify(shard_t *shard, int fd, struct _client_t *client, uint32_t events);
+void shard_unwatch(shard_t *shard, int fd);
+void shard_wake(shard_t *shard);
+
+/* io_uring backend: wait for the wakeup eventfd, and accept a connection */
+int shard_arm_wake(shard_t *shard);
+int shard_arm_accept(shard_t *shard, int socket);
+
+/* io_uring backend: complete a request after ms milliseconds, so that the
+ * loop wakes up by then */
+int shard_arm_timeout(shard_t *shard, unsigned int ms);
+
+/* Queues a frame for one of the shard's clients, taking over the caller's
+ * reference; may be called from any thread */
+int shard_post(shard_t *shard, struct _client_t *client, outq_frame_t *frame, int bulk);
+
+/* Takes every message posted so far, oldest first */
+shard_msg_t *shard_take(shard_t *shard);
+
+static inline int shard_has_mail(shard_t *shard) {
+	return __atomic_load_n(&shard->inbox, __ATOMIC_ACQUIRE) != NULL;
+}
+
+#endif
@@ -0,0 +1,604 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "store.h"
+#include "crc32c.h"
+#include "file.h"
+#include "debug.h"
+#include "macros.h"
+
+/* Temporary files of uploads in progress start with this */
+#define STORE_TEMP_PREFIX ".upload-"
+
+static void store_path(const store_t *store, const uint8_t digest[SHA256_LEN], char path[PATH_MAX]) {
+	char hex[2*SHA256_LEN + 1];
+
+	sha256_hex(digest, hex);
+	snprintf(path, PATH_MAX, "%s/%s", store->dir, hex);
+}
+
+/* Reads back a file name written by store_path(); returns 0 on success */
+static int store_parse_name(const char *name, uint8_t digest[SHA256_LEN]) {
+	for(int i=0; i<2*SHA256_LEN; i++) {
+		char c = name[i];
+		int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+		if(v < 0)
+			return 1;
+		digest[i/2] = i % 2 ? digest[i/2] | v : v << 4;
+	}
+
+	return name[2*SHA256_LEN] != '\0';
+}
+
+/* The complete file with this digest, whatever its size, or NULL */
+static store_file_t *store_lookup(const store_t *store, const uint8_t digest[SHA256_LEN]) {
+	store_file_t **file;
+	vector_foreach(&store->files, file) {
+		if((*file)->complete && !memcmp((*file)->digest, digest, SHA256_LEN))
+			return *file;
+	}
+
+	return NULL;
+}
+
+static void store_idle_del(store_t *store, store_file_t *file) {
+	if(file->prev)
+		file->prev->next = file->next;
+	else
+		store->idle_head = file->next;
+	if(file->next)
+		file->next->prev = file->prev;
+	else
+		store->idle_tail = file->prev;
+	file->prev = file->next = NULL;
+}
+
+/* Closes the descriptor of a file no read is pending on */
+static void store_close(store_t *store, store_file_t *file) {
+	assert(!file->pins);
+
+	if(file->fd < 0)
+		return;
+
+	/* Files nothing refers to are kept out of the list */
+	if(file->prev || store->idle_head == file)
+		store_idle_del(store, file);
+	close(file->fd);
+	file->fd = -1;
+	store->open_fds--;
+}
+
+/* Idle descriptors past the limit are closed, oldest first */
+static void store_idle_add(store_t *store, store_file_t *file) {
+	assert(file->fd >= 0);
+	assert(!file->pins);
+
+	file->prev = store->idle_tail;
+	file->next = NULL;
+	if(store->idle_tail)
+		store->idle_tail->next = file;
+	else
+		store->idle_head = file;
+	store->idle_tail = file;
+
+	while(store->open_fds > store->max_fds && store->idle_head)
+		store_close(store, store->idle_head);
+}
+
+/* Allocates the file's table of granule checksums, all unknown */
+static int store_crc_init(store_file_t *file) {
+	const uint64_t granules = (file->size + STORE_GRANULE - 1) / STORE_GRANULE;
+
+	check_mem(file->crcs = malloc(granules * sizeof(*file->crcs)));
+	check_mem(file->crc_known = calloc((granules + 63) / 64, sizeof(*file->crc_known)));
+
+	return 0;
+error:
+	return 1;
+}
+
+static void store_file_free(store_t *store, store_file_t *file) {
+	store_close(store, file);
+	free(file->temp);
+	free(file->mem);
+	free(file->crcs);
+	free(file->crc_known);
+	free(file);
+}
+
+/* Deletes a file nothing refers to any more, and forgets it; it is freed
+ * once no read is pending on it */
+static void store_delete(store_t *store, store_file_t *file) {
+	assert(!file->refs);
+
+	char path[PATH_MAX];
+	store_file_t **f;
+
+	if(file->mem)
+		store->mem_bytes -= file->size;
+	else {
+		if(file->complete)
+			store_path(store, file->digest, path);
+		else
+			snprintf(path, PATH_MAX, "%s", file->temp);
+		check_warn(!unlink(path), "Couldn't delete '%s': %s", path, strerror(errno));
+		store->bytes -= file->size;
+	}
+
+	vector_foreach(&store->files, f) {
+		if(*f == file) {
+			vector_del(&store->files, vector_indexof(&store->files, f));
+			break;
+		}
+	}
+
+	if(file->pins)
+		file->dead = 1;
+	else
+		store_file_free(store, file);
+}
+
+/* Deletes the least recently used file that nothing refers to, in memory
+ * or on disk */
+static int store_evict(store_t *store, int mem) {
+	store_file_t **f, *victim = NULL;
+	char hex[2*SHA256_LEN + 1];
+
+	vector_foreach(&store->files, f) {
+		if(!(*f)->refs && (*f)->complete && !(*f)->mem == !mem
+				&& (!victim || (*f)->used < victim->used))
+			victim = *f;
+	}
+	if(!victim)
+		return 1;
+
+	sha256_hex(victim->digest, hex);
+	log_info("Evicting %s from the spool%s.", hex, mem ? " in memory" : "");
+	store->evictions++;
+	store_delete(store, victim);
+
+	return 0;
+}
+
+/* Evicts files until size more bytes fit in the quota, of memory or disk */
+static int store_make_room(store_t *store, uint64_t size, int mem) {
+	const uint64_t quota = mem ? store->mem_quota : store->quota;
+	const uint64_t *bytes = mem ? &store->mem_bytes : &store->bytes;
+
+	if(!quota)
+		return 0;
+	if(size > quota)
+		return 1;
+
+	while(*bytes > quota - size) {
+		if(store_evict(store, mem))
+			return 1;
+	}
+
+	return 0;
+}
+
+int store_init(store_t *store, const char *dir, uint64_t quota, unsigned int max_fds, uint64_t mem_max, uint64_t mem_quota) {
+	assert(store);
+	assert(dir);
+	assert(max_fds > 0);
+
+	DIR *d = NULL;
+	struct dirent *entry;
+
+	memset(store, 0, sizeof(*store));
+	store->quota = quota;
+	store->max_fds = max_fds;
+	store->mem_max = mem_max;
+	store->mem_quota = mem_quota;
+	store->lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+	vector_init(&store->files, sizeof(store_file_t *));
+
+	check_mem(store->dir = strdup(dir));
+	check(!mkdir(dir, 0700) || errno == EEXIST,
+			"Couldn't create spool directory '%s': %s", dir, strerror(errno));
+	check(d = opendir(dir), "Couldn't open spool directory '%s': %s", dir, strerror(errno));
+
+	while((entry = readdir(d))) {
+		uint8_t digest[SHA256_LEN];
+		struct stat st;
+		store_file_t *file;
+
+		/* Uploads cut short by the last run can't be resumed */
+		if(!strncmp(entry->d_name, STORE_TEMP_PREFIX, strlen(STORE_TEMP_PREFIX))) {
+			check_warn(!unlinkat(dirfd(d), entry->d_name, 0),
+					"Couldn't delete '%s': %s", entry->d_name, strerror(errno));
+			continue;
+		}
+
+		/* ...but their complete files can be shared again */
+		if(store_parse_name(entry->d_name, digest)
+				|| fstatat(dirfd(d), entry->d_name, &st, 0) || !S_ISREG(st.st_mode))
+			continue;
+
+		check_mem(file = calloc(1, sizeof(*file)));
+		file->store = store;
+		file->fd = -1;
+		file->size = st.st_size;
+		file->complete = 1;
+		memcpy(file->digest, digest, SHA256_LEN);
+		if(store_crc_init(file) || !vector_add(&store->files, &file, 1)) {
+			store_file_free(store, file);
+			goto error;
+		}
+		store->bytes += file->size;
+	}
+	closedir(d);
+	d = NULL;
+
+	check_warn(!store_make_room(store, 0, 0), "Spool '%s' is over its quota.", dir);
+	store_log_stats(store);
+
+	return 0;
+error:
+	if(d)
+		closedir(d);
+	store_free(store);
+	return 1;
+}
+
+void store_free(store_t *store) {
+	assert(store);
+
+	store_file_t **file;
+	vector_foreach(&store->files, file) {
+		if((*file)->temp)
+			check_warn(!unlink((*file)->temp), "Couldn't delete '%s': %s",
+					(*file)->temp, strerror(errno));
+		(*file)->pins = 0;
+		store_file_free(store, *file);
+	}
+	vector_free(&store->files);
+
+	pthread_mutex_destroy(&store->lock);
+	free(store->dir);
+	store->dir = NULL;
+}
+
+store_file_t *store_find(store_t *store, const uint8_t digest[SHA256_LEN], uint64_t size) {
+	assert(store);
+	assert(digest);
+
+	store_file_t *file;
+
+	pthread_mutex_lock(&store->lock);
+
+	if((file = store_lookup(store, digest)) && file->size == size) {
+		file->refs++;
+		file->used = ++store->clock;
+	} else
+		file = NULL;
+
+	pthread_mutex_unlock(&store->lock);
+
+	return file;
+}
+
+store_file_t *store_create(store_t *store, uint64_t size) {
+	assert(store);
+	assert(size > 0);
+
+	store_file_t *file = NULL;
+
+	pthread_mutex_lock(&store->lock);
+
+	check_mem(file = calloc(1, sizeof(*file)));
+	file->store = store;
+	file->fd = -1;
+	file->size = size;
+	check_quiet(!store_crc_init(file));
+
+	/* Small files stay in memory, as long as there is room */
+	if(size <= store->mem_max && !store_make_room(store, size, 1)) {
+		check_mem(file->mem = malloc(size));
+		check_mem(vector_add(&store->files, &file, 1));
+		store->mem_bytes += size;
+	} else {
+		check(!store_make_room(store, size, 0), "Spool is full: no room for %" PRIu64 " bytes.", size);
+		check_mem(file->temp = malloc(strlen(store->dir) + strlen("/" STORE_TEMP_PREFIX "XXXXXX") + 1));
+		sprintf(file->temp, "%s/" STORE_TEMP_PREFIX "XXXXXX", store->dir);
+		check((file->fd = file_create_temp(file->temp, size)) != -1,
+				"Couldn't create a temporary file in '%s'.", store->dir);
+		if(!vector_add(&store->files, &file, 1)) {
+			unlink(file->temp);
+			goto error;
+		}
+		store->bytes += size;
+		store->open_fds++;
+	}
+
+	/* The upload keeps it pinned, and any descriptor open, until it is complete */
+	file->refs = file->pins = 1;
+	file->used = ++store->clock;
+
+	pthread_mutex_unlock(&store->lock);
+
+	return file;
+error:
+	if(file && file->fd != -1)
+		close(file->fd);
+	if(file) {
+		free(file->temp);
+		free(file->mem);
+		free(file->crcs);
+		free(file->crc_known);
+	}
+	free(file);
+	pthread_mutex_unlock(&store->lock);
+	return NULL;
+}
+
+/* Notes the checksum of a granule; whoever reads it back sees crcs first */
+static void store_crc_set(store_file_t *file, uint64_t granule, uint32_t crc) {
+	__atomic_store_n(&file->crcs[granule], crc, __ATOMIC_RELAXED);
+	__atomic_or_fetch(&file->crc_known[granule / 64], 1ULL << granule % 64, __ATOMIC_RELEASE);
+}
+
+/* The checksum of a granule, if it is known; returns 0 if it is */
+static int store_crc_get(const store_file_t *file, uint64_t granule, uint32_t *crc) {
+	if(!(__atomic_load_n(&file->crc_known[granule / 64], __ATOMIC_ACQUIRE) & 1ULL << granule % 64))
+		return 1;
+
+	*crc = __atomic_load_n(&file->crcs[granule], __ATOMIC_RELAXED);
+	return 0;
+}
+
+uint32_t store_checksum(store_file_t *file, const void *buf, size_t len, uint64_t offset) {
+	assert(file);
+	assert(buf);
+	assert(!file->complete);
+	assert(offset % STORE_GRANULE == 0);
+	assert(offset + len <= file->size);
+
+	uint32_t crc = 0;
+
+	/* A block that fails its check is sent again, and the checksums of
+	 * its granules overwritten, before the downloads can get to them */
+	for(size_t done = 0, n; done < len; done += n) {
+		const uint64_t at = offset + done;
+		n = min(len - done, STORE_GRANULE);
+
+		uint32_t c = crc32c(0, (const char *)buf + done, n);
+		if(n == STORE_GRANULE || at + n == file->size)
+			store_crc_set(file, at / STORE_GRANULE, c);
+		crc = crc32c_combine(crc, c, n);
+	}
+
+	return crc;
+}
+
+int store_write(store_file_t *file, const void *buf, size_t len, uint64_t offset) {
+	assert(file);
+	assert(!file->complete);
+	assert(offset + len <= file->size);
+
+	if(!file->mem)
+		return file_write(file->fd, buf, len, offset);
+
+	memcpy(file->mem + offset, buf, len);
+	return 0;
+}
+
+int store_commit(store_t *store, store_file_t **file, const uint8_t digest[SHA256_LEN]) {
+	assert(store);
+	assert(file);
+	assert(!(*file)->complete);
+	assert((*file)->refs == 1);
+	assert(digest);
+
+	store_file_t *upload = *file, *stored;
+	char dst[PATH_MAX];
+
+	pthread_mutex_lock(&store->lock);
+
+	store_path(store, digest, dst);
+
+	/* Same contents as an earlier upload: switch over to its copy */
+	if((stored = store_lookup(store, digest)) && stored->size == upload->size) {
+		stored->refs++;
+		stored->used = ++store->clock;
+		*file = stored;
+
+		upload->refs = 0;
+		upload->pins--;
+		store_delete(store, upload);
+
+		pthread_mutex_unlock(&store->lock);
+		return 0;
+	}
+
+	check(!stored, "Stored copy '%s' is damaged.", dst);
+	if(!upload->mem) {
+		check(!rename(upload->temp, dst), "Couldn't store '%s': %s", dst, strerror(errno));
+		free(upload->temp);
+		upload->temp = NULL;
+	}
+
+	memcpy(upload->digest, digest, SHA256_LEN);
+	upload->complete = 1;
+	if(!--upload->pins && upload->fd >= 0)
+		store_idle_add(store, upload);
+
+	pthread_mutex_unlock(&store->lock);
+	return 0;
+error:
+	pthread_mutex_unlock(&store->lock);
+	return 1;
+}
+
+void store_release(store_t *store, store_file_t *file) {
+	assert(store);
+	assert(file);
+
+	pthread_mutex_lock(&store->lock);
+
+	assert(file->refs > 0);
+	if(--file->refs) {
+		pthread_mutex_unlock(&store->lock);
+		return;
+	}
+
+	if(!file->complete) {
+		/* An upload that won't complete */
+		file->pins--;
+		store_delete(store, file);
+	} else if(!file->pins)
+		store_close(store, file);
+
+	pthread_mutex_unlock(&store->lock);
+}
+
+store_file_t *store_pin(store_t *store, store_file_t **file, int *fd) {
+	assert(store);
+	assert(file);
+	assert(fd);
+
+	store_file_t *f;
+	char path[PATH_MAX];
+
+	pthread_mutex_lock(&store->lock);
+
+	f = *file;
+	assert(f->refs > 0);
+
+	if(!f->mem && f->fd < 0) {
+		/* Make room in the cache first */
+		if(store->open_fds >= store->max_fds && store->idle_head)
+			store_close(store, store->idle_head);
+
+		store_path(store, f->digest, path);
+		check((f->fd = open(f->temp ? f->temp : path, O_RDONLY|O_CLOEXEC)) != -1,
+				"Couldn't open '%s': %s", f->temp ? f->temp : path, strerror(errno));
+		store->open_fds++;
+	} else if(f->fd >= 0 && !f->pins)
+		store_idle_del(store, f);
+
+	f->pins++;
+	f->used = ++store->clock;
+	*fd = f->fd;
+
+	pthread_mutex_unlock(&store->lock);
+
+	return f;
+error:
+	pthread_mutex_unlock(&store->lock);
+	return NULL;
+}
+
+void store_unpin(store_file_t *file) {
+	assert(file);
+
+	store_t *store = file->store;
+
+	pthread_mutex_lock(&store->lock);
+
+	assert(file->pins > 0);
+	if(!--file->pins) {
+		if(file->dead)
+			store_file_free(store, file);
+		else if(!file->refs)
+			store_close(store, file);
+		else if(file->fd >= 0)
+			store_idle_add(store, file);
+	}
+
+	pthread_mutex_unlock(&store->lock);
+}
+
+/* Checksums len bytes of a pinned file from offset, reading them back */
+static int store_crc_read(const store_file_t *file, int fd, uint64_t offset, size_t len, uint32_t *crc) {
+	char *buf = NULL;
+
+	if(file->mem) {
+		*crc = crc32c(0, file->mem + offset, len);
+		return 0;
+	}
+
+	check_mem(buf = malloc(len));
+	check_quiet(!file_read(fd, buf, len, offset));
+	*crc = crc32c(0, buf, len);
+	free(buf);
+
+	return 0;
+error:
+	free(buf);
+	return 1;
+}
+
+int store_crc(store_file_t *file, int fd, uint64_t offset, uint64_t len, uint32_t *crc) {
+	assert(file);
+	assert(crc);
+	assert(file->pins > 0);
+	assert(offset + len <= file->size);
+
+	*crc = 0;
+
+	for(uint64_t end = offset + len, n; offset < end; offset += n) {
+		const uint64_t granule = offset / STORE_GRANULE,
+			  start = granule * STORE_GRANULE,
+			  stop = min(start + STORE_GRANULE, file->size);
+		uint32_t c;
+
+		n = min(stop, end) - offset;
+
+		/* Only whole granules have their checksums noted */
+		if(offset != start || n != stop - start) {
+			check_quiet(!store_crc_read(file, fd, offset, n, &c));
+		} else if(store_crc_get(file, granule, &c)) {
+			check_quiet(!store_crc_read(file, fd, offset, n, &c));
+			store_crc_set(file, granule, c);
+		}
+
+		*crc = crc32c_combine(*crc, c, n);
+	}
+
+	return 0;
+error:
+	return 1;
+}
+
+int store_hash(store_file_t *file, int fd, uint64_t offset, size_t len, sha256_t *hash) {
+	assert(file);
+	assert(hash);
+	assert(file->pins > 0);
+	assert(offset + len <= file->size);
+
+	char *buf = NULL;
+
+	if(file->mem) {
+		sha256_update(hash, file->mem + offset, len);
+		return 0;
+	}
+
+	check_mem(buf = malloc(len));
+	check_quiet(!file_read(fd, buf, len, offset));
+	sha256_update(hash, buf, len);
+	free(buf);
+
+	return 0;
+error:
+	free(buf);
+	return 1;
+}
+
+void store_log_stats(store_t *store) {
+	assert(store);
+
+	pthread_mutex_lock(&store->lock);
+	log_info("Spool: %" PRIu64 " bytes on disk and %" PRIu64 " in memory, in %zu files, %u open, %" PRIu64 " evicted",
+			store->bytes, store->mem_bytes, store->files.size, store->open_fds, store->evictions);
+	pthread_mutex_unlock(&store->lock);
+}
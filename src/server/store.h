@@ -0,0 +1,112 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "vector.h"
+#include "sha256.h"
+
+/* Files are checksummed in granules of this many bytes, the smallest file
+ * block, so that a block's checksum can be put together from theirs */
+#define STORE_GRANULE (1<<15)
+
+/* A file in the store, shared by every file entry with the same contents.
+ * It is kept on disk while unused too, for later uploads of the same
+ * contents, until the quota needs the space */
+typedef struct _store_file_t {
+	struct _store_t *store;
+	uint8_t digest[SHA256_LEN];
+	uint64_t size;
+	int complete; /* Filed under its digest */
+	char *temp; /* Path of an upload to disk, until it is complete */
+	char *mem; /* Contents of a small file, kept in memory; NULL on disk */
+	unsigned int refs; /* File entries using it */
+	int dead; /* Deleted, and freed once unpinned */
+	/* Open descriptor, or -1; cached while idle, and only closed once no
+	 * read through it, or of mem, is pending */
+	int fd;
+	unsigned int pins;
+	uint64_t used; /* When it was last read from, for eviction */
+	struct _store_file_t *prev, *next; /* In the list of idle descriptors */
+
+	/* The CRC-32C of each granule, so that downloads can send blocks with
+	 * their checksums without reading them; crc_known has a bit set for
+	 * each one filled in. Files found in the spool at startup have theirs
+	 * filled in as they are first read. Atomic */
+	uint32_t *crcs;
+	uint64_t *crc_known;
+} store_file_t;
+
+/* Content-addressed spool directory: each complete file is kept once, named
+ * after the hex SHA-256 of its contents, so that identical uploads share one
+ * copy on disk. Uploads in progress are written to temporary files beside
+ * them, and filed under their digest once complete. At most max_fds
+ * descriptors are kept open for idle files, least recently used first out,
+ * and unused files are deleted, least recently used first, to keep the
+ * spool within its quota.
+ * Files of up to mem_max bytes are kept in memory instead, within a quota
+ * of their own, and skip the file system altogether; they don't outlive
+ * the server. Thread safe */
+typedef struct _store_t {
+	char *dir;
+	uint64_t quota; /* Bytes, or 0 for no limit */
+	unsigned int max_fds;
+	uint64_t mem_max, mem_quota;
+	pthread_mutex_t lock;
+	vector_t files; /* Of store_file_t *, which must not move */
+	store_file_t *idle_head, *idle_tail; /* Oldest first */
+	uint64_t clock;
+
+	/* Counters, under the lock */
+	uint64_t bytes; /* In the spool, including uploads in progress */
+	uint64_t mem_bytes; /* Likewise, in memory */
+	unsigned int open_fds;
+	uint64_t evictions;
+} store_t;
+
+int store_init(store_t *store, const char *dir, uint64_t quota, unsigned int max_fds, uint64_t mem_max, uint64_t mem_quota);
+void store_free(store_t *store);
+
+/* The stored file with this digest and size, or NULL if there is none. The
+ * caller gets a reference */
+store_file_t *store_find(store_t *store, const uint8_t digest[SHA256_LEN], uint64_t size);
+
+/* Makes room for, and creates, a temporary file for an upload of size bytes,
+ * in memory if it is small enough, and open for writing until it is
+ * committed. The caller gets a reference; NULL if the spool is full */
+store_file_t *store_create(store_t *store, uint64_t size);
+
+/* Checksums a block of an upload, which starts on a granule, before it is
+ * written, noting the checksums of its granules for the downloads */
+uint32_t store_checksum(store_file_t *file, const void *buf, size_t len, uint64_t offset);
+
+/* Writes part of an upload; returns 0 on success */
+int store_write(store_file_t *file, const void *buf, size_t len, uint64_t offset);
+
+/* Files a complete upload under its digest. If the store has the same
+ * contents already, *file is switched over to that copy, and the upload's
+ * own copy goes away once no read of it is pending */
+int store_commit(store_t *store, store_file_t **file, const uint8_t digest[SHA256_LEN]);
+
+/* Drops a reference; an upload nothing refers to any more is deleted */
+void store_release(store_t *store, store_file_t *file);
+
+/* Sets fd to a descriptor for *file, which stays open until store_unpin(),
+ * or to -1 if it is kept in memory: then its mem stays valid instead.
+ * Returns the file pinned, which store_commit() may switch *file away from
+ * meanwhile, or NULL on error */
+store_file_t *store_pin(store_t *store, store_file_t **file, int *fd);
+void store_unpin(store_file_t *file);
+
+/* Sets crc to the CRC-32C of len bytes of a pinned file from offset, put
+ * together from the checksums of its granules, reading back only what they
+ * don't cover; returns 0 on success */
+int store_crc(store_file_t *file, int fd, uint64_t offset, uint64_t len, uint32_t *crc);
+
+/* Adds len bytes of a pinned file from offset to a running SHA-256;
+ * returns 0 on success */
+int store_hash(store_file_t *file, int fd, uint64_t offset, size_t len, sha256_t *hash);
+
+void store_log_stats(store_t *store);
+
+#endif
@@ -0,0 +1,118 @@
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "debug.h"
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_init(uring_t *ring, unsigned int entries) {
+	assert(ring);
+	assert(entries > 0);
+
+	struct io_uring_params p;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+
+	ring->fd = uring_setup(entries, &p);
+	check(ring->fd >= 0, "Couldn't create io_uring: %s", strerror(errno));
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries*sizeof(unsigned int);
+	ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	ring->sqes_sz = p.sq_entries*sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	check(ring->sq_ring != MAP_FAILED, "Couldn't map submission ring: %s", strerror(errno));
+	ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	check(ring->cq_ring != MAP_FAILED, "Couldn't map completion ring: %s", strerror(errno));
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	check(ring->sqes != MAP_FAILED, "Couldn't map submission entries: %s", strerror(errno));
+
+	char *sq = ring->sq_ring, *cq = ring->cq_ring;
+	ring->sq_head  = (unsigned int *)(sq + p.sq_off.head);
+	ring->sq_tail  = (unsigned int *)(sq + p.sq_off.tail);
+	ring->sq_mask  = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	ring->cq_head  = (unsigned int *)(cq + p.cq_off.head);
+	ring->cq_tail  = (unsigned int *)(cq + p.cq_off.tail);
+	ring->cq_mask  = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+error:
+	uring_free(ring);
+	return 1;
+}
+
+void uring_free(uring_t *ring) {
+	assert(ring);
+
+	if(ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_sz);
+	if(ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	if(ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+	if(ring->fd >= 0)
+		close(ring->fd);
+	ring->fd = -1;
+	ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *ring) {
+	assert(ring);
+
+	unsigned int tail = *ring->sq_tail;
+
+	if(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > *ring->sq_mask) {
+		check_quiet(!uring_submit(ring, 0));
+		check(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) <= *ring->sq_mask,
+				"Submission queue full.");
+	}
+
+	unsigned int i = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[i] = i;
+
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->sq_pending++;
+
+	return sqe;
+error:
+	return NULL;
+}
+
+int uring_submit(uring_t *ring, unsigned int wait_nr) {
+	assert(ring);
+
+	int r = uring_enter(ring->fd, ring->sq_pending, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	if(r >= 0) {
+		ring->sq_pending -= r;
+		return 0;
+	}
+
+	/* Interrupted, or short of resources until some completions are
+	 * reaped: the caller goes round its loop again either way */
+	check(errno == EINTR || errno == EAGAIN || errno == EBUSY,
+			"Couldn't submit to io_uring: %s", strerror(errno));
+
+	return 0;
+error:
+	return 1;
+}
@@ -0,0 +1,47 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/* Minimal io_uring wrapper over the raw system calls; one ring per thread */
+typedef struct _uring_t {
+	int fd;
+
+	/* Submission queue */
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_pending; /* Entries filled in but not yet submitted */
+
+	/* Completion queue */
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned int entries);
+void uring_free(uring_t *ring);
+
+/* Next free submission entry, cleared; submits queued entries to make room
+ * if the queue is full. Returns NULL on failure */
+struct io_uring_sqe *uring_sqe(uring_t *ring);
+
+/* Submits everything queued, and waits for at least wait_nr completions */
+int uring_submit(uring_t *ring, unsigned int wait_nr);
+
+/* Oldest unseen completion, or NULL */
+static inline struct io_uring_cqe *uring_cqe(uring_t *ring) {
+	unsigned int head = *ring->cq_head;
+	if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+static inline void uring_cqe_seen(uring_t *ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,64 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "buffer.h"
+#include "debug.h"
+#include "macros.h"
+
+void buffer_init(buffer_t *b) {
+	assert(b);
+	memset(b, 0, sizeof(*b));
+}
+
+void buffer_free(buffer_t *b) {
+	assert(b);
+	free(b->data);
+	buffer_init(b);
+}
+
+/* Makes room for len more bytes at the end, and returns a pointer to it */
+char *buffer_reserve(buffer_t *b, size_t len) {
+	assert(b);
+
+	if(b->size - b->end >= len)
+		return b->data + b->end;
+
+	/* Move the unconsumed bytes to the front before growing */
+	if(b->start) {
+		memmove(b->data, b->data + b->start, buffer_len(b));
+		b->end -= b->start;
+		b->start = 0;
+	}
+
+	if(b->size - b->end < len) {
+		size_t size = max(b->size*2, b->end + len);
+		char *data;
+		check_mem(data = realloc(b->data, size));
+		b->data = data;
+		b->size = size;
+	}
+
+	return b->data + b->end;
+error:
+	return NULL;
+}
+
+ssize_t buffer_recv(buffer_t *b, int fd, size_t len) {
+	assert(b);
+	assert(fd >= 0);
+
+	char *dst;
+	ssize_t r;
+
+	if(!(dst = buffer_reserve(b, len))) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if((r = recv(fd, dst, len, MSG_DONTWAIT)) > 0)
+		buffer_commit(b, r);
+
+	return r;
+}
@@ -0,0 +1,46 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Byte buffer filled at the end and consumed from the start */
+typedef struct _buffer_t {
+	char *data;
+	size_t start, end, size;
+} buffer_t;
+
+void buffer_init(buffer_t *b);
+void buffer_free(buffer_t *b);
+char *buffer_reserve(buffer_t *b, size_t len);
+
+/* Appends whatever recv() returns, reading at most len bytes */
+ssize_t buffer_recv(buffer_t *b, int fd, size_t len);
+
+static inline char *buffer_data(const buffer_t *b) {
+	assert(b);
+	return b->data + b->start;
+}
+
+static inline size_t buffer_len(const buffer_t *b) {
+	assert(b);
+	return b->end - b->start;
+}
+
+static inline void buffer_commit(buffer_t *b, size_t len) {
+	assert(b);
+	assert(b->end + len <= b->size);
+	b->end += len;
+}
+
+static inline void buffer_consume(buffer_t *b, size_t len) {
+	assert(b);
+	assert(len <= buffer_len(b));
+
+	b->start += len;
+	if(b->start == b->end)
+		b->start = b->end = 0;
+}
+
+#endif /* end of include guard: BUFFER_H */
@@ -0,0 +1,235 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+#include "debug.h"
+#include "macros.h"
+
+/* Samples of a block looked at to judge it */
+#define CODEC_SAMPLES 8
+#define CODEC_SAMPLE_SZ 512
+
+/* Streams keep a 4 KiB window, and take up about 40 KiB to deflate; what
+ * a single write inflates to is capped, against decompression bombs */
+#define CODEC_STREAM_WBITS 12
+#define CODEC_STREAM_MEMLEVEL 5
+#define CODEC_STREAM_MAX (1<<24)
+#define CODEC_STREAM_MIN_OUT (1<<12)
+
+void codec_init(codec_t *codec, int level) {
+	assert(codec);
+	assert(level >= 0 && level <= 9);
+
+	memset(codec, 0, sizeof(*codec));
+	codec->level = level;
+}
+
+void codec_free(codec_t *codec) {
+	assert(codec);
+
+	if(codec->deflating)
+		deflateEnd(&codec->deflate);
+	if(codec->inflating)
+		inflateEnd(&codec->inflate);
+	free(codec->out);
+	memset(codec, 0, sizeof(*codec));
+}
+
+/* Grows an output buffer to at least len bytes */
+static int codec_grow(char **out, size_t *out_sz, size_t len) {
+	char *grown;
+
+	if(*out_sz >= len)
+		return 0;
+
+	check_mem(grown = realloc(*out, len));
+	*out = grown;
+	*out_sz = len;
+
+	return 0;
+error:
+	return 1;
+}
+
+/* Adds up how often each byte value turns up */
+static void codec_count(uint32_t counts[256], const uint8_t *p, size_t len) {
+	for(size_t i=0; i<len; i++)
+		counts[p[i]]++;
+}
+
+/* The chance that two bytes picked at random are equal is 1/256 for random
+ * data, and far higher for text and the like; at 2^-7.5 or below, what
+ * deflate could save isn't worth the time it takes */
+int codec_worth_it(const void *buf, size_t len) {
+	assert(buf || !len);
+
+	uint32_t counts[256] = {0};
+	uint64_t n = 0, pairs = 0;
+
+	if(len < CODEC_MIN_SZ)
+		return 0;
+
+	if(len <= CODEC_SAMPLES*CODEC_SAMPLE_SZ) {
+		codec_count(counts, buf, len);
+		n = len;
+	} else {
+		/* Spread over the block, the last one at its end */
+		size_t step = (len - CODEC_SAMPLE_SZ) / (CODEC_SAMPLES - 1);
+		for(int i=0; i<CODEC_SAMPLES; i++)
+			codec_count(counts, (const uint8_t *)buf + i*step, CODEC_SAMPLE_SZ);
+		n = CODEC_SAMPLES*CODEC_SAMPLE_SZ;
+	}
+
+	for(int i=0; i<256; i++) {
+		if(counts[i])
+			pairs += (uint64_t)counts[i] * (counts[i] - 1);
+	}
+
+	/* 2^7.5 is about 181 */
+	return pairs * 181 > n * (n - 1);
+}
+
+size_t codec_compress(codec_t *codec, const void *buf, size_t len) {
+	assert(codec);
+	assert(codec->level > 0);
+	assert(buf);
+	assert(len > 0);
+
+	/* Not worth it unless it saves some */
+	size_t limit = len - len/32;
+	int ret;
+
+	if(!codec->deflating) {
+		check(deflateInit2(&codec->deflate, codec->level, Z_DEFLATED, -MAX_WBITS, 8,
+					Z_DEFAULT_STRATEGY) == Z_OK, "Couldn't set up deflate.");
+		codec->deflating = 1;
+	} else
+		deflateReset(&codec->deflate);
+	check_quiet(!codec_grow(&codec->out, &codec->out_sz, limit));
+
+	codec->deflate.next_in = (Bytef *)buf;
+	codec->deflate.avail_in = len;
+	codec->deflate.next_out = (Bytef *)codec->out;
+	codec->deflate.avail_out = limit;
+
+	/* Runs out of room if it doesn't */
+	if((ret = deflate(&codec->deflate, Z_FINISH)) != Z_STREAM_END) {
+		check(ret == Z_OK || ret == Z_BUF_ERROR, "Couldn't deflate: %s",
+				codec->deflate.msg ? codec->deflate.msg : "unknown error");
+		return 0;
+	}
+
+	return codec->deflate.total_out;
+error:
+	return 0;
+}
+
+ssize_t codec_decompress(codec_t *codec, const void *buf, size_t len, size_t max) {
+	return codec_decompress_to(codec, buf, len, max, &codec->out, &codec->out_sz);
+}
+
+ssize_t codec_decompress_to(codec_t *codec, const void *buf, size_t len, size_t max, char **out, size_t *out_sz) {
+	assert(codec);
+	assert(buf || !len);
+	assert(out);
+	assert(out_sz);
+
+	if(!codec->inflating) {
+		check(inflateInit2(&codec->inflate, -MAX_WBITS) == Z_OK, "Couldn't set up inflate.");
+		codec->inflating = 1;
+	} else
+		inflateReset(&codec->inflate);
+	check_quiet(!codec_grow(out, out_sz, max));
+
+	codec->inflate.next_in = (Bytef *)buf;
+	codec->inflate.avail_in = len;
+	codec->inflate.next_out = (Bytef *)*out;
+	codec->inflate.avail_out = max;
+
+	/* Nothing may be left over on either side */
+	if(inflate(&codec->inflate, Z_FINISH) != Z_STREAM_END || codec->inflate.avail_in)
+		return -1;
+
+	return codec->inflate.total_out;
+error:
+	return -1;
+}
+
+int codec_stream_init(codec_stream_t *stream, int level) {
+	assert(stream);
+	assert(level >= 0 && level <= 9);
+
+	memset(stream, 0, sizeof(*stream));
+	stream->deflating = level > 0;
+
+	if(stream->deflating) {
+		check(deflateInit2(&stream->z, level, Z_DEFLATED, -CODEC_STREAM_WBITS,
+					CODEC_STREAM_MEMLEVEL, Z_DEFAULT_STRATEGY) == Z_OK,
+				"Couldn't set up deflate.");
+	} else {
+		check(inflateInit2(&stream->z, -CODEC_STREAM_WBITS) == Z_OK,
+				"Couldn't set up inflate.");
+	}
+
+	return 0;
+error:
+	return 1;
+}
+
+void codec_stream_free(codec_stream_t *stream) {
+	assert(stream);
+
+	if(stream->deflating)
+		deflateEnd(&stream->z);
+	else
+		inflateEnd(&stream->z);
+	free(stream->out);
+	memset(stream, 0, sizeof(*stream));
+}
+
+/* Runs the stream until it has taken all of its input, and has no more
+ * output to give */
+static int codec_stream_run(codec_stream_t *stream, const void *buf, size_t len, int flush) {
+	z_stream *z = &stream->z;
+	int ret;
+
+	z->next_in = (Bytef *)buf;
+	z->avail_in = len;
+
+	do {
+		if(stream->out_sz - stream->out_len < CODEC_MIN_SZ) {
+			check(stream->out_sz < CODEC_STREAM_MAX, "Stream inflates to too much.");
+			check_quiet(!codec_grow(&stream->out, &stream->out_sz,
+						max(2*stream->out_sz, CODEC_STREAM_MIN_OUT)));
+		}
+
+		z->next_out = (Bytef *)stream->out + stream->out_len;
+		z->avail_out = stream->out_sz - stream->out_len;
+		ret = stream->deflating ? deflate(z, flush) : inflate(z, flush);
+		stream->out_len = stream->out_sz - z->avail_out;
+
+		/* A buffer error only means there was nothing left to do */
+		check(ret == Z_OK || ret == Z_BUF_ERROR, "Couldn't %s stream: %s",
+				stream->deflating ? "deflate" : "inflate", z->msg ? z->msg : "unknown error");
+	} while(z->avail_in || !z->avail_out);
+
+	return 0;
+error:
+	return 1;
+}
+
+int codec_stream_write(codec_stream_t *stream, const void *buf, size_t len) {
+	assert(stream);
+	assert(buf || !len);
+
+	return codec_stream_run(stream, buf, len, stream->deflating ? Z_NO_FLUSH : Z_SYNC_FLUSH);
+}
+
+int codec_stream_flush(codec_stream_t *stream) {
+	assert(stream);
+	assert(stream->deflating);
+
+	return codec_stream_run(stream, NULL, 0, Z_SYNC_FLUSH);
+}
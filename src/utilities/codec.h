@@ -0,0 +1,67 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+/* Blocks smaller than this are never worth compressing */
+#define CODEC_MIN_SZ 512
+
+/* Raw deflate of file blocks, each on its own: blocks are checked, resent
+ * and shared between downloads one at a time, so none may depend on those
+ * before it. The streams are set up on first use, and their output is kept
+ * in a buffer of the codec's own, valid until the next call. Not thread
+ * safe: each thread has its own */
+typedef struct _codec_t {
+	int level; /* Of compression, 1 to 9; 0 if only used to decompress */
+	z_stream deflate, inflate;
+	int deflating, inflating; /* Whether each stream is set up */
+	char *out;
+	size_t out_sz;
+} codec_t;
+
+void codec_init(codec_t *codec, int level);
+void codec_free(codec_t *codec);
+
+/* Whether a block looks compressible, judged from a histogram of a few
+ * samples of it; much cheaper than trying, and good enough to skip data
+ * that is compressed already */
+int codec_worth_it(const void *buf, size_t len);
+
+/* Compresses a block into codec->out; returns its compressed length, or 0
+ * if it doesn't come out small enough to be worth it */
+size_t codec_compress(codec_t *codec, const void *buf, size_t len);
+
+/* Decompresses a block into codec->out; returns its length, or -1 if it is
+ * damaged, or longer than max */
+ssize_t codec_decompress(codec_t *codec, const void *buf, size_t len, size_t max);
+
+/* Likewise, into a buffer of the caller's, grown as need be, so that the
+ * block outlives the next call */
+ssize_t codec_decompress_to(codec_t *codec, const void *buf, size_t len, size_t max, char **out, size_t *out_sz);
+
+/* One side of a deflate stream over a connection's messages, so that they
+ * share its history as a dictionary. The sender flushes it after each
+ * batch, so that the other side can decode all of it straight away. What
+ * comes out is added to out, until the caller empties it by setting
+ * out_len to 0. Only a small window is kept, as every connection has a
+ * stream of its own */
+typedef struct _codec_stream_t {
+	z_stream z;
+	int deflating; /* Or inflating */
+	char *out;
+	size_t out_len, out_sz;
+} codec_stream_t;
+
+/* A level of 0 sets up the inflating side; returns 0 on success */
+int codec_stream_init(codec_stream_t *stream, int level);
+void codec_stream_free(codec_stream_t *stream);
+
+/* Deflates or inflates len more bytes; returns 0 on success */
+int codec_stream_write(codec_stream_t *stream, const void *buf, size_t len);
+
+/* Deflates everything written so far into out, up to a byte boundary */
+int codec_stream_flush(codec_stream_t *stream);
+
+#endif
@@ -0,0 +1,179 @@
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CRC32C_X86
+#endif
+
+#include "crc32c.h"
+
+/* Reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+/* Lane lengths for the interleaved hardware loop */
+#define CRC32C_LONG  8192
+#define CRC32C_SHORT 256
+
+/* Byte-at-a-time tables for slicing by 8 */
+static uint32_t crc32c_table[8][256];
+
+/* x^(2^n) modulo the polynomial, for shifting a crc past n zero bits */
+static uint32_t crc32c_x2n[64];
+
+/* Multiplies a and b modulo the polynomial */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+	uint32_t m = 1U << 31, p = 0;
+
+	for(;;) {
+		if(a & m) {
+			p ^= b;
+			if(!(a & (m - 1)))
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/* x^(8*len) modulo the polynomial: the operator for appending len zeros */
+static uint32_t crc32c_zeros(uint64_t len) {
+	uint32_t p = 1U << 31;
+
+	for(int k=3; len; len >>= 1, k++)
+		if(len & 1)
+			p = crc32c_multmodp(crc32c_x2n[k & 63], p);
+	return p;
+}
+
+static void crc32c_tables(void) {
+	for(uint32_t n=0; n<256; n++) {
+		uint32_t crc = n;
+		for(int k=0; k<8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][n] = crc;
+	}
+	for(uint32_t n=0; n<256; n++)
+		for(int k=1; k<8; k++)
+			crc32c_table[k][n] = (crc32c_table[k-1][n] >> 8)
+				^ crc32c_table[0][crc32c_table[k-1][n] & 0xff];
+
+	crc32c_x2n[0] = 1U << 30;
+	for(int n=1; n<64; n++)
+		crc32c_x2n[n] = crc32c_multmodp(crc32c_x2n[n-1], crc32c_x2n[n-1]);
+}
+
+static uint32_t crc32c_generic(uint32_t crc, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+
+	crc = ~crc;
+	for(; len >= 8; len -= 8, p += 8) {
+		crc ^= (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+		crc = crc32c_table[7][crc & 0xff] ^ crc32c_table[6][(crc >> 8) & 0xff]
+			^ crc32c_table[5][(crc >> 16) & 0xff] ^ crc32c_table[4][crc >> 24]
+			^ crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]]
+			^ crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+	}
+	while(len--)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+	return ~crc;
+}
+
+#ifdef CRC32C_X86
+/* Operators for appending CRC32C_LONG and CRC32C_SHORT zeros, a byte of the
+ * crc at a time */
+static uint32_t crc32c_long[4][256], crc32c_short[4][256];
+
+static void crc32c_shift_tables(uint32_t table[4][256], uint64_t len) {
+	uint32_t op = crc32c_zeros(len);
+
+	for(uint32_t n=0; n<256; n++)
+		for(int k=0; k<4; k++)
+			table[k][n] = crc32c_multmodp(op, n << (8*k));
+}
+
+static inline uint32_t crc32c_shift(uint32_t table[4][256], uint32_t crc) {
+	return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff]
+		^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+static inline uint64_t crc32c_load(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* With SSE4.2: the crc32 instruction has a latency of three cycles but a
+ * throughput of one, so three independent lanes keep it busy, and are
+ * shifted into place and combined after each stretch */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	uint64_t crc0 = ~crc;
+
+	for(; len && ((uintptr_t)p & 7); len--)
+		crc0 = _mm_crc32_u8(crc0, *p++);
+
+	for(; len >= 3*CRC32C_LONG; len -= 3*CRC32C_LONG, p += 2*CRC32C_LONG) {
+		uint64_t crc1 = 0, crc2 = 0;
+		for(const uint8_t *end = p + CRC32C_LONG; p < end; p += 8) {
+			crc0 = _mm_crc32_u64(crc0, crc32c_load(p));
+			crc1 = _mm_crc32_u64(crc1, crc32c_load(p + CRC32C_LONG));
+			crc2 = _mm_crc32_u64(crc2, crc32c_load(p + 2*CRC32C_LONG));
+		}
+		crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+	}
+
+	for(; len >= 3*CRC32C_SHORT; len -= 3*CRC32C_SHORT, p += 2*CRC32C_SHORT) {
+		uint64_t crc1 = 0, crc2 = 0;
+		for(const uint8_t *end = p + CRC32C_SHORT; p < end; p += 8) {
+			crc0 = _mm_crc32_u64(crc0, crc32c_load(p));
+			crc1 = _mm_crc32_u64(crc1, crc32c_load(p + CRC32C_SHORT));
+			crc2 = _mm_crc32_u64(crc2, crc32c_load(p + 2*CRC32C_SHORT));
+		}
+		crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+	}
+
+	for(; len >= 8; len -= 8, p += 8)
+		crc0 = _mm_crc32_u64(crc0, crc32c_load(p));
+	for(; len; len--)
+		crc0 = _mm_crc32_u8(crc0, *p++);
+
+	return ~(uint32_t)crc0;
+}
+#endif
+
+typedef uint32_t (*crc32c_impl_t)(uint32_t crc, const void *buf, size_t len);
+
+/* Picked on first use, by what the CPU supports */
+static crc32c_impl_t crc32c_impl;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_detect(void) {
+	crc32c_tables();
+	crc32c_impl = crc32c_generic;
+#ifdef CRC32C_X86
+	unsigned int a, b, c, d;
+	if(__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_2)) {
+		crc32c_shift_tables(crc32c_long, CRC32C_LONG);
+		crc32c_shift_tables(crc32c_short, CRC32C_SHORT);
+		crc32c_impl = crc32c_sse42;
+	}
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+	assert(buf || !len);
+
+	pthread_once(&crc32c_once, crc32c_detect);
+	return crc32c_impl(crc, buf, len);
+}
+
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b) {
+	pthread_once(&crc32c_once, crc32c_detect);
+	return crc32c_multmodp(crc32c_zeros(len_b), crc_a) ^ crc_b;
+}
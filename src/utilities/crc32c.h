@@ -0,0 +1,14 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32C (Castagnoli), for checking file blocks in transit. Start from 0,
+ * and feed the result back in to continue a checksum over more data */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* The checksum of a followed by b, given those of a and b and b's length */
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b);
+
+#endif
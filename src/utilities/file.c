@@ -1,40 +1,132 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
 #include "file.h"
 #include "debug.h"
 
-int file_create(const char *path, uint32_t size) {
+/* Allocates the whole file up front, so that writing the blocks can't run
+ * out of space or fragment it. The size is kept, so that it tells how much
+ * has been written if the transfer is cut short */
+static int file_allocate(int fd, uint64_t size) {
+	assert(fd >= 0);
+	assert(size > 0);
+
+	if(fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) && errno != EOPNOTSUPP) {
+		log_err("Couldn't allocate %" PRIu64 " bytes: %s", size, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+int file_create(const char *path, uint64_t size) {
 	assert(path);
+	assert(strlen(path) > 0);
 	assert(size > 0);
 
 	int fd;
 
-	if(!*path) { /* The server passes "" */
-		char name[] = "/tmp/chatserver-XXXXXX";
-		fd = mkstemp(name);
-		unlink(name);
-	} else { /* CLIENT */
-		assert(strlen(path) > 0);
-		/* mmap needs O_RDWR */
-		if((fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0644)) == -1) {
-			/* The client caller file must handle already-existing case */
-			 return -1;
-		}
-	}
+	/* The caller handles the file already existing */
+	if((fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0644)) == -1)
+		return -1;
 
-	/* Stretch the file to the right size */
-	if(lseek(fd, size-1, SEEK_SET) < 0 || write(fd, "", 1) != 1) {
-		log_err("Error stretching '%s': %s", path, strerror(errno));
+	if(file_allocate(fd, size)) {
 		unlink(path);
 		close(fd);
-		goto error;
+		return -1;
+	}
+
+	return fd;
+}
+
+int file_create_temp(char *template, uint64_t size) {
+	assert(template);
+	assert(size > 0);
+
+	int fd;
+
+	if((fd = mkstemp(template)) == -1) {
+		log_err("Couldn't create '%s': %s", template, strerror(errno));
+		return -1;
+	}
+
+	if(file_allocate(fd, size)) {
+		unlink(template);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int file_open_partial(const char *path, uint64_t size, uint64_t *written) {
+	assert(path);
+	assert(size > 0);
+	assert(written);
+
+	int fd;
+	struct stat st;
+
+	if((fd = open(path, O_RDWR)) == -1)
+		return -1;
+
+	if(fstat(fd, &st) || (uint64_t)st.st_size >= size) {
+		close(fd);
+		errno = EEXIST;
+		return -1;
 	}
 
+	*written = st.st_size;
 	return fd;
-error:
-	return -1;
+}
+
+int file_write(int fd, const void *buf, size_t size, off_t offset) {
+	assert(fd >= 0);
+	assert(buf);
+
+	while(size) {
+		ssize_t r = pwrite(fd, buf, size, offset);
+		if(r < 0) {
+			if(errno == EINTR)
+				continue;
+			log_err("Couldn't write to file: %s", strerror(errno));
+			return 1;
+		}
+		buf = (const char *)buf + r;
+		size -= r;
+		offset += r;
+	}
+
+	return 0;
+}
+
+int file_read(int fd, void *buf, size_t size, off_t offset) {
+	assert(fd >= 0);
+	assert(buf);
+
+	while(size) {
+		ssize_t r = pread(fd, buf, size, offset);
+		if(r < 0) {
+			if(errno == EINTR)
+				continue;
+			log_err("Couldn't read from file: %s", strerror(errno));
+			return 1;
+		}
+		if(!r) {
+			log_err("Couldn't read from file: unexpected end of file");
+			return 1;
+		}
+		buf = (char *)buf + r;
+		size -= r;
+		offset += r;
+	}
+
+	return 0;
 }
 
 void *file_map(int fd, int prot, off_t offset, size_t size) {
@@ -5,14 +5,23 @@
 #include <stdint.h>
 #include <sys/mman.h>
 
-/* Used when server/client receives a file: they first create the file
- * of the right size, then mmap chunks in one at a time
+/* Used when a client receives a file: it first creates the file of the
+ * right size, then writes chunks in one at a time. Fails with EEXIST if the
+ * file exists already
  * Returns -1 on error
- *
- * Server use: path='/tmp/', flags = O_TMPFILE
- * Client use: path='outfile', flags = 
  */
-int file_create(const char *path, uint32_t size);
+int file_create(const char *path, uint64_t size);
+/* Same, for a new temporary file named after template, whose last six
+ * characters must be XXXXXX and are replaced to make the name unique */
+int file_create_temp(char *template, uint64_t size);
+/* Reopens a file that file_create() made but which was only partly written,
+ * setting written to its length; fails with EEXIST if it is complete */
+int file_open_partial(const char *path, uint64_t size, uint64_t *written);
+/* Writes a whole chunk at the given offset; returns 0 on success */
+int file_write(int fd, const void *buf, size_t size, off_t offset);
+/* Reads a whole chunk from the given offset; returns 0 on success, and
+ * fails at the end of the file */
+int file_read(int fd, void *buf, size_t size, off_t offset);
 void *file_map(int fd, int prot, off_t offset, size_t size);
 void file_unmap(void *mem, size_t size);
 
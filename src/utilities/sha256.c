@@ -0,0 +1,192 @@
+#include <assert.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86
+#endif
+
+#include "sha256.h"
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_generic(uint32_t state[8], const uint8_t *p, size_t num) {
+	for(; num--; p += 64) {
+		uint32_t w[64];
+
+		for(int i=0; i<16; i++)
+			w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16
+				| (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+		for(int i=16; i<64; i++) {
+			uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3),
+					 s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+				 e = state[4], f = state[5], g = state[6], h = state[7];
+		for(int i=0; i<64; i++) {
+			uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25))
+					+ ((e & f) ^ (~e & g)) + sha256_k[i] + w[i],
+					 t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22))
+					+ ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+#ifdef SHA256_X86
+/* With the SHA extensions: each sha256rnds2 does two rounds, on the state
+ * split into ABEF and CDGH halves */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const uint8_t *p, size_t num) {
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i abef, cdgh, tmp, w[4];
+
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+	cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+	abef = _mm_alignr_epi8(tmp, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+	for(; num--; p += 64) {
+		__m128i abef_in = abef, cdgh_in = cdgh;
+
+		for(int i=0; i<16; i++) {
+			if(i < 4)
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16*i)), bswap);
+			else
+				w[i&3] = _mm_sha256msg2_epu32(_mm_add_epi32(
+							_mm_sha256msg1_epu32(w[i&3], w[(i+1)&3]),
+							_mm_alignr_epi8(w[(i+3)&3], w[(i+2)&3], 4)), w[(i+3)&3]);
+
+			tmp = _mm_add_epi32(w[i&3], _mm_loadu_si128((const __m128i *)&sha256_k[4*i]));
+			cdgh = _mm_sha256rnds2_epu32(cdgh, abef, tmp);
+			abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(tmp, 0x0e));
+		}
+
+		abef = _mm_add_epi32(abef, abef_in);
+		cdgh = _mm_add_epi32(cdgh, cdgh_in);
+	}
+
+	tmp = _mm_shuffle_epi32(abef, 0x1b);
+	cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, cdgh, 0xf0));
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+#endif
+
+typedef void (*sha256_blocks_t)(uint32_t state[8], const uint8_t *p, size_t num);
+
+/* Picked on first use, by what the CPU supports */
+static sha256_blocks_t sha256_impl;
+
+static sha256_blocks_t sha256_detect(void) {
+#ifdef SHA256_X86
+	unsigned int a, b, c, d;
+	if(__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_1)
+			&& __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA))
+		return sha256_blocks_shani;
+#endif
+	return sha256_blocks_generic;
+}
+
+static void sha256_blocks(uint32_t state[8], const uint8_t *p, size_t num) {
+	sha256_blocks_t impl = __atomic_load_n(&sha256_impl, __ATOMIC_RELAXED);
+	if(!impl) {
+		impl = sha256_detect();
+		__atomic_store_n(&sha256_impl, impl, __ATOMIC_RELAXED);
+	}
+	impl(state, p, num);
+}
+
+void sha256_init(sha256_t *ctx) {
+	assert(ctx);
+
+	static const uint32_t h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, h, sizeof(h));
+	ctx->len = 0;
+}
+
+void sha256_update(sha256_t *ctx, const void *data, size_t len) {
+	assert(ctx);
+	assert(data || !len);
+
+	const uint8_t *p = data;
+	size_t used = ctx->len % 64;
+
+	ctx->len += len;
+
+	/* Top up a partial block first, then hash straight from the input */
+	if(used) {
+		size_t n = 64 - used < len ? 64 - used : len;
+		memcpy(ctx->block + used, p, n);
+		p += n;
+		len -= n;
+		if(used + n < 64)
+			return;
+		sha256_blocks(ctx->state, ctx->block, 1);
+	}
+
+	sha256_blocks(ctx->state, p, len / 64);
+	p += len - len % 64;
+	memcpy(ctx->block, p, len % 64);
+}
+
+void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_LEN]) {
+	assert(ctx);
+	assert(digest);
+
+	uint64_t bits = ctx->len * 8;
+	size_t used = ctx->len % 64;
+
+	/* A one bit, zeros up to 56 mod 64, and the length in bits */
+	ctx->block[used++] = 0x80;
+	if(used > 56) {
+		memset(ctx->block + used, 0, 64 - used);
+		sha256_blocks(ctx->state, ctx->block, 1);
+		used = 0;
+	}
+	memset(ctx->block + used, 0, 56 - used);
+	for(int i=0; i<8; i++)
+		ctx->block[56 + i] = bits >> (56 - 8*i);
+	sha256_blocks(ctx->state, ctx->block, 1);
+
+	for(int i=0; i<8; i++) {
+		digest[4*i]   = ctx->state[i] >> 24;
+		digest[4*i+1] = ctx->state[i] >> 16;
+		digest[4*i+2] = ctx->state[i] >> 8;
+		digest[4*i+3] = ctx->state[i];
+	}
+}
+
+void sha256_hex(const uint8_t digest[SHA256_LEN], char hex[2*SHA256_LEN + 1]) {
+	assert(digest);
+	assert(hex);
+
+	static const char digits[] = "0123456789abcdef";
+
+	for(int i=0; i<SHA256_LEN; i++) {
+		hex[2*i]   = digits[digest[i] >> 4];
+		hex[2*i+1] = digits[digest[i] & 15];
+	}
+	hex[2*SHA256_LEN] = '\0';
+}
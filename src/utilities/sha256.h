@@ -0,0 +1,23 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN 32
+
+/* Incremental SHA-256 (FIPS 180-4), for hashing files as they stream in */
+typedef struct _sha256_t {
+	uint32_t state[8];
+	uint64_t len; /* Bytes hashed so far */
+	uint8_t block[64];
+} sha256_t;
+
+void sha256_init(sha256_t *ctx);
+void sha256_update(sha256_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_LEN]);
+
+/* Writes the digest as 2*SHA256_LEN lowercase hex digits and a NUL */
+void sha256_hex(const uint8_t digest[SHA256_LEN], char hex[2*SHA256_LEN + 1]);
+
+#endif